@@ -0,0 +1,156 @@
+#!/bin/bash
+#
+# Runs imap-mh against bench/fakeimap.py and prints messages per second,
+# MB per second and wall time, so that versions can be compared.
+#
+#   bench/bench.sh [download|update|idle|literal|crlf|parse|commit|all]
+#
+# Settings are taken from the environment:
+#   MESSAGES=2000      messages in the generated mailbox
+#   SIZES=2000:50,20000:35,200000:12,2000000:3   message size:weight
+#   LATENCY=20         milliseconds before the server answers a command
+#   RATE=0             bytes per second the server sends, 0 for no limit
+#   CHANGES=300        messages added, expunged and flagged before update
+#   IDLE_ROUNDS=5      new messages timed from arrival to fetch
+#   CRLF_CORPUS=       folder downloaded by imap-mh for the crlf kernels
+#   PARSE_RESPONSES=1000000   FETCH responses and VANISHED uids for parse
+#   COMMIT_DIR=        directory on the filesystem of the folders for commit
+#   IMAP_MH=           binary to measure, built from imap-mh.c if empty
+#   CC=cc
+
+set -e
+
+BENCHDIR=$(cd "$(dirname "$0")" && pwd)
+TOPDIR=$(dirname "$BENCHDIR")
+MESSAGES=${MESSAGES:-2000}
+SIZES=${SIZES:-2000:50,20000:35,200000:12,2000000:3}
+LATENCY=${LATENCY:-20}
+RATE=${RATE:-0}
+CHANGES=${CHANGES:-300}
+IDLE_ROUNDS=${IDLE_ROUNDS:-5}
+CC=${CC:-cc}
+
+WORK=$(mktemp -d /tmp/imap-mh-bench.XXXXXX)
+trap 'rm -rf "$WORK"' EXIT
+
+if [ -z "$IMAP_MH" ]; then
+    IMAP_MH=$WORK/imap-mh
+    $CC -O2 -o "$IMAP_MH" "$TOPDIR/imap-mh.c" -lz -lssl -lcrypto -lpthread
+fi
+
+FAKEIMAP="python3 $BENCHDIR/fakeimap.py"
+STATE=$WORK/mailbox.json
+FOLDER=$WORK/inbox
+
+serve() {
+    $FAKEIMAP serve "$STATE" --latency "$LATENCY" --rate "$RATE" -- "$IMAP_MH" "$@"
+}
+
+setup_folder() {
+    rm -rf "$FOLDER"
+    mkdir "$FOLDER"
+    echo user > "$FOLDER/.username"
+    echo password > "$FOLDER/.password"
+    echo INBOX > "$FOLDER/.mailbox"
+    echo quiet > "$FOLDER/.loglevel"
+    echo "$WORK/metrics.json" > "$FOLDER/.metrics"
+}
+
+# Prints one line from the metrics of the last run
+report() {
+    python3 - "$1" "$2" "$WORK/metrics.json" <<'EOF'
+import json, sys
+name, seconds, path = sys.argv[1], int(sys.argv[2]) / 1000.0, sys.argv[3]
+m = json.load(open(path))
+messages = m['messages_written']
+mb = m['literal_bytes'] / 1e6
+print('%-8s %6d messages %8.1f MB %7.2f s wall %8.1f msg/s %7.1f MB/s' % (name, messages, mb, seconds, messages / seconds, mb / seconds))
+EOF
+}
+
+now_ms() {
+    echo $(( $(date +%s%N) / 1000000 ))
+}
+
+bench_download() {
+    $FAKEIMAP generate "$STATE" --messages "$MESSAGES" --sizes "$SIZES"
+    setup_folder
+    local start=$(now_ms)
+    (cd "$FOLDER" && serve download)
+    report download $(( $(now_ms) - start ))
+}
+
+bench_update() {
+    [ -f "$FOLDER/.uidvalidity" ] || bench_download
+    $FAKEIMAP change "$STATE" --add "$CHANGES" --delete "$CHANGES" --flag "$CHANGES" --sizes "$SIZES"
+    local start=$(now_ms)
+    (cd "$FOLDER" && serve update)
+    report update $(( $(now_ms) - start ))
+}
+
+count_messages() {
+    ls -A "$FOLDER" | grep -c '^\.[0-9]*$' || true
+}
+
+bench_idle() {
+    [ -f "$FOLDER/.uidvalidity" ] || bench_download
+    (cd "$FOLDER" && exec $FAKEIMAP serve "$STATE" --latency "$LATENCY" --rate "$RATE" -- "$IMAP_MH" idle-sync) 2>/dev/null &
+    local pid=$!
+    sleep 2
+    local total=0
+    for round in $(seq 1 "$IDLE_ROUNDS"); do
+        local before=$(count_messages)
+        $FAKEIMAP change "$STATE" --add 1 --sizes 2000 --seed "$round"
+        local start=$(now_ms)
+        while [ "$(count_messages)" -le "$before" ]; do
+            sleep 0.005
+        done
+        local ms=$(( $(now_ms) - start ))
+        total=$(( total + ms ))
+        printf 'idle     round %d: new message fetched after %d ms\n' "$round" "$ms"
+    done
+    kill "$pid" 2>/dev/null || true
+    wait "$pid" 2>/dev/null || true
+    printf 'idle     %d rounds, %d ms average from arrival to fetch\n' "$IDLE_ROUNDS" $(( total / IDLE_ROUNDS ))
+}
+
+# Builds and runs one of the benchmarks that include imap-mh.c
+micro() {
+    local name=$1
+    shift
+    $CC -O2 -o "$WORK/$name" "$BENCHDIR/$name.c" -lz -lssl -lcrypto -lpthread
+    "$WORK/$name" "$@"
+}
+
+bench_literal() {
+    echo "literal: receiving 1 MB messages"
+    micro literalbench 200 1048576
+}
+
+bench_crlf() {
+    echo "crlf: CRLF to LF kernels, ${CRLF_CORPUS:-64 MB of generated mail}"
+    micro crlfbench ${CRLF_CORPUS:-64}
+}
+
+bench_parse() {
+    echo "parse: untagged responses through the tokenizer"
+    micro parsebench ${PARSE_RESPONSES:-1000000}
+}
+
+bench_commit() {
+    echo "commit: writing messages into the folder, per file against group commit"
+    micro commitbench "$MESSAGES" 20000 "${COMMIT_DIR:-$WORK}"
+}
+
+echo "imap-mh bench: $MESSAGES messages, sizes $SIZES, latency $LATENCY ms, rate $RATE B/s"
+case "${1:-all}" in
+    download) bench_download ;;
+    update) bench_update ;;
+    idle) bench_idle ;;
+    literal) bench_literal ;;
+    crlf) bench_crlf ;;
+    parse) bench_parse ;;
+    commit) bench_commit ;;
+    all) bench_download; bench_update; bench_idle; bench_literal; bench_crlf; bench_parse; bench_commit ;;
+    *) echo "Usage: $0 [download|update|idle|literal|crlf|parse|commit|all]" >&2; exit 1 ;;
+esac
@@ -0,0 +1,141 @@
+#!/bin/bash
+#
+# Runs download, update, idle-sync and push against bench/fakeimap.py and
+# checks the folder against the mailbox after each, with 'fakeimap.py
+# check'. Also checks that update and idle-sync leave a message added
+# with inc alone until push uploads it, and that a wakeup of idle-sync
+# for flag changes only fetches no message bodies.
+#
+#   bench/check.sh
+#
+#   MESSAGES=200       messages in the generated mailbox
+#   IMAP_MH=           binary to check, built from imap-mh.c if empty
+#   CC=cc
+
+set -e
+
+BENCHDIR=$(cd "$(dirname "$0")" && pwd)
+TOPDIR=$(dirname "$BENCHDIR")
+MESSAGES=${MESSAGES:-200}
+SIZES=2000:50,20000:35,200000:15
+CC=${CC:-cc}
+
+WORK=$(mktemp -d /tmp/imap-mh-check.XXXXXX)
+trap 'rm -rf "$WORK"' EXIT
+
+if [ -z "$IMAP_MH" ]; then
+    IMAP_MH=$WORK/imap-mh
+    $CC -O2 -o "$IMAP_MH" "$TOPDIR/imap-mh.c" -lz -lssl -lcrypto -lpthread
+fi
+
+FAKEIMAP="python3 $BENCHDIR/fakeimap.py"
+STATE=$WORK/mailbox.json
+FOLDER=$WORK/inbox
+LOG=$WORK/commands.log
+FAILED=0
+
+serve() {
+    $FAKEIMAP serve "$STATE" --log "$LOG" -- "$IMAP_MH" "$@"
+}
+
+pass() {
+    printf 'ok      %s\n' "$1"
+}
+
+fail() {
+    printf 'FAILED  %s\n' "$1"
+    FAILED=1
+}
+
+check_folder() {
+    if $FAKEIMAP check "$STATE" "$FOLDER" > "$WORK/check.out"; then
+        pass "$1: $(tail -1 "$WORK/check.out")"
+    else
+        fail "$1"
+        sed 's/^/        /' "$WORK/check.out"
+    fi
+}
+
+# Waits up to 10 seconds for the log to have more than $1 lines matching $2
+wait_for_log() {
+    for i in $(seq 1 1000); do
+        [ "$(grep -c "$2" "$LOG" || true)" -gt "$1" ] && return 0
+        sleep 0.01
+    done
+    return 1
+}
+
+$FAKEIMAP generate "$STATE" --messages "$MESSAGES" --sizes "$SIZES"
+mkdir "$FOLDER"
+echo user > "$FOLDER/.username"
+echo password > "$FOLDER/.password"
+echo INBOX > "$FOLDER/.mailbox"
+echo quiet > "$FOLDER/.loglevel"
+
+(cd "$FOLDER" && serve download)
+check_folder download
+
+$FAKEIMAP change "$STATE" --add 20 --delete 20 --flag 20 --sizes "$SIZES"
+(cd "$FOLDER" && serve update)
+check_folder update
+
+# a message added with inc takes the next free number, update must keep
+# it and number the new messages around it
+INC=$(( $(ls "$FOLDER" | grep -c '^[0-9]*$') + 1 ))
+printf 'From: inc@example.com\nSubject: added with inc\nMessage-ID: <inc@example.com>\n\nnot on the server yet\n' > "$FOLDER/$INC"
+cp "$FOLDER/$INC" "$WORK/inc"
+$FAKEIMAP change "$STATE" --add 5 --sizes "$SIZES" --seed 3
+(cd "$FOLDER" && serve update)
+if [ ! -L "$FOLDER/$INC" ] && cmp -s "$FOLDER/$INC" "$WORK/inc"; then
+    pass "update keeps message $INC added with inc"
+else
+    fail "update keeps message $INC added with inc"
+fi
+check_folder "update around a message added with inc"
+
+(cd "$FOLDER" && exec $FAKEIMAP serve "$STATE" --log "$LOG" -- "$IMAP_MH" idle-sync) 2>/dev/null &
+IDLE=$!
+wait_for_log 0 "idle IDLE\|idle idle" || fail "idle-sync enters IDLE"
+CHANGED=$(grep -c "CHANGEDSINCE" "$LOG" || true)
+BODIES=$(grep -c "RFC822)\|RFC822 \|BODY" "$LOG" || true)
+$FAKEIMAP change "$STATE" --flag 5 --seed 4
+wait_for_log "$CHANGED" "CHANGEDSINCE" || fail "idle-sync wakes up for flag changes"
+sleep 0.5
+if [ "$(grep -c "RFC822)\|RFC822 \|BODY" "$LOG" || true)" -eq "$BODIES" ]; then
+    pass "idle-sync fetches no bodies for flag changes"
+else
+    fail "idle-sync fetches no bodies for flag changes"
+    grep "RFC822\|BODY" "$LOG" | tail -3 | sed 's/^/        /'
+fi
+CHANGED=$(grep -c "CHANGEDSINCE" "$LOG" || true)
+UIDNEXT=$(python3 -c "import json, sys; print(json.load(open(sys.argv[1]))['uidnext'])" "$STATE")
+$FAKEIMAP change "$STATE" --add 3 --sizes "$SIZES" --seed 5
+wait_for_log "$CHANGED" "CHANGEDSINCE" || fail "idle-sync wakes up for new messages"
+wait_for_log "$BODIES" "RFC822)" || fail "idle-sync fetches new messages"
+FIRST=$(grep "RFC822)" "$LOG" | tail -1 | sed 's/.*uid fetch \([0-9]*\).*/\1/')
+if [ "$FIRST" -ge "$UIDNEXT" ]; then
+    pass "idle-sync fetches the bodies of new messages only"
+else
+    fail "idle-sync fetches the bodies of new messages only, from uid $FIRST"
+fi
+sleep 1
+kill "$IDLE" 2>/dev/null || true
+wait "$IDLE" 2>/dev/null || true
+if [ ! -L "$FOLDER/$INC" ] && cmp -s "$FOLDER/$INC" "$WORK/inc"; then
+    pass "idle-sync keeps message $INC added with inc"
+else
+    fail "idle-sync keeps message $INC added with inc"
+fi
+check_folder idle-sync
+
+# rmm of message 1 is pushed as a deletion
+rm "$FOLDER/1"
+(cd "$FOLDER" && serve push)
+if [ -L "$FOLDER/$INC" ]; then
+    pass "push uploads message $INC"
+else
+    fail "push uploads message $INC"
+fi
+check_folder push
+
+exit $FAILED
@@ -0,0 +1,138 @@
+/*
+
+ commitbench - writing downloaded messages into the folder, the open,
+ O_TRUNC and rename() per file used before against O_TMPFILE files that
+ are committed in groups with linkat()
+
+ This file is part of imap-mh, see the GNU General Public License in
+ LICENSE.
+
+ The messages are received from a file of CRLF text with receive_literal()
+ into a scratch directory, so that only the writing and committing are
+ measured. The old path did not sync anything, so it is also shown with
+ an fsync() of the file and the directory per message, which is what it
+ takes to make it as durable as a group commit. The scratch directory
+ should be on the filesystem of the mail folders, /tmp is often tmpfs,
+ where a sync costs nothing.
+
+ cc -O2 -o commitbench bench/commitbench.c -lz -lssl -lcrypto -lpthread
+ ./commitbench [messages] [size] [directory]
+
+ */
+
+#define main imap_mh_main
+#include "../imap-mh.c"
+#undef main
+
+static void make_corpus(int fd, int messages, int size)
+{
+    char *msg = malloc(size);
+    unsigned int seed = 1;
+    for (int i=0; i<size-2; i++) {
+        msg[i] = ((i % 72) == 70) ? '\r' : ((i % 72) == 71) ? '\n' : 'a' + rand_r(&seed) % 26;
+    }
+    msg[size-2] = '\r';
+    msg[size-1] = '\n';
+    for (int i=0; i<messages; i++) {
+        write_all(fd, msg, size);
+    }
+    free(msg);
+}
+
+static void remove_messages(int messages)
+{
+    for (int i=1; i<=messages; i++) {
+        char filename[64];
+        snprintf(filename, sizeof(filename), ".%d", i);
+        unlink(filename);
+    }
+    unlink(".groupcommit");
+    _indexcount = 0;
+}
+
+/* the path from before, optionally with the syncs it lacked */
+static void commit_per_file(int messages, int size, int durable)
+{
+    for (int i=1; i<=messages; i++) {
+        char partname[64];
+        char filename[64];
+        snprintf(partname, sizeof(partname), ".%d.part", i);
+        snprintf(filename, sizeof(filename), ".%d", i);
+        int emailfd = open(partname, O_WRONLY|O_CREAT|O_TRUNC, 0600);
+        if (emailfd < 0) {
+            die("Unable to create file '%s'", partname);
+        }
+        receive_literal(emailfd, size, NULL);
+        if (durable && (fsync(emailfd) != 0)) {
+            die("Unable to fsync '%s'", partname);
+        }
+        close(emailfd);
+        if (rename(partname, filename) != 0) {
+            die("Unable to rename '%s' to '%s'", partname, filename);
+        }
+        if (durable && (fsync(_messagedirfd) != 0)) {
+            die("Unable to fsync directory");
+        }
+    }
+}
+
+static void commit_grouped(int messages, int size, int group)
+{
+    char groupbuf[64];
+    snprintf(groupbuf, sizeof(groupbuf), "%d", group);
+    write_string_to_new_file(groupbuf, ".groupcommit");
+    for (int i=1; i<=messages; i++) {
+        receive_message_file(i, size, 0, 0);
+        finish_message_file(0, 0, 0);
+    }
+    commit_messages();
+}
+
+int main(int argc, char **argv)
+{
+    _loglevel = LOG_QUIET;
+    int messages = (argc > 1) ? atoi(argv[1]) : 1000;
+    int size = (argc > 2) ? atoi(argv[2]) : 20000;
+    char *dir = (argc > 3) ? argv[3] : ".";
+    char path[] = "/tmp/commitbench.XXXXXX";
+    int fd = mkstemp(path);
+    if (fd < 0) {
+        die("Unable to create '%s'", path);
+    }
+    unlink(path);
+    make_corpus(fd, messages, size);
+
+    char scratch[BUFSIZE];
+    snprintf(scratch, sizeof(scratch), "%s/commitbench.XXXXXX", dir);
+    int topfd = open(".", O_RDONLY|O_DIRECTORY);
+    if ((topfd < 0) || !mkdtemp(scratch) || (chdir(scratch) != 0)) {
+        die("Unable to create a directory in '%s'", dir);
+    }
+    printf("%d messages of %d bytes in %s\n", messages, size, scratch);
+
+    static int groups[] = { 1, DEFAULT_GROUP_COMMIT, MAX_GROUP_COMMIT };
+    for (int run=-2; run<3; run++) {
+        lseek(fd, 0, SEEK_SET);
+        _infd = fd;
+        _inpos = _inlen = 0;
+        _messagedirfd = open_current_directory();
+        start_writer("sync");
+        long startus = monotonic_microseconds();
+        char name[64];
+        if (run < 0) {
+            commit_per_file(messages, size, (run == -1));
+            snprintf(name, sizeof(name), "rename per file%s", (run == -1) ? ", fsync" : "");
+        } else {
+            commit_grouped(messages, size, groups[run]);
+            snprintf(name, sizeof(name), "O_TMPFILE, group of %d", groups[run]);
+        }
+        long us = monotonic_microseconds() - startus;
+        printf("%-28s %8.1f ms %8.1f msg/s\n", name, us/1000.0, messages/(us/1e6));
+        close_message_directory();
+        remove_messages(messages);
+    }
+    if ((fchdir(topfd) != 0) || (rmdir(scratch) != 0)) {
+        die("Unable to remove '%s'", scratch);
+    }
+    return 0;
+}
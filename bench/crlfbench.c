@@ -0,0 +1,245 @@
+/*
+
+ crlfbench - the CRLF to LF kernels on text-heavy and base64-heavy mail,
+ and their share of the time spent receiving it
+
+ This file is part of imap-mh, see the GNU General Public License in
+ LICENSE.
+
+ Each corpus is converted in LITBUFSIZE chunks the way receive_literal()
+ does it. The share is the time of the chosen kernel against the time
+ receive_literal() takes for the same bytes from a file to /dev/null,
+ which is everything receiving a message costs apart from the network.
+ Instead of the made up corpora, the messages of a folder downloaded by
+ imap-mh can be used, they are turned back into CRLF first.
+
+ cc -O2 -o crlfbench bench/crlfbench.c -lz -lssl -lcrypto -lpthread
+ ./crlfbench [megabytes | folder]
+
+ */
+
+#define main imap_mh_main
+#include "../imap-mh.c"
+#undef main
+
+static char *_corpus;
+static int _corpuslen;
+static char *_out;
+
+static void add_crlf_text(char *text, int len, int maxlen)
+{
+    for (int i=0; (i<len) && (_corpuslen<maxlen-1); i++) {
+        if ((text[i] == '\n') && (!i || (text[i-1] != '\r'))) {
+            _corpus[_corpuslen++] = '\r';
+        }
+        _corpus[_corpuslen++] = text[i];
+    }
+}
+
+/* Short lines of words, like the plain text part of most mail */
+static void make_text_corpus(int maxlen)
+{
+    static char *words[] = { "the", "quick", "brown", "fox", "jumps", "over", "lazy", "dog", "mail", "server", "Re:", "> " };
+    unsigned int seed = 1;
+    _corpuslen = 0;
+    while (_corpuslen < maxlen-2) {
+        int linelen = rand_r(&seed) % 78;
+        int end = _corpuslen + linelen;
+        while ((_corpuslen < end) && (_corpuslen < maxlen-2)) {
+            char *w = words[rand_r(&seed) % 12];
+            while (*w && (_corpuslen < maxlen-2)) {
+                _corpus[_corpuslen++] = *w++;
+            }
+            _corpus[_corpuslen++] = ' ';
+        }
+        _corpus[_corpuslen++] = '\r';
+        _corpus[_corpuslen++] = '\n';
+    }
+}
+
+/* 76 character lines of base64, like attachments */
+static void make_base64_corpus(int maxlen)
+{
+    static char *alphabet = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    unsigned int seed = 2;
+    _corpuslen = 0;
+    while (_corpuslen < maxlen-78) {
+        for (int i=0; i<76; i++) {
+            _corpus[_corpuslen++] = alphabet[rand_r(&seed) % 64];
+        }
+        _corpus[_corpuslen++] = '\r';
+        _corpus[_corpuslen++] = '\n';
+    }
+}
+
+/* The '.UID' files of an imap-mh folder */
+static void read_folder_corpus(char *path, int maxlen)
+{
+    DIR *dir = opendir(path);
+    if (!dir) {
+        die("Unable to open '%s'", path);
+    }
+    _corpuslen = 0;
+    static char buf[LITBUFSIZE];
+    for(;;) {
+        struct dirent *ent = readdir(dir);
+        if (!ent || (_corpuslen >= maxlen-1)) {
+            break;
+        }
+        if (!is_filename_uid(ent->d_name)) {
+            continue;
+        }
+        char filename[BUFSIZE*2];
+        snprintf(filename, sizeof(filename), "%s/%s", path, ent->d_name);
+        int fd = open(filename, O_RDONLY);
+        if (fd < 0) {
+            die("Unable to open '%s'", filename);
+        }
+        for(;;) {
+            int n = read(fd, buf, sizeof(buf));
+            if (n <= 0) {
+                break;
+            }
+            add_crlf_text(buf, n, maxlen);
+        }
+        close(fd);
+    }
+    closedir(dir);
+}
+
+static long time_kernel(char *(*kernel)(char *, char *, char *, int *))
+{
+    long best = 0;
+    for (int pass=0; pass<3; pass++) {
+        long startus = monotonic_microseconds();
+        int pending_cr = 0;
+        for (int pos=0; pos<_corpuslen; pos+=LITBUFSIZE) {
+            int n = (_corpuslen - pos < LITBUFSIZE) ? _corpuslen - pos : LITBUFSIZE;
+            kernel(_out+pos, _corpus+pos, _corpus+pos+n, &pending_cr);
+        }
+        long us = monotonic_microseconds() - startus;
+        if (!pass || (us < best)) {
+            best = us;
+        }
+    }
+    return best;
+}
+
+static long time_receive(int fd)
+{
+    long best = 0;
+    int outfd = open("/dev/null", O_WRONLY);
+    start_writer("sync");
+    for (int pass=0; pass<3; pass++) {
+        lseek(fd, 0, SEEK_SET);
+        _infd = fd;
+        _inpos = _inlen = 0;
+        long startus = monotonic_microseconds();
+        receive_literal(outfd, _corpuslen, NULL);
+        writer_wait(1);
+        long us = monotonic_microseconds() - startus;
+        if (!pass || (us < best)) {
+            best = us;
+        }
+    }
+    stop_writer();
+    close(outfd);
+    return best;
+}
+
+static void run_corpus(char *name)
+{
+    static struct {
+        char *name;
+        char *(*kernel)(char *, char *, char *, int *);
+    } kernels[] = {
+        { "scalar", normalize_crlf_scalar },
+#if defined(__SSE2__)
+        { "sse2", normalize_crlf_sse2 },
+#endif
+#if defined(__x86_64__) && defined(__GNUC__)
+        { "avx2", normalize_crlf_avx2 },
+#endif
+    };
+    int numkernels = sizeof(kernels)/sizeof(kernels[0]);
+    double mb = _corpuslen/1e6;
+    int crlfs = 0;
+    for (int i=1; i<_corpuslen; i++) {
+        crlfs += (_corpus[i] == '\n') && (_corpus[i-1] == '\r');
+    }
+    printf("%s: %.1f MB, %.1f bytes per line\n", name, mb, crlfs ? (double)_corpuslen/crlfs : 0.0);
+
+    int pending_cr = 0;
+    int expected = normalize_crlf_scalar(_out, _corpus, _corpus+_corpuslen, &pending_cr) - _out;
+    for (int k=0; k<numkernels; k++) {
+#if defined(__x86_64__) && defined(__GNUC__)
+        if (!strcmp(kernels[k].name, "avx2") && !__builtin_cpu_supports("avx2")) {
+            continue;
+        }
+#endif
+        long us = time_kernel(kernels[k].kernel);
+        pending_cr = 0;
+        char *p = _out;
+        for (int pos=0; pos<_corpuslen; pos+=LITBUFSIZE) {
+            int n = (_corpuslen - pos < LITBUFSIZE) ? _corpuslen - pos : LITBUFSIZE;
+            p = kernels[k].kernel(p, _corpus+pos, _corpus+pos+n, &pending_cr);
+        }
+        int len = p - _out;
+        printf("  %-8s %8.1f MB/s%s\n", kernels[k].name, mb/(us/1e6), (len == expected) ? "" : "  WRONG LENGTH");
+    }
+
+    char path[] = "/tmp/crlfbench.XXXXXX";
+    int fd = mkstemp(path);
+    if (fd < 0) {
+        die("Unable to create '%s'", path);
+    }
+    unlink(path);
+    write_all(fd, _corpus, _corpuslen);
+    long receiveus = time_receive(fd);
+    close(fd);
+    /* the kernel normalize_crlf() picked, into one buffer as receive_literal() does */
+    long kernelus = 0;
+    for (int pass=0; pass<3; pass++) {
+        long startus = monotonic_microseconds();
+        pending_cr = 0;
+        for (int pos=0; pos<_corpuslen; pos+=LITBUFSIZE) {
+            int n = (_corpuslen - pos < LITBUFSIZE) ? _corpuslen - pos : LITBUFSIZE;
+            normalize_crlf(_out, _corpus+pos, n, &pending_cr);
+        }
+        long us = monotonic_microseconds() - startus;
+        if (!pass || (us < kernelus)) {
+            kernelus = us;
+        }
+    }
+    printf("  receive_literal %.1f MB/s, the kernel is %.0f%% of it\n", mb/(receiveus/1e6), 100.0*kernelus/receiveus);
+}
+
+int main(int argc, char **argv)
+{
+    _loglevel = LOG_QUIET;
+    int maxlen = 64*1000*1000;
+    char *folder = NULL;
+    if (argc > 1) {
+        if (strspn(argv[1], DIGITCHARS) == strlen(argv[1])) {
+            maxlen = atoi(argv[1])*1000*1000;
+        } else {
+            folder = argv[1];
+            maxlen = 256*1000*1000;
+        }
+    }
+    _corpus = malloc(maxlen);
+    _out = malloc(maxlen);
+    if (!_corpus || !_out) {
+        die("Out of memory");
+    }
+    if (folder) {
+        read_folder_corpus(folder, maxlen);
+        run_corpus(folder);
+        return 0;
+    }
+    make_text_corpus(maxlen);
+    run_corpus("text");
+    make_base64_corpus(maxlen);
+    run_corpus("base64");
+    return 0;
+}
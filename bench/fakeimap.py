@@ -0,0 +1,604 @@
+#!/usr/bin/env python3
+#
+# fakeimap.py - a local stand-in IMAP server for measuring imap-mh
+#
+# This file is part of imap-mh, see the GNU General Public License in
+# LICENSE.
+#
+# The mailbox is kept in a JSON state file with the uid, size, flags,
+# modseq and INTERNALDATE of every message. Message bodies are made up
+# from the uid when they are fetched, so large mailboxes stay small on
+# disk. Appended messages are stored with their body.
+#
+#   fakeimap.py generate STATE --messages 2000 --sizes 2000:50,20000:35,200000:12,2000000:3
+#   fakeimap.py change STATE --add 10 --delete 10 --flag 10
+#   fakeimap.py serve STATE --latency 20 --rate 10000000 -- /path/to/imap-mh download
+#   fakeimap.py check STATE /path/to/folder
+#
+# serve runs the command with its stdin and stdout connected to the
+# server, like socat system:, or talks on its own stdin and stdout when
+# no command is given. Every response is held back until --latency
+# milliseconds after the command that caused it was received, without
+# holding up the commands behind it, and --rate limits the bytes per
+# second sent. CAPABILITY, LOGIN, COMPRESS, ENABLE, SELECT and EXAMINE
+# with QRESYNC, STATUS, UID FETCH with CHANGEDSINCE and VANISHED, UID
+# STORE, EXPUNGE, UID EXPUNGE, APPEND, IDLE, UNSELECT, CLOSE, NOOP and
+# LOGOUT are understood.
+#
+# check compares a folder with the mailbox: every message has a '.UID'
+# file with its body in LF form and one number, the numbers follow the
+# uids, and .mh_sequences matches the flags. Numbers held by plain files
+# are waiting for push and are only counted.
+
+import argparse
+import base64
+import json
+import os
+import queue
+import random
+import re
+import select
+import subprocess
+import sys
+import threading
+import time
+import zlib
+
+DEFAULT_CAPS = 'IMAP4rev1 LITERAL+ MULTIAPPEND UIDPLUS UNSELECT IDLE ENABLE CONDSTORE QRESYNC COMPRESS=DEFLATE'
+MONTHS = ['Jan', 'Feb', 'Mar', 'Apr', 'May', 'Jun', 'Jul', 'Aug', 'Sep', 'Oct', 'Nov', 'Dec']
+BLOCKSIZE = 4*1024*1024
+
+
+def load_state(path):
+    with open(path) as f:
+        return json.load(f)
+
+
+def save_state(path, st):
+    with open(path + '.tmp', 'w') as f:
+        json.dump(st, f)
+    os.rename(path + '.tmp', path)
+
+
+def format_internaldate(t):
+    tm = time.gmtime(t)
+    return '%02d-%s-%04d %02d:%02d:%02d +0000' % (tm.tm_mday, MONTHS[tm.tm_mon-1], tm.tm_year, tm.tm_hour, tm.tm_min, tm.tm_sec)
+
+
+def parse_sizes(s):
+    sizes = []
+    for part in s.split(','):
+        size, _, weight = part.partition(':')
+        sizes.append((int(size), int(weight or 1)))
+    return sizes
+
+
+def new_message(st, rnd, sizes, t):
+    st['modseq'] += 1
+    m = {
+        'uid': st['uidnext'],
+        'size': rnd.choices([s for s, w in sizes], [w for s, w in sizes])[0],
+        'flags': ['\\Seen'] if rnd.random() < 0.8 else [],
+        'modseq': st['modseq'],
+        'internaldate': format_internaldate(t),
+    }
+    st['uidnext'] += 1
+    st['messages'].append(m)
+    return m
+
+
+class Bodies:
+    """Makes up message bodies of the requested size from a block of plain
+    text and a block of base64, one message in three is base64"""
+
+    def __init__(self):
+        rnd = random.Random(1)
+        words = ('the quick brown fox jumps over the lazy dog while mail '
+                 'arrives from the server in batches of many messages').split()
+        text = ' '.join(rnd.choices(words, k=BLOCKSIZE//5))
+        self.text = b'\r\n'.join(text[i:i+72].encode() for i in range(0, BLOCKSIZE, 72)) + b'\r\n'
+        raw = base64.encodebytes(rnd.randbytes(BLOCKSIZE*3//4))
+        self.b64 = raw.replace(b'\n', b'\r\n')
+
+    def body(self, st, m):
+        if 'body' in m:
+            return m['body'].encode('latin-1')
+        uid = m['uid']
+        header = ('From: sender%d@example.com\r\n'
+                  'To: bench@example.com\r\n'
+                  'Subject: message %d\r\n'
+                  'Message-ID: <%d.%d@bench.example.com>\r\n'
+                  'MIME-Version: 1.0\r\n'
+                  '\r\n' % (uid % 97, uid, uid, st['uidvalidity'])).encode()
+        need = max(m['size'] - len(header) - 2, 0)
+        block = self.b64 if uid % 3 == 0 else self.text
+        while len(block) < need:
+            block = block + block
+        off = (uid * 7919) % (len(block) - need + 1)
+        return header + block[off:off+need] + b'\r\n'
+
+
+def generate(args):
+    rnd = random.Random(args.seed)
+    st = {'uidvalidity': args.uidvalidity, 'uidnext': 1, 'modseq': 1, 'messages': [], 'expunged': []}
+    sizes = parse_sizes(args.sizes)
+    start = time.time() - args.messages * 600
+    for i in range(args.messages):
+        new_message(st, rnd, sizes, start + i * 600)
+    save_state(args.state, st)
+
+
+def change(args):
+    rnd = random.Random(args.seed)
+    st = load_state(args.state)
+    sizes = parse_sizes(args.sizes)
+    for i in range(args.add):
+        new_message(st, rnd, sizes, time.time())
+    if args.delete:
+        st['modseq'] += 1
+        gone = set(m['uid'] for m in rnd.sample(st['messages'], min(args.delete, len(st['messages']))))
+        st['messages'] = [m for m in st['messages'] if m['uid'] not in gone]
+        st['expunged'] += [{'uid': uid, 'modseq': st['modseq']} for uid in sorted(gone)]
+    for m in rnd.sample(st['messages'], min(args.flag, len(st['messages']))):
+        st['modseq'] += 1
+        m['flags'] = [] if '\\Seen' in m['flags'] else ['\\Seen']
+        m['modseq'] = st['modseq']
+    save_state(args.state, st)
+
+
+class Connection:
+    """Reads commands as they arrive and sends every response through a
+    writer thread that holds it until its release time"""
+
+    def __init__(self, rfd, wfd, latency, rate):
+        self.rfd = rfd
+        self.wfd = wfd
+        self.latency = latency
+        self.rate = rate
+        self.rbuf = b''
+        self.inflate = None
+        self.deflate = None
+        self.received = 0
+        self.queue = queue.Queue()
+        self.writer = threading.Thread(target=self.write_loop, daemon=True)
+        self.writer.start()
+
+    def fill(self):
+        data = os.read(self.rfd, 65536)
+        if not data:
+            raise EOFError
+        if self.inflate:
+            data = self.inflate.decompress(data)
+        self.rbuf += data
+
+    def readline(self):
+        while b'\n' not in self.rbuf:
+            self.fill()
+        i = self.rbuf.index(b'\n') + 1
+        line, self.rbuf = self.rbuf[:i], self.rbuf[i:]
+        self.received = time.monotonic()
+        return line
+
+    def read(self, n):
+        while len(self.rbuf) < n:
+            self.fill()
+        data, self.rbuf = self.rbuf[:n], self.rbuf[n:]
+        return data
+
+    def has_input(self, timeout):
+        if self.rbuf:
+            return True
+        r, _, _ = select.select([self.rfd], [], [], timeout)
+        return bool(r)
+
+    def send(self, data):
+        if isinstance(data, str):
+            data = data.encode()
+        self.queue.put((self.received + self.latency, data))
+
+    def start_compression(self):
+        self.queue.put((self.received + self.latency, None))
+        self.inflate = zlib.decompressobj(-15)
+        self.rbuf = self.inflate.decompress(self.rbuf)
+
+    def finish(self):
+        self.queue.put((0, b''))
+        self.writer.join()
+
+    def write_loop(self):
+        busy = time.monotonic()
+        for release, data in iter(self.queue.get, (0, b'')):
+            if data is None:
+                self.deflate = zlib.compressobj(-1, zlib.DEFLATED, -15)
+                continue
+            now = time.monotonic()
+            if release > now:
+                time.sleep(release - now)
+            if self.deflate:
+                data = self.deflate.compress(data) + self.deflate.flush(zlib.Z_SYNC_FLUSH)
+            if self.rate:
+                busy = max(busy, time.monotonic()) + len(data) / self.rate
+                delay = busy - time.monotonic()
+                if delay > 0:
+                    time.sleep(delay)
+            try:
+                os.write(self.wfd, data)
+            except OSError:
+                return
+
+
+def parse_uid_set(s, maxuid):
+    ranges = []
+    for part in s.split(','):
+        first, _, last = part.partition(':')
+        first = maxuid if first == '*' else int(first)
+        last = first if not last else maxuid if last == '*' else int(last)
+        ranges.append((min(first, last), max(first, last)))
+    return ranges
+
+
+def in_uid_set(uid, ranges):
+    return any(first <= uid <= last for first, last in ranges)
+
+
+def format_uid_set(uids):
+    uids = sorted(uids)
+    parts = []
+    i = 0
+    while i < len(uids):
+        j = i
+        while j+1 < len(uids) and uids[j+1] == uids[j]+1:
+            j += 1
+        parts.append(str(uids[i]) if i == j else '%d:%d' % (uids[i], uids[j]))
+        i = j+1
+    return ','.join(parts)
+
+
+def split_items(s):
+    """Splits a parenthesized list into its items, keeping [..] and (..)
+    inside an item together"""
+    items = []
+    depth = 0
+    cur = ''
+    for c in s:
+        if c in '[(':
+            depth += 1
+        elif c in '])':
+            depth -= 1
+        if c == ' ' and not depth:
+            if cur:
+                items.append(cur)
+            cur = ''
+            continue
+        cur += c
+    if cur:
+        items.append(cur)
+    return items
+
+
+def fetch_response(bodies, st, seq, m, items):
+    out = b'* %d FETCH (' % seq
+    first = True
+    for item in items:
+        u = item.upper()
+        part = None
+        literal = None
+        if u == 'UID':
+            part = 'UID %d' % m['uid']
+        elif u == 'FLAGS':
+            part = 'FLAGS (%s)' % ' '.join(m['flags'])
+        elif u == 'MODSEQ':
+            part = 'MODSEQ (%d)' % m['modseq']
+        elif u == 'RFC822.SIZE':
+            part = 'RFC822.SIZE %d' % len(bodies.body(st, m))
+        elif u == 'INTERNALDATE':
+            part = 'INTERNALDATE "%s"' % m['internaldate']
+        elif u in ('RFC822', 'BODY[]', 'BODY.PEEK[]'):
+            literal = bodies.body(st, m)
+            part = '%s {%d}\r\n' % ('RFC822' if u == 'RFC822' else 'BODY[]', len(literal))
+        elif u in ('RFC822.HEADER', 'BODY[HEADER]', 'BODY.PEEK[HEADER]'):
+            body = bodies.body(st, m)
+            literal = body[:body.find(b'\r\n\r\n')+4]
+            part = '%s {%d}\r\n' % ('RFC822.HEADER' if u == 'RFC822.HEADER' else 'BODY[HEADER]', len(literal))
+        elif u.startswith('BODY[HEADER.FIELDS') or u.startswith('BODY.PEEK[HEADER.FIELDS'):
+            fields = re.search(r'\(([^)]*)\)', u).group(1).split()
+            body = bodies.body(st, m)
+            header = body[:body.find(b'\r\n\r\n')].split(b'\r\n')
+            literal = b''.join(l + b'\r\n' for l in header if l.split(b':')[0].upper().decode() in fields) + b'\r\n'
+            part = 'BODY[HEADER.FIELDS (%s)] {%d}\r\n' % (' '.join(fields), len(literal))
+        if part is None:
+            continue
+        if not first:
+            out += b' '
+        first = False
+        out += part.encode()
+        if literal is not None:
+            out += literal
+    return out + b')\r\n'
+
+
+def serve(args):
+    if args.command:
+        proc = subprocess.Popen(args.command, stdin=subprocess.PIPE, stdout=subprocess.PIPE)
+        conn = Connection(proc.stdout.fileno(), proc.stdin.fileno(), args.latency/1000.0, args.rate)
+    else:
+        proc = None
+        conn = Connection(0, 1, args.latency/1000.0, args.rate)
+    log = open(args.log, 'a') if args.log else None
+    try:
+        serve_connection(conn, args, log)
+    except (EOFError, BrokenPipeError):
+        pass
+    conn.finish()
+    if proc:
+        proc.stdin.close()
+        sys.exit(proc.wait())
+
+
+def serve_connection(conn, args, log):
+    bodies = Bodies()
+    caps = args.caps
+    conn.send('* OK fakeimap ready\r\n')
+    while True:
+        line = conn.readline()
+        if log:
+            log.write('C: %r\n' % line[:200])
+            log.flush()
+        words = line.decode().rstrip('\r\n').split(' ', 2)
+        tag = words[0]
+        cmd = words[1].upper() if len(words) > 1 else ''
+        rest = words[2] if len(words) > 2 else ''
+        if cmd == 'UID':
+            sub, _, rest = rest.partition(' ')
+            cmd = 'UID ' + sub.upper()
+        st = load_state(args.state)
+        maxuid = st['messages'][-1]['uid'] if st['messages'] else 0
+
+        if cmd == 'CAPABILITY':
+            conn.send('* CAPABILITY %s\r\n%s OK done\r\n' % (caps, tag))
+        elif cmd == 'LOGIN':
+            conn.send('%s OK [CAPABILITY %s] logged in\r\n' % (tag, caps))
+        elif cmd == 'COMPRESS':
+            conn.send('%s OK deflate active\r\n' % tag)
+            conn.start_compression()
+        elif cmd == 'ENABLE':
+            conn.send('* ENABLED %s\r\n%s OK enabled\r\n' % (rest, tag))
+        elif cmd == 'LOGOUT':
+            conn.send('* BYE logging out\r\n%s OK bye\r\n' % tag)
+            return
+        elif cmd in ('SELECT', 'EXAMINE'):
+            conn.send('* %d EXISTS\r\n' % len(st['messages']))
+            conn.send('* OK [UIDVALIDITY %d] ok\r\n' % st['uidvalidity'])
+            conn.send('* OK [UIDNEXT %d] ok\r\n' % st['uidnext'])
+            conn.send('* OK [HIGHESTMODSEQ %d] ok\r\n' % st['modseq'])
+            m = re.search(r'\(QRESYNC \((\d+) (\d+)', rest, re.I)
+            if m and int(m.group(1)) == st['uidvalidity']:
+                since = int(m.group(2))
+                vanished = [e['uid'] for e in st['expunged'] if e['modseq'] > since]
+                if vanished:
+                    conn.send('* VANISHED (EARLIER) %s\r\n' % format_uid_set(vanished))
+                for seq, msg in enumerate(st['messages'], 1):
+                    if msg['modseq'] > since:
+                        conn.send('* %d FETCH (UID %d FLAGS (%s) MODSEQ (%d))\r\n' % (seq, msg['uid'], ' '.join(msg['flags']), msg['modseq']))
+            conn.send('%s OK [%s] done\r\n' % (tag, 'READ-ONLY' if cmd == 'EXAMINE' else 'READ-WRITE'))
+        elif cmd == 'STATUS':
+            mailbox = rest.split(' ')[0]
+            conn.send('* STATUS %s (MESSAGES %d UIDNEXT %d UIDVALIDITY %d HIGHESTMODSEQ %d)\r\n%s OK status\r\n'
+                      % (mailbox, len(st['messages']), st['uidnext'], st['uidvalidity'], st['modseq'], tag))
+        elif cmd == 'UID FETCH':
+            uidset, _, rest = rest.partition(' ')
+            ranges = parse_uid_set(uidset, maxuid)
+            if rest.startswith('('):
+                depth = 0
+                for end, c in enumerate(rest):
+                    depth += (c == '(') - (c == ')')
+                    if not depth:
+                        break
+                items = split_items(rest[1:end])
+                modifiers = rest[end+1:]
+            else:
+                items = [rest.split(' ')[0]]
+                modifiers = rest[len(items[0]):]
+            if 'UID' not in [i.upper() for i in items]:
+                items = ['UID'] + items
+            m = re.search(r'CHANGEDSINCE (\d+)', modifiers, re.I)
+            since = int(m.group(1)) if m else None
+            if since is not None:
+                items.append('MODSEQ')
+                if 'VANISHED' in modifiers.upper():
+                    vanished = [e['uid'] for e in st['expunged'] if e['modseq'] > since and in_uid_set(e['uid'], ranges)]
+                    if vanished:
+                        conn.send('* VANISHED (EARLIER) %s\r\n' % format_uid_set(vanished))
+            for seq, msg in enumerate(st['messages'], 1):
+                if not in_uid_set(msg['uid'], ranges):
+                    continue
+                if since is not None and msg['modseq'] <= since:
+                    continue
+                conn.send(fetch_response(bodies, st, seq, msg, items))
+            conn.send('%s OK fetch done\r\n' % tag)
+        elif cmd == 'UID STORE':
+            uidset, op, flags = rest.split(' ', 2)
+            ranges = parse_uid_set(uidset, maxuid)
+            flags = flags.strip('()').split()
+            for msg in st['messages']:
+                if not in_uid_set(msg['uid'], ranges):
+                    continue
+                st['modseq'] += 1
+                if op.startswith('+'):
+                    msg['flags'] = sorted(set(msg['flags']) | set(flags))
+                elif op.startswith('-'):
+                    msg['flags'] = sorted(set(msg['flags']) - set(flags))
+                else:
+                    msg['flags'] = flags
+                msg['modseq'] = st['modseq']
+            save_state(args.state, st)
+            conn.send('%s OK store done\r\n' % tag)
+        elif cmd in ('EXPUNGE', 'UID EXPUNGE', 'CLOSE'):
+            ranges = parse_uid_set(rest, maxuid) if cmd == 'UID EXPUNGE' else [(0, maxuid)]
+            st['modseq'] += 1
+            gone = [m['uid'] for m in st['messages'] if '\\Deleted' in m['flags'] and in_uid_set(m['uid'], ranges)]
+            st['messages'] = [m for m in st['messages'] if m['uid'] not in gone]
+            st['expunged'] += [{'uid': uid, 'modseq': st['modseq']} for uid in gone]
+            save_state(args.state, st)
+            if gone and cmd != 'CLOSE':
+                conn.send('* VANISHED %s\r\n' % format_uid_set(gone))
+            conn.send('%s OK %s done\r\n' % (tag, cmd.lower()))
+        elif cmd == 'APPEND':
+            uids = []
+            cur = rest
+            while True:
+                m = re.search(r'(?:\((?P<flags>[^)]*)\) )?(?:"(?P<date>[^"]*)" )?\{(?P<size>\d+)(?P<plus>\+?)\}$', cur)
+                if not m:
+                    break
+                if not m.group('plus'):
+                    conn.send('+ go ahead\r\n')
+                body = conn.read(int(m.group('size')))
+                st['modseq'] += 1
+                st['messages'].append({
+                    'uid': st['uidnext'],
+                    'size': len(body),
+                    'flags': (m.group('flags') or '').split(),
+                    'modseq': st['modseq'],
+                    'internaldate': m.group('date') or format_internaldate(time.time()),
+                    'body': body.decode('latin-1'),
+                })
+                uids.append(st['uidnext'])
+                st['uidnext'] += 1
+                cur = conn.readline().decode().strip()
+                if not cur:
+                    break
+            save_state(args.state, st)
+            if 'UIDPLUS' in caps.split():
+                conn.send('%s OK [APPENDUID %d %s] append done\r\n' % (tag, st['uidvalidity'], format_uid_set(uids)))
+            else:
+                conn.send('%s OK append done\r\n' % tag)
+        elif cmd == 'IDLE':
+            conn.send('+ idling\r\n')
+            mtime = os.stat(args.state).st_mtime_ns
+            count = len(st['messages'])
+            modseq = st['modseq']
+            while True:
+                if conn.has_input(0.01):
+                    if conn.readline().strip().upper() == b'DONE':
+                        break
+                if os.stat(args.state).st_mtime_ns == mtime:
+                    continue
+                mtime = os.stat(args.state).st_mtime_ns
+                now = load_state(args.state)
+                vanished = [e['uid'] for e in now['expunged'] if e['modseq'] > modseq]
+                if vanished:
+                    conn.send('* VANISHED %s\r\n' % format_uid_set(vanished))
+                if len(now['messages']) != count:
+                    conn.send('* %d EXISTS\r\n' % len(now['messages']))
+                for seq, msg in enumerate(now['messages'], 1):
+                    if msg['modseq'] > modseq and msg['uid'] < st['uidnext']:
+                        conn.send('* %d FETCH (UID %d FLAGS (%s) MODSEQ (%d))\r\n' % (seq, msg['uid'], ' '.join(msg['flags']), msg['modseq']))
+                count = len(now['messages'])
+                modseq = now['modseq']
+            conn.send('%s OK idle done\r\n' % tag)
+        elif cmd in ('UNSELECT', 'NOOP'):
+            conn.send('%s OK %s done\r\n' % (tag, cmd.lower()))
+        else:
+            conn.send('%s BAD unknown command %s\r\n' % (tag, cmd))
+
+
+def check(args):
+    st = load_state(args.state)
+    bodies = Bodies()
+    problems = []
+    uids = {}
+    plain = 0
+    for name in os.listdir(args.folder):
+        path = os.path.join(args.folder, name)
+        if name.isdigit():
+            if not os.path.islink(path):
+                plain += 1
+                continue
+            target = os.readlink(path)
+            if not (target.startswith('.') and target[1:].isdigit()):
+                problems.append('%s points at %s' % (name, target))
+            elif int(target[1:]) in uids:
+                problems.append('%s and %d both point at %s' % (name, uids[int(target[1:])], target))
+            else:
+                uids[int(target[1:])] = int(name)
+    files = set(int(n[1:]) for n in os.listdir(args.folder) if n.startswith('.') and n[1:].isdigit())
+    server = {m['uid']: m for m in st['messages']}
+    for uid in sorted(server):
+        if uid not in files:
+            problems.append('uid %d is missing' % uid)
+            continue
+        with open(os.path.join(args.folder, '.%d' % uid), 'rb') as f:
+            if f.read() != bodies.body(st, server[uid]).replace(b'\r\n', b'\n'):
+                problems.append('uid %d differs' % uid)
+        if uid not in uids:
+            problems.append('uid %d has no number' % uid)
+    for uid in sorted(files - set(server)):
+        problems.append('uid %d is not on the server' % uid)
+    numbers = [uids[uid] for uid in sorted(uids)]
+    if numbers != sorted(numbers):
+        problems.append('the numbers are not in uid order')
+    expected = {'unseen': set(), 'flagged': set(), 'replied': set()}
+    for uid, n in uids.items():
+        flags = server[uid]['flags'] if uid in server else []
+        if '\\Seen' not in flags:
+            expected['unseen'].add(n)
+        if '\\Flagged' in flags:
+            expected['flagged'].add(n)
+        if '\\Answered' in flags:
+            expected['replied'].add(n)
+    found = {name: set() for name in expected}
+    path = os.path.join(args.folder, '.mh_sequences')
+    if os.path.exists(path):
+        for line in open(path):
+            name, _, value = line.partition(':')
+            if name not in found:
+                continue
+            for part in value.split():
+                first, _, last = part.partition('-')
+                found[name].update(n for n in range(int(first), int(last or first)+1) if n in uids.values())
+    for name in expected:
+        if expected[name] != found[name]:
+            problems.append('sequence %s has %d numbers, expected %d' % (name, len(found[name]), len(expected[name])))
+    for p in problems[:20]:
+        print(p)
+    print('check: %d messages, %d plain files, %d problems' % (len(server), plain, len(problems)))
+    sys.exit(1 if problems else 0)
+
+
+def main():
+    parser = argparse.ArgumentParser(description='local stand-in IMAP server for imap-mh')
+    sub = parser.add_subparsers(dest='mode', required=True)
+    p = sub.add_parser('generate', help='create a mailbox')
+    p.add_argument('state')
+    p.add_argument('--messages', type=int, default=1000)
+    p.add_argument('--sizes', default='2000:50,20000:35,200000:12,2000000:3', help='size:weight,...')
+    p.add_argument('--uidvalidity', type=int, default=1)
+    p.add_argument('--seed', type=int, default=1)
+    p = sub.add_parser('change', help='add, expunge and flag messages')
+    p.add_argument('state')
+    p.add_argument('--add', type=int, default=0)
+    p.add_argument('--delete', type=int, default=0)
+    p.add_argument('--flag', type=int, default=0)
+    p.add_argument('--sizes', default='2000:50,20000:35,200000:12,2000000:3')
+    p.add_argument('--seed', type=int, default=2)
+    p = sub.add_parser('serve', help='serve the mailbox to a command or on stdio')
+    p.add_argument('state')
+    p.add_argument('--latency', type=float, default=0, help='milliseconds before each response')
+    p.add_argument('--rate', type=float, default=0, help='bytes per second sent, 0 for no limit')
+    p.add_argument('--caps', default=DEFAULT_CAPS)
+    p.add_argument('--log', help='append the commands received to this file')
+    p = sub.add_parser('check', help='compare a folder with the mailbox')
+    p.add_argument('state')
+    p.add_argument('folder')
+    argv = sys.argv[1:]
+    command = []
+    if '--' in argv:
+        command = argv[argv.index('--')+1:]
+        argv = argv[:argv.index('--')]
+    args = parser.parse_args(argv)
+    args.command = command
+    {'generate': generate, 'change': change, 'serve': serve, 'check': check}[args.mode](args)
+
+
+if __name__ == '__main__':
+    main()
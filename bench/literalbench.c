@@ -0,0 +1,145 @@
+/*
+
+ literalbench - receiving RFC822 literals, the per-line fgets loop that
+ do_fetch() used to run against receive_literal()
+
+ This file is part of imap-mh, see the GNU General Public License in
+ LICENSE.
+
+ The messages are read from a file of CRLF text, one literal after the
+ other, and written to /dev/null, so that only the receiving is measured.
+
+ cc -O2 -o literalbench bench/literalbench.c -lz -lssl -lcrypto -lpthread
+ ./literalbench [messages] [size]
+
+ */
+
+#define main imap_mh_main
+#include "../imap-mh.c"
+#undef main
+
+static void make_corpus(int fd, int messages, int size)
+{
+    static char *words[] = { "the", "quick", "brown", "fox", "jumps", "over", "lazy", "dog", "mail", "server" };
+    char *msg = malloc(size);
+    int pos = 0;
+    unsigned int seed = 1;
+    while (pos < size-2) {
+        int linelen = 20 + rand_r(&seed) % 60;
+        int end = pos + linelen;
+        while ((pos < end) && (pos < size-2)) {
+            char *w = words[rand_r(&seed) % 10];
+            for (int i=0; w[i] && (pos < size-2); i++) {
+                msg[pos++] = w[i];
+            }
+            if (pos < size-2) {
+                msg[pos++] = ' ';
+            }
+        }
+        if (pos < size-2) {
+            msg[pos++] = '\r';
+            msg[pos++] = '\n';
+        }
+    }
+    msg[pos++] = '\r';
+    msg[pos++] = '\n';
+    for (int i=0; i<messages; i++) {
+        write_all(fd, msg, size);
+    }
+    free(msg);
+}
+
+/* the loop from before, one fgets() and fwrite() per line */
+static void receive_fgets(FILE *infp, FILE *outfp, int fetch_size)
+{
+    int fetch_bytes_read = 0;
+    for(;;) {
+        if (fetch_bytes_read == fetch_size) {
+            break;
+        }
+        if (fetch_bytes_read >= fetch_size) {
+            die("Read too many bytes");
+        }
+        if (!fgets(_buf, BUFSIZE, infp)) {
+            die("fgets failed");
+        }
+        int len = strlen(_buf);
+        fetch_bytes_read += len;
+        if (len >= 2) {
+            if (_buf[len-1] == '\n') {
+                if (_buf[len-2] == '\r') {
+                    _buf[len-2] = '\n';
+                    _buf[len-1] = 0;
+                    len--;
+                }
+            }
+        }
+        if (fwrite(_buf, 1, len, outfp) != len) {
+            die("fwrite error");
+        }
+    }
+}
+
+static void report(char *name, long us, int messages, int size)
+{
+    double mb = (double)messages*size/1e6;
+    printf("%-24s %8.1f ms %8.1f MB/s\n", name, us/1000.0, mb/(us/1e6));
+}
+
+int main(int argc, char **argv)
+{
+    _loglevel = LOG_QUIET;
+    int messages = (argc > 1) ? atoi(argv[1]) : 100;
+    int size = (argc > 2) ? atoi(argv[2]) : 1024*1024;
+    char path[] = "/tmp/literalbench.XXXXXX";
+    int fd = mkstemp(path);
+    if (fd < 0) {
+        die("Unable to create '%s'", path);
+    }
+    unlink(path);
+    make_corpus(fd, messages, size);
+    printf("%d messages of %d bytes\n", messages, size);
+
+    /* the first pass of each only warms the page cache */
+    _buf = malloc(BUFSIZE);
+    for (int pass=0; pass<2; pass++) {
+        lseek(fd, 0, SEEK_SET);
+        FILE *infp = fdopen(dup(fd), "r");
+        FILE *outfp = fopen("/dev/null", "w");
+        long startus = monotonic_microseconds();
+        for (int i=0; i<messages; i++) {
+            receive_fgets(infp, outfp, size);
+        }
+        fflush(outfp);
+        long us = monotonic_microseconds() - startus;
+        fclose(infp);
+        fclose(outfp);
+        if (pass) {
+            report("fgets per line", us, messages, size);
+        }
+    }
+
+    static char *writers[] = { "sync", "thread", "io_uring" };
+    int outfd = open("/dev/null", O_WRONLY);
+    for (int w=0; w<3; w++) {
+        for (int pass=0; pass<2; pass++) {
+            lseek(fd, 0, SEEK_SET);
+            _infd = fd;
+            _inpos = _inlen = 0;
+            start_writer(writers[w]);
+            long startus = monotonic_microseconds();
+            for (int i=0; i<messages; i++) {
+                receive_literal(outfd, size, NULL);
+            }
+            writer_wait(1);
+            long us = monotonic_microseconds() - startus;
+            if (pass) {
+                char name[64];
+                snprintf(name, sizeof(name), "receive_literal %s", _writernames[_writerbackend]);
+                report(name, us, messages, size);
+            }
+            stop_writer();
+        }
+    }
+    return 0;
+}
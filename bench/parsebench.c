@@ -0,0 +1,169 @@
+/*
+
+ parsebench - parsing untagged responses with the tokenizer: the sizes
+ that schedule_fetch() orders by, the flag changes of a QRESYNC select
+ and a VANISHED (EARLIER) line longer than the input buffer
+
+ This file is part of imap-mh, see the GNU General Public License in
+ LICENSE.
+
+ The responses are read with read_line() from a file, so the time
+ includes finding the line ends. The sizes are also parsed with the
+ strstr() lookups schedule_fetch() used before.
+
+ cc -O2 -o parsebench bench/parsebench.c -lz -lssl -lcrypto -lpthread
+ ./parsebench [responses]
+
+ */
+
+#define main imap_mh_main
+#include "../imap-mh.c"
+#undef main
+
+static int _corpusfd;
+static long _corpusbytes;
+
+static void start_corpus()
+{
+    char path[] = "/tmp/parsebench.XXXXXX";
+    _corpusfd = mkstemp(path);
+    if (_corpusfd < 0) {
+        die("Unable to create '%s'", path);
+    }
+    unlink(path);
+    _corpusbytes = 0;
+}
+
+static void add_corpus(char *fmt, ...)
+{
+    char line[BUFSIZE];
+    va_list args;
+    va_start(args, fmt);
+    int len = vsnprintf(line, sizeof(line), fmt, args);
+    va_end(args);
+    write_all(_corpusfd, line, len);
+    _corpusbytes += len;
+}
+
+static void rewind_corpus()
+{
+    lseek(_corpusfd, 0, SEEK_SET);
+    reset_input();
+    _infd = _corpusfd;
+}
+
+static void make_sizes_corpus(int responses)
+{
+    unsigned int seed = 1;
+    start_corpus();
+    for (int i=1; i<=responses; i++) {
+        add_corpus("* %d FETCH (UID %d RFC822.SIZE %d INTERNALDATE \"%02d-Oct-2026 %02d:%02d:%02d +0000\")\r\n", i, i, 1000 + rand_r(&seed) % 200000, 1 + i % 28, i % 24, i % 60, i % 60);
+    }
+}
+
+static void make_flags_corpus(int responses)
+{
+    static char *flags[] = { "", "\\Seen", "\\Seen \\Answered", "\\Flagged \\Seen", "\\Seen $Junk NonJunk" };
+    unsigned int seed = 2;
+    start_corpus();
+    for (int i=1; i<=responses; i++) {
+        add_corpus("* %d FETCH (UID %d FLAGS (%s) MODSEQ (%d))\r\n", i, i, flags[rand_r(&seed) % 5], 100000 + i);
+    }
+}
+
+/* Every other uid, so that each one is a range of its own */
+static void make_vanished_corpus(int responses)
+{
+    start_corpus();
+    add_corpus("* VANISHED (EARLIER) 1");
+    for (int i=1; i<responses; i++) {
+        add_corpus(",%d", 1 + 2*i);
+    }
+    add_corpus("\r\n");
+}
+
+/* the parsing from before, strstr() for each item */
+static unsigned long parse_sizes_strstr()
+{
+    char *p = strstr(_buf, " FETCH ");
+    if (!p) {
+        return 0;
+    }
+    char *uid_p = strstr(p, "UID ");
+    char *size_p = strstr(p, "RFC822.SIZE ");
+    if (!uid_p || !size_p) {
+        return 0;
+    }
+    char *date_p = strstr(p, "INTERNALDATE \"");
+    time_t internaldate = date_p ? parse_internaldate(date_p+14) : 0;
+    return strtoul(uid_p+4, NULL, 10) + strtoul(size_p+12, NULL, 10) + internaldate;
+}
+
+static unsigned long parse_tokens()
+{
+    struct fetch_items items;
+    if (!parse_fetch_response(&items)) {
+        return 0;
+    }
+    return items.uid + items.rfc822size + items.internaldate + (items.flags > 0 ? items.flags : 0) + items.modseq;
+}
+
+static void time_lines(char *name, int responses, unsigned long (*parse)())
+{
+    long best = 0;
+    unsigned long check = 0;
+    for (int pass=0; pass<3; pass++) {
+        rewind_corpus();
+        check = 0;
+        long startus = monotonic_microseconds();
+        for (int i=0; i<responses; i++) {
+            read_line();
+            check += parse();
+        }
+        long us = monotonic_microseconds() - startus;
+        if (!pass || (us < best)) {
+            best = us;
+        }
+    }
+    printf("  %-20s %8.2f M responses/s %8.1f MB/s  (%lu)\n", name, responses/(double)best, _corpusbytes/(double)best, check);
+}
+
+static void time_vanished()
+{
+    long best = 0;
+    for (int pass=0; pass<3; pass++) {
+        rewind_corpus();
+        uid_set_clear(&_vanishedset);
+        long startus = monotonic_microseconds();
+        read_line();
+        receive_vanished_response(&_vanishedset);
+        long us = monotonic_microseconds() - startus;
+        if (!pass || (us < best)) {
+            best = us;
+        }
+    }
+    printf("  %-20s %8.2f M uids/s %8.1f MB/s  (%d ranges)\n", "tokenizer", _vanishedset.count/(double)best, _corpusbytes/(double)best, _vanishedset.count);
+}
+
+int main(int argc, char **argv)
+{
+    _loglevel = LOG_QUIET;
+    int responses = (argc > 1) ? atoi(argv[1]) : 1000000;
+
+    make_sizes_corpus(responses);
+    printf("sizes: %d responses, %.1f MB\n", responses, _corpusbytes/1e6);
+    time_lines("strstr", responses, parse_sizes_strstr);
+    time_lines("tokenizer", responses, parse_tokens);
+    close(_corpusfd);
+
+    make_flags_corpus(responses);
+    printf("flags: %d responses, %.1f MB\n", responses, _corpusbytes/1e6);
+    time_lines("tokenizer", responses, parse_tokens);
+    close(_corpusfd);
+
+    make_vanished_corpus(responses);
+    printf("vanished: one line of %d uids, %.1f MB\n", responses, _corpusbytes/1e6);
+    time_vanished();
+    close(_corpusfd);
+    return 0;
+}
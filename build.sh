@@ -1,5 +1,5 @@
 #!/bin/bash
 
 set -x
-clang -o imap-mh imap-mh.c
+clang -o imap-mh imap-mh.c -lz -lssl -lcrypto -lpthread
 
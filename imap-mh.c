@@ -23,23 +23,213 @@
 
  */
 
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdarg.h>
 #include <string.h>
+#include <strings.h>
+#include <stdint.h>
+#include <errno.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <unistd.h>
 #include <dirent.h>
 #include <fcntl.h>
 #include <termios.h>
+#include <time.h>
+#include <signal.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <poll.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#endif
+#include <zlib.h>
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#include <openssl/evp.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
 
 #define DIGITCHARS "1234567890"
 
 #define BUFSIZE 1024
+#define INBUFSIZE (1024*1024)
+#define LITBUFSIZE 262144
+#define SENDBUFSIZE 65536
+#define ZBUFSIZE 65536
+#define ZARENASIZE (512*1024)
+
+#define MAX_MESSAGES 1048576
+/* The ranges of a set of uids are separated by uids of messages that are
+   not in it, so there can be at most one more range than messages */
+#define MAX_UID_RANGES (MAX_MESSAGES+1)
+#define FETCH_BATCH_UIDS 256
+#define DEFAULT_FETCH_WINDOW 4
+#define MAX_FETCH_WINDOW 64
+#define FETCH_BATCH_BYTES (8*1024*1024)
+#define LARGE_MESSAGE_SIZE (1024*1024)
+#define FIRST_MESSAGES_METRIC 50
+#define MAX_UID 4294967295UL
+#define DEFAULT_GROUP_COMMIT 64
+#define MAX_GROUP_COMMIT 256
+#define GROUP_COMMIT_MILLISECONDS 1000
+#define DEFAULT_PACK_DAYS 365
 
-static char _buf[BUFSIZE];
-static FILE *_infp;
+static char *_buf = ""; /* the current response line, in place in _inbuf */
+static int _infd;
+static char _inbuf[INBUFSIZE+1];
+static int _inpos;
+static int _inlen;
+static int _lineend = -1;
+static char _lineendchar;
+static char _litbuf[LITBUFSIZE+1];
 static FILE *_outfp;
+static SSL *_ssl; /* set when connected with tls:host:port instead of stdio */
+static char _sendbuf[SENDBUFSIZE];
+
+static int _compressing;
+static z_stream _zin;
+static z_stream _zout;
+static char _zinbuf[ZBUFSIZE];
+static char _zoutbuf[ZBUFSIZE];
+
+struct uid_range {
+    unsigned long first;
+    unsigned long last;
+};
+
+/* Sorted, non-overlapping, non-adjacent ranges of uids */
+struct uid_set {
+    int count;
+    int capacity;
+    struct uid_range *ranges;
+};
+
+static struct uid_set _fetchset;
+static struct uid_set _vanishedset;
+static struct uid_set _batchset;
+
+/* Messages to be fetched, in the order they are requested */
+struct fetch_entry {
+    unsigned long uid;
+    unsigned long size;
+    time_t internaldate;
+};
+
+static struct fetch_entry *_fetchorder;
+static int _fetchordercount;
+static int _fetchordercapacity;
+static long _fetchstartms;
+static int _fetchcommitted;
+
+#define INDEX_MAGIC "IMAPMHI3"
+#define PACK_MAGIC "IMAPMHP1"
+
+/* The .index file lists the local messages sorted by uid, so that update
+   does not need to walk the directory or stat every message. It is
+   marked dirty before the directory is changed and rewritten clean
+   afterwards, a dirty index is rebuilt from the directory. */
+struct index_header {
+    char magic[8];
+    uint64_t count;
+    uint64_t maxmsgnum;
+    uint64_t clean;
+};
+
+struct index_record {
+    uint64_t uid;
+    uint64_t size;
+    int64_t internaldate;
+    uint64_t msgnum;
+    uint64_t flags;
+    unsigned char hash[32]; /* SHA-256 if the file is in .store, otherwise zero */
+};
+
+static struct index_record *_index;
+static int _indexcount;
+static int _indexcapacity;
+static int _indexmaxmsgnum;
+static int _indexloaded;
+
+#define DEFAULT_DOWNLOAD_SHARDS 4
+#define MAX_DOWNLOAD_SHARDS 16
+#define DOWNLOAD_CHUNK_UIDS 500
+
+/* Each shard of a parallel download owns the uids from next up to but not
+   including end. The state is shared between the worker processes. */
+struct download_shard {
+    unsigned long next;
+    unsigned long end;
+};
+
+struct download_state {
+    volatile int lock;
+    int numshards;
+    struct download_shard shards[MAX_DOWNLOAD_SHARDS];
+};
+
+static struct download_state *_download;
+static struct uid_set _claimedset;
+
+#define IDLE_REISSUE_SECONDS (25*60)
+#define IDLE_COALESCE_MILLISECONDS 250
+
+#define MAX_FOLDERS 256
+#define DEFAULT_SYNC_CONNECTIONS 2
+#define MAX_SYNC_CONNECTIONS 16
+
+struct sync_folder {
+    char directory[BUFSIZE];
+    char mailbox[BUFSIZE];
+    unsigned long highestmodseq;
+    int needs_download;
+    int changed;
+};
+
+static struct sync_folder _folders[MAX_FOLDERS];
+static int _numfolders;
+static int _schedule[MAX_FOLDERS];
+
+/* Shared between the sync worker processes */
+struct sync_state {
+    volatile int nextfolder;
+    volatile int failed[MAX_FOLDERS];
+};
+
+static struct sync_state *_sync;
+
+#define JOURNAL_MAGIC "IMAPMHJ1"
+#define JOURNAL_FETCH 1
+#define JOURNAL_VANISHED 2
+#define JOURNAL_FLAGS 3 /* last is the new flags of uid first */
+
+/* The .journal file records what the QRESYNC SELECT reported, so that an
+   interrupted update can be resumed. The header is rewritten in place,
+   records are only ever appended. */
+struct journal_header {
+    char magic[8];
+    uint64_t uidvalidity;
+    uint64_t highestmodseq;
+    uint64_t complete;
+    uint64_t cursor;
+};
+
+struct journal_record {
+    uint64_t type;
+    uint64_t first;
+    uint64_t last;
+};
 
 static void die(char *fmt, ...)
 {
@@ -52,7 +242,18 @@ static void die(char *fmt, ...)
     exit(1);
 }
 
-static void debuglog(char *fmt, ...)
+/* Tracing of every line sent and received is only compiled in up to
+   MAX_LOG_LEVEL and printed up to the level in '.loglevel' */
+#define LOG_QUIET 0
+#define LOG_INFO 1
+#define LOG_TRACE 2
+#ifndef MAX_LOG_LEVEL
+#define MAX_LOG_LEVEL LOG_TRACE
+#endif
+
+static int _loglevel = LOG_INFO;
+
+static void write_log(char *fmt, ...)
 {
     va_list args;
     va_start(args, fmt);
@@ -61,816 +262,6634 @@ static void debuglog(char *fmt, ...)
     fprintf(stderr, "\n");
 }
 
-static void read_line()
+#define debuglog(...) do { if ((MAX_LOG_LEVEL >= LOG_INFO) && (_loglevel >= LOG_INFO)) write_log(__VA_ARGS__); } while (0)
+#define tracelog(...) do { if ((MAX_LOG_LEVEL >= LOG_TRACE) && (_loglevel >= LOG_TRACE)) write_log(__VA_ARGS__); } while (0)
+
+/* The counters are always kept and written at exit if '.metrics' names a
+   file. They are in shared memory then, so that the workers of
+   parallel-download and sync add to them. */
+#define PHASE_LOGIN 0
+#define PHASE_SELECT 1
+#define PHASE_FETCH 2 /* includes the commits made while fetching */
+#define PHASE_VANISH 3
+#define PHASE_COMMIT 4
+#define NUM_PHASES 5
+
+static char *_phasenames[NUM_PHASES] = { "login", "select", "fetch", "vanish", "commit" };
+
+/* Commands are told apart by their tag without the trailing number */
+static char *_commandnames[] = {
+    "capability", "compress", "login", "logout", "qresync", "select", "examine",
+    "status", "fetch", "flags", "sizes", "changed", "close", "idle",
+    "store", "expunge", "append", "other"
+};
+#define NUM_COMMANDS (sizeof(_commandnames)/sizeof(_commandnames[0]))
+
+static double _latencybuckets[] = { 0.001, 0.0025, 0.005, 0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1, 2.5, 5, 10 };
+#define NUM_LATENCY_BUCKETS (sizeof(_latencybuckets)/sizeof(_latencybuckets[0]))
+
+struct command_metrics {
+    uint64_t count;
+    uint64_t microseconds;
+    uint64_t buckets[NUM_LATENCY_BUCKETS+1]; /* the last one is +Inf */
+};
+
+struct metrics {
+    uint64_t phasemicroseconds[NUM_PHASES];
+    struct command_metrics commands[NUM_COMMANDS];
+    uint64_t receivedbytes;
+    uint64_t sentbytes;
+    uint64_t literalbytes;
+    uint64_t messageswritten;
+    uint64_t fsyncs;
+    uint64_t fsyncmicroseconds;
+    uint64_t diskwritemicroseconds;
+    uint64_t diskwaitmicroseconds;
+    uint64_t firstmessagesmicroseconds;
+};
+
+static struct metrics _localmetrics;
+static struct metrics *_metrics = &_localmetrics;
+static char _metricspath[BUFSIZE*2];
+static pid_t _metricspid;
+static long _metricsstartus;
+
+#define metric_add(field, n) __atomic_fetch_add(&_metrics->field, (n), __ATOMIC_RELAXED)
+
+#define MAX_OUTSTANDING_COMMANDS 256
+
+struct outstanding_command {
+    char tag[32];
+    int command;
+    long startus;
+};
+
+static struct outstanding_command _outstanding[MAX_OUTSTANDING_COMMANDS];
+static int _outstandingcount;
+
+static long monotonic_microseconds()
 {
-    if (!fgets(_buf, BUFSIZE, _infp)) {
-        die("Unable to read line");
-    }
-debuglog("recv '%s'", _buf);
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec*1000000 + ts.tv_nsec/1000;
 }
 
-static void write_string(char *fmt, ...)
+static void add_phase_time(int phase, long startus)
 {
-    va_list args1;
-    va_start(args1, fmt);
-    vfprintf(_outfp, fmt, args1);
-    va_end(args1);
-    fflush(_outfp);
+    metric_add(phasemicroseconds[phase], monotonic_microseconds() - startus);
+}
 
-    fprintf(stderr, "send '");
-    va_list args2;
-    va_start(args2, fmt);
-    vfprintf(stderr, fmt, args2);
-    va_end(args2);
-    fprintf(stderr, "'\n");
+static void add_fsync_time(long startus)
+{
+    metric_add(fsyncs, 1);
+    metric_add(fsyncmicroseconds, monotonic_microseconds() - startus);
 }
 
-static int file_exists(char *path)
+/* Remembers when the command in str was sent, 'DONE' and other lines
+   without a tag are ignored */
+static void start_command_timer(char *str)
 {
-    struct stat statbuf;
-    if (!stat(path, &statbuf)) {
-        return 1;
+    int taglen = strcspn(str, " \r\n");
+    if ((str[taglen] != ' ') || (taglen >= sizeof(_outstanding[0].tag)) || (_outstandingcount == MAX_OUTSTANDING_COMMANDS)) {
+        return;
     }
-    return 0;
+    struct outstanding_command *cmd = &_outstanding[_outstandingcount++];
+    memcpy(cmd->tag, str, taglen);
+    cmd->tag[taglen] = 0;
+    int namelen = taglen;
+    while ((namelen > 0) && strchr(DIGITCHARS, cmd->tag[namelen-1])) {
+        namelen--;
+    }
+    cmd->command = NUM_COMMANDS-1;
+    for (int i=0; i<NUM_COMMANDS-1; i++) {
+        if ((strlen(_commandnames[i]) == namelen) && !strncmp(cmd->tag, _commandnames[i], namelen)) {
+            cmd->command = i;
+            break;
+        }
+    }
+    cmd->startus = monotonic_microseconds();
 }
 
-static int is_file_symlink(char *path)
+/* Records the round trip of the command that the tagged line completes */
+static void finish_command_timer(char *line)
 {
-    struct stat statbuf;
-    if (!lstat(path, &statbuf)) {
-        if (S_ISLNK(statbuf.st_mode)) {
-            return 1;
+    int taglen = strcspn(line, " \r\n");
+    for (int i=0; i<_outstandingcount; i++) {
+        struct outstanding_command *cmd = &_outstanding[i];
+        if ((strlen(cmd->tag) != taglen) || strncmp(cmd->tag, line, taglen)) {
+            continue;
         }
+        long us = monotonic_microseconds() - cmd->startus;
+        int bucket = 0;
+        while ((bucket < NUM_LATENCY_BUCKETS) && (us > _latencybuckets[bucket]*1000000)) {
+            bucket++;
+        }
+        metric_add(commands[cmd->command].count, 1);
+        metric_add(commands[cmd->command].microseconds, us);
+        metric_add(commands[cmd->command].buckets[bucket], 1);
+        *cmd = _outstanding[--_outstandingcount];
+        return;
     }
-    return 0;
 }
 
-static FILE *open_file_for_writing(char *path)
+static void write_prometheus_metrics(FILE *fp, double seconds)
 {
-    int fd = open(path, O_WRONLY|O_CREAT|O_EXCL, 0600);
-    if (fd < 0) {
-        return NULL;
+    fprintf(fp, "# HELP imap_mh_run_seconds Duration of the run.\n");
+    fprintf(fp, "# TYPE imap_mh_run_seconds gauge\n");
+    fprintf(fp, "imap_mh_run_seconds %.6f\n", seconds);
+    fprintf(fp, "# HELP imap_mh_phase_seconds Time spent in each phase.\n");
+    fprintf(fp, "# TYPE imap_mh_phase_seconds gauge\n");
+    for (int i=0; i<NUM_PHASES; i++) {
+        fprintf(fp, "imap_mh_phase_seconds{phase=\"%s\"} %.6f\n", _phasenames[i], _metrics->phasemicroseconds[i]/1e6);
     }
-    FILE *fp = fdopen(fd, "w");
-    return fp;
+    fprintf(fp, "# HELP imap_mh_command_latency_seconds Round trip time of tagged IMAP commands.\n");
+    fprintf(fp, "# TYPE imap_mh_command_latency_seconds histogram\n");
+    for (int i=0; i<NUM_COMMANDS; i++) {
+        struct command_metrics *cmd = &_metrics->commands[i];
+        if (!cmd->count) {
+            continue;
+        }
+        uint64_t total = 0;
+        for (int j=0; j<NUM_LATENCY_BUCKETS; j++) {
+            total += cmd->buckets[j];
+            fprintf(fp, "imap_mh_command_latency_seconds_bucket{command=\"%s\",le=\"%g\"} %lu\n", _commandnames[i], _latencybuckets[j], (unsigned long)total);
+        }
+        fprintf(fp, "imap_mh_command_latency_seconds_bucket{command=\"%s\",le=\"+Inf\"} %lu\n", _commandnames[i], (unsigned long)cmd->count);
+        fprintf(fp, "imap_mh_command_latency_seconds_sum{command=\"%s\"} %.6f\n", _commandnames[i], cmd->microseconds/1e6);
+        fprintf(fp, "imap_mh_command_latency_seconds_count{command=\"%s\"} %lu\n", _commandnames[i], (unsigned long)cmd->count);
+    }
+    fprintf(fp, "# TYPE imap_mh_received_bytes gauge\n");
+    fprintf(fp, "imap_mh_received_bytes %lu\n", (unsigned long)_metrics->receivedbytes);
+    fprintf(fp, "# TYPE imap_mh_sent_bytes gauge\n");
+    fprintf(fp, "imap_mh_sent_bytes %lu\n", (unsigned long)_metrics->sentbytes);
+    fprintf(fp, "# TYPE imap_mh_literal_bytes gauge\n");
+    fprintf(fp, "imap_mh_literal_bytes %lu\n", (unsigned long)_metrics->literalbytes);
+    fprintf(fp, "# TYPE imap_mh_messages_written gauge\n");
+    fprintf(fp, "imap_mh_messages_written %lu\n", (unsigned long)_metrics->messageswritten);
+    fprintf(fp, "# TYPE imap_mh_fsyncs gauge\n");
+    fprintf(fp, "imap_mh_fsyncs %lu\n", (unsigned long)_metrics->fsyncs);
+    fprintf(fp, "# TYPE imap_mh_fsync_seconds gauge\n");
+    fprintf(fp, "imap_mh_fsync_seconds %.6f\n", _metrics->fsyncmicroseconds/1e6);
+    fprintf(fp, "# HELP imap_mh_disk_write_seconds Time message data was being written.\n");
+    fprintf(fp, "# TYPE imap_mh_disk_write_seconds gauge\n");
+    fprintf(fp, "imap_mh_disk_write_seconds %.6f\n", _metrics->diskwritemicroseconds/1e6);
+    fprintf(fp, "# HELP imap_mh_disk_wait_seconds Time receiving waited for message data to be written.\n");
+    fprintf(fp, "# TYPE imap_mh_disk_wait_seconds gauge\n");
+    fprintf(fp, "imap_mh_disk_wait_seconds %.6f\n", _metrics->diskwaitmicroseconds/1e6);
+    fprintf(fp, "# HELP imap_mh_first_messages_seconds Time from the start of fetching until the first %d messages were committed, 0 if fewer were fetched.\n", FIRST_MESSAGES_METRIC);
+    fprintf(fp, "# TYPE imap_mh_first_messages_seconds gauge\n");
+    fprintf(fp, "imap_mh_first_messages_seconds %.6f\n", _metrics->firstmessagesmicroseconds/1e6);
 }
 
-static char *string_prefix_endp(char *str, char *prefix)
+static void write_json_metrics(FILE *fp, double seconds)
 {
-    int len = strlen(prefix);
-    if (!len) {
-        return NULL;
+    fprintf(fp, "{\n  \"run_seconds\": %.6f,\n  \"phase_seconds\": {", seconds);
+    for (int i=0; i<NUM_PHASES; i++) {
+        fprintf(fp, "%s\"%s\": %.6f", i ? ", " : " ", _phasenames[i], _metrics->phasemicroseconds[i]/1e6);
     }
-    if (!strncmp(str, prefix, len)) {
-        return str + len;
+    fprintf(fp, " },\n  \"commands\": {");
+    int first = 1;
+    for (int i=0; i<NUM_COMMANDS; i++) {
+        struct command_metrics *cmd = &_metrics->commands[i];
+        if (!cmd->count) {
+            continue;
+        }
+        fprintf(fp, "%s\n    \"%s\": { \"count\": %lu, \"seconds\": %.6f, \"buckets\": [", first ? "" : ",", _commandnames[i], (unsigned long)cmd->count, cmd->microseconds/1e6);
+        for (int j=0; j<=NUM_LATENCY_BUCKETS; j++) {
+            fprintf(fp, "%s%lu", j ? ", " : "", (unsigned long)cmd->buckets[j]);
+        }
+        fprintf(fp, "] }");
+        first = 0;
     }
-    return NULL;
+    fprintf(fp, "\n  },\n  \"latency_buckets\": [");
+    for (int j=0; j<NUM_LATENCY_BUCKETS; j++) {
+        fprintf(fp, "%s%g", j ? ", " : "", _latencybuckets[j]);
+    }
+    fprintf(fp, "],\n");
+    fprintf(fp, "  \"received_bytes\": %lu,\n", (unsigned long)_metrics->receivedbytes);
+    fprintf(fp, "  \"received_bytes_per_second\": %.0f,\n", seconds > 0 ? _metrics->receivedbytes/seconds : 0);
+    fprintf(fp, "  \"sent_bytes\": %lu,\n", (unsigned long)_metrics->sentbytes);
+    fprintf(fp, "  \"literal_bytes\": %lu,\n", (unsigned long)_metrics->literalbytes);
+    fprintf(fp, "  \"messages_written\": %lu,\n", (unsigned long)_metrics->messageswritten);
+    fprintf(fp, "  \"fsyncs\": %lu,\n", (unsigned long)_metrics->fsyncs);
+    fprintf(fp, "  \"fsync_seconds\": %.6f,\n", _metrics->fsyncmicroseconds/1e6);
+    fprintf(fp, "  \"disk_write_seconds\": %.6f,\n", _metrics->diskwritemicroseconds/1e6);
+    fprintf(fp, "  \"disk_wait_seconds\": %.6f,\n", _metrics->diskwaitmicroseconds/1e6);
+    fprintf(fp, "  \"first_messages\": %d,\n", FIRST_MESSAGES_METRIC);
+    fprintf(fp, "  \"first_messages_seconds\": %.6f\n}\n", _metrics->firstmessagesmicroseconds/1e6);
 }
 
-static char *string_suffix(char *str, char *suffix)
+/* Runs at exit in the process that read '.metrics', the file is written
+   as JSON if its name ends in '.json', otherwise in the Prometheus text
+   format for the node exporter textfile collector */
+static void write_metrics()
 {
-    int suffixlen = strlen(suffix);
-    if (!suffixlen) {
-        return NULL;
+    if (getpid() != _metricspid) {
+        return;
     }
-    int len = strlen(str);
-    if (len < suffixlen) {
-        return NULL;
+    char tmppath[BUFSIZE*2+8];
+    snprintf(tmppath, sizeof(tmppath), "%s.tmp", _metricspath);
+    FILE *fp = fopen(tmppath, "w");
+    if (!fp) {
+        fprintf(stderr, "Unable to create '%s'\n", tmppath);
+        return;
     }
-    char *p = str + len-suffixlen;
-    if (!strcmp(p, suffix)) {
-        return p;
+    double seconds = (monotonic_microseconds() - _metricsstartus)/1e6;
+    int len = strlen(_metricspath);
+    if ((len > 5) && !strcmp(_metricspath+len-5, ".json")) {
+        write_json_metrics(fp, seconds);
+    } else {
+        write_prometheus_metrics(fp, seconds);
+    }
+    if ((fclose(fp) != 0) || (rename(tmppath, _metricspath) != 0)) {
+        fprintf(stderr, "Unable to write '%s'\n", _metricspath);
     }
-    return NULL;
 }
 
-static char *str_validchars_endchar(char *str, char *validchars, char endchar)
+/* Message data goes through a writer, so that the next literal can be
+   received while the previous ones are being written. The io_uring
+   backend submits everything queued since the last read from the network
+   in one system call, the thread backend hands it to a thread that calls
+   pwrite(), and the sync backend writes it at once. A buffer is reused
+   when its write has completed, so at most WRITER_BUFFERS writes are in
+   flight. Files are still opened and closed directly, because linkat()
+   and fallocate() need the descriptor right away and the close comes
+   after fdatasync() has written everything. */
+
+#define WRITER_BUFFERS 32
+#define WRITER_SYNC 0
+#define WRITER_THREAD 1
+#define WRITER_IO_URING 2
+
+static char *_writernames[] = { "sync", "thread", "io_uring" };
+
+struct writer_buffer {
+    int fd;
+    int len;
+    off_t offset;
+    char data[LITBUFSIZE+1];
+};
+
+static struct writer_buffer _writerbuffers[WRITER_BUFFERS];
+static int _writerfree[WRITER_BUFFERS];
+static int _writerfreecount;
+static int _writerqueue[WRITER_BUFFERS]; /* filled, not submitted yet */
+static int _writerqueuecount;
+static int _writerinflight;
+static int _writerbackend = -1;
+static pid_t _writerpid;
+static int _writererror;
+static long _writerbusystartus;
+static uint64_t _writerbusyus;
+static uint64_t _writerwaitus;
+
+/* the thread backend, _writermutex protects everything above that the
+   thread touches */
+static pthread_mutex_t _writermutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t _writerworkcond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t _writerdonecond = PTHREAD_COND_INITIALIZER;
+static int _writerwork[WRITER_BUFFERS];
+static int _writerworkhead;
+static int _writerworkcount;
+static int _writerthreadstarted;
+
+static int pwrite_all(int fd, char *buf, int len, off_t offset)
 {
-    char *p = str;
-    for(;;) {
-        if (*p == endchar) {
-            if (p == str) {
-                return NULL;
+    while (len > 0) {
+        ssize_t n = pwrite(fd, buf, len, offset);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
             }
-            return p;
-        }
-        if (!*p) {
-            return NULL;
-        }
-        if (!strchr(validchars, *p)) {
-            return NULL;
+            return errno;
         }
-        p++;
+        buf += n;
+        len -= n;
+        offset += n;
     }
-    // not reached
-    return NULL;
+    return 0;
 }
 
-static void chomp_string(char *str)
+static void *writer_thread(void *arg)
 {
-    int len = strlen(str);
-    if (len > 0) {
-        if (str[len-1] == '\n') {
-            str[len-1] = 0;
+    pthread_mutex_lock(&_writermutex);
+    for(;;) {
+        while (!_writerworkcount) {
+            pthread_cond_wait(&_writerworkcond, &_writermutex);
+        }
+        int i = _writerwork[_writerworkhead];
+        _writerworkhead = (_writerworkhead + 1) % WRITER_BUFFERS;
+        _writerworkcount--;
+        pthread_mutex_unlock(&_writermutex);
+
+        struct writer_buffer *wb = &_writerbuffers[i];
+        long startus = monotonic_microseconds();
+        int err = pwrite_all(wb->fd, wb->data, wb->len, wb->offset);
+        long us = monotonic_microseconds() - startus;
+
+        pthread_mutex_lock(&_writermutex);
+        _writerbusyus += us;
+        if (err && !_writererror) {
+            _writererror = err;
         }
+        _writerfree[_writerfreecount++] = i;
+        _writerinflight--;
+        pthread_cond_signal(&_writerdonecond);
     }
+    return NULL;
 }
 
-static int is_number_in_range(char *numberstr, char *rangestr)
-{
-    char *str = rangestr;
-    unsigned long number = strtoul(numberstr, NULL, 10);
-//debuglog("number %lu", number);
+/* The io_uring backend is set up with the raw system calls, it needs
+   Linux 5.6 for IORING_OP_WRITE and IOSQE_ASYNC, which makes sure the
+   write is done by a kernel worker instead of inline in the submit */
+#if defined(__NR_io_uring_setup) && defined(IOSQE_ASYNC)
+struct io_ring {
+    int fd;
+    unsigned *sqtail;
+    unsigned *sqmask;
+    unsigned *sqarray;
+    unsigned *cqhead;
+    unsigned *cqtail;
+    unsigned *cqmask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+};
 
-    char *p = str;
-    for(;;) {
-        char *endp = NULL;
-        unsigned long number1 = strtoul(p, &endp, 10);
-        if (endp == p) {
-            return 0;
+static struct io_ring _ring;
+static int _ringready; /* 1 if set up, -1 if unavailable */
+
+static int setup_io_ring()
+{
+    if (_ringready) {
+        return _ringready > 0;
+    }
+    _ringready = -1;
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    int fd = syscall(__NR_io_uring_setup, WRITER_BUFFERS, &params);
+    if (fd < 0) {
+debuglog("io_uring is not available");
+        return 0;
+    }
+    if (!(params.features & IORING_FEAT_RW_CUR_POS)) {
+debuglog("io_uring is too old");
+        close(fd);
+        return 0;
+    }
+    size_t sqsize = params.sq_off.array + params.sq_entries*sizeof(unsigned);
+    size_t cqsize = params.cq_off.cqes + params.cq_entries*sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        if (cqsize > sqsize) {
+            sqsize = cqsize;
         }
-        if (*endp == ':') {
-            p = endp+1;
-            endp = NULL;
-            unsigned long number2 = strtoul(p, &endp, 10);
-            if (endp == p) {
-//debuglog("missing second number of range %lu", number1);
-                return 0;
-            }
-//debuglog("range from %lu to %lu", number1, number2);
-            if ((number >= number1) && (number <= number2)) {
-                return 1;
-            }
-            if (*endp == ',') {
-                p = endp+1;
-                continue;
-            }
-            return 0;
-        } else if (*endp == ',') {
-//debuglog("number %lu *", number1);
-            if (number == number1) {
-                return 1;
-            }
-            p = endp+1;
-            continue;
-        } else {
-//debuglog("number %lu next char '%c'", number1, *endp);
-            if (number == number1) {
-                return 1;
-            }
-            return 0;
+    }
+    char *sq = mmap(NULL, sqsize, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    if (sq == MAP_FAILED) {
+        die("Unable to map io_uring");
+    }
+    char *cq = sq;
+    if (!(params.features & IORING_FEAT_SINGLE_MMAP)) {
+        cq = mmap(NULL, cqsize, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+        if (cq == MAP_FAILED) {
+            die("Unable to map io_uring");
         }
     }
-    // not reached
-    return 0;
+    _ring.sqes = mmap(NULL, params.sq_entries*sizeof(struct io_uring_sqe), PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (_ring.sqes == MAP_FAILED) {
+        die("Unable to map io_uring");
+    }
+    _ring.fd = fd;
+    _ring.sqtail = (unsigned *)(sq + params.sq_off.tail);
+    _ring.sqmask = (unsigned *)(sq + params.sq_off.ring_mask);
+    _ring.sqarray = (unsigned *)(sq + params.sq_off.array);
+    _ring.cqhead = (unsigned *)(cq + params.cq_off.head);
+    _ring.cqtail = (unsigned *)(cq + params.cq_off.tail);
+    _ring.cqmask = (unsigned *)(cq + params.cq_off.ring_mask);
+    _ring.cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+    _ringready = 1;
+    return 1;
 }
 
-static int is_filename_uid(char *str)
+static void enter_io_ring(int submit, int wait)
 {
-    char *p = str;
-    if (*p == '.') {
-        p++;
-        for(;;) {
-            if (!*p) {
-                if (p - str >= 2) {
-                    return 1;
-                }
-                return 0;
-            }
-            if ((*p >= '0') && (*p <= '9')) {
-                p++;
+    for(;;) {
+        int n = syscall(__NR_io_uring_enter, _ring.fd, submit, wait, wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+        if (n < 0) {
+            if (errno == EINTR) {
                 continue;
             }
-            return 0;
+            die("Unable to submit to io_uring");
         }
+        if (n >= submit) {
+            return;
+        }
+        submit -= n;
     }
-    return 0;
 }
 
-static void unlink_files_in_range(char *range)
+static void submit_io_ring()
 {
-    DIR *dir = opendir(".");
-    if (!dir) {
-        die("Unable to open current directory");
-    }
-    for(;;) {
-        struct dirent *ent = readdir(dir);
-        if (!ent) {
-            break;
-        }
-        char *p = ent->d_name;
-//debuglog("dirent '%s' %d", p, is_filename_uid(p));
-        if (is_filename_uid(p)) {
-            char *q = p + 1;
-//debuglog("q '%s'", q);
-            if (is_number_in_range(q, range)) {
-debuglog("'%s' in range '%s'", q, range);
-                if (unlink(p) != 0) {
-                    die("Unable to unlink '%s'", p);
-                }
-debuglog("unlinked '%s'", p);
-            }
-        }
+    unsigned tail = *_ring.sqtail;
+    for (int i=0; i<_writerqueuecount; i++) {
+        int b = _writerqueue[i];
+        struct writer_buffer *wb = &_writerbuffers[b];
+        unsigned idx = tail & *_ring.sqmask;
+        struct io_uring_sqe *sqe = &_ring.sqes[idx];
+        memset(sqe, 0, sizeof(*sqe));
+        sqe->opcode = IORING_OP_WRITE;
+        sqe->flags = IOSQE_ASYNC;
+        sqe->fd = wb->fd;
+        sqe->addr = (unsigned long)wb->data;
+        sqe->len = wb->len;
+        sqe->off = wb->offset;
+        sqe->user_data = b;
+        _ring.sqarray[idx] = idx;
+        tail++;
     }
-    closedir(dir);
+    __atomic_store_n(_ring.sqtail, tail, __ATOMIC_RELEASE);
+    enter_io_ring(_writerqueuecount, 0);
 }
 
-static void unlink_message_symlinks()
+static void reap_io_ring()
 {
-    DIR *dir = opendir(".");
-    if (!dir) {
-        die("Unable to open current directory");
-    }
-    for(;;) {
-        struct dirent *ent = readdir(dir);
-        if (!ent) {
-            break;
-        }
-        char *p = ent->d_name;
-        if (str_validchars_endchar(p, DIGITCHARS, 0)) {
-            if (!is_file_symlink(p)) {
-                die("File '%s' is not a symlink", p);
+    unsigned head = *_ring.cqhead;
+    unsigned tail = __atomic_load_n(_ring.cqtail, __ATOMIC_ACQUIRE);
+    while (head != tail) {
+        struct io_uring_cqe *cqe = &_ring.cqes[head & *_ring.cqmask];
+        int b = cqe->user_data;
+        struct writer_buffer *wb = &_writerbuffers[b];
+        if (cqe->res < 0) {
+            if (!_writererror) {
+                _writererror = -cqe->res;
             }
-            if (unlink(p) != 0) {
-                die("Unable to unlink '%s'", p);
+        } else if (cqe->res < wb->len) {
+            /* a short write is finished here, it is rare for files */
+            int err = pwrite_all(wb->fd, wb->data+cqe->res, wb->len-cqe->res, wb->offset+cqe->res);
+            if (err && !_writererror) {
+                _writererror = err;
             }
         }
+        _writerfree[_writerfreecount++] = b;
+        _writerinflight--;
+        head++;
+    }
+    __atomic_store_n(_ring.cqhead, head, __ATOMIC_RELEASE);
+    if (!_writerinflight && _writerbusystartus) {
+        _writerbusyus += monotonic_microseconds() - _writerbusystartus;
+        _writerbusystartus = 0;
     }
-    closedir(dir);
+}
+#else
+static int setup_io_ring()
+{
+    return 0;
 }
 
-static void read_first_line_from_file(char *filename, char *buf)
+static void submit_io_ring()
 {
-    FILE *fp = fopen(filename, "r");
-    if (!fp) {
-        die("Unable to open '%s'", filename);
-    }
-    if (!fgets(buf, BUFSIZE, fp)) {
-        die("Unable to read line from '%s'", filename);
-    }
-    fclose(fp);
-    chomp_string(buf);
 }
 
-static void write_string_to_new_file(char *str, char *path)
+static void reap_io_ring()
 {
-    FILE *fp = open_file_for_writing(path);
-    if (!fp) {
-        die("Unable to create file '%s'", path);
-    }
-    fprintf(fp, "%s", str);
-    fclose(fp);
 }
 
-static void wait_for_initial_ok()
+static void enter_io_ring(int submit, int wait)
 {
-    read_line();
-    if (!string_prefix_endp(_buf, "* OK")) {
-        die("Expecting OK but received '%s'", _buf);
-    }
 }
+#endif
 
-static void do_login(char *username, char *password)
+/* Submits what has been queued since the last call and collects the
+   writes that have completed, called before each read from the network */
+static void writer_flush()
 {
-    write_string("login login %s %s\r\n", username, password);
-    for(;;) {
-        read_line();
-        if (string_prefix_endp(_buf, "login OK")) {
-            break;
+    if (_writerbackend == WRITER_IO_URING) {
+        if (_writerqueuecount) {
+            if (!_writerinflight) {
+                _writerbusystartus = monotonic_microseconds();
+            }
+            _writerinflight += _writerqueuecount;
+            submit_io_ring();
+            _writerqueuecount = 0;
         }
-        if (string_prefix_endp(_buf, "login NO")
-         || string_prefix_endp(_buf, "login BAD"))
-        {
-            die("Unable to login '%s'", _buf);
+        if (_writerinflight) {
+            reap_io_ring();
+        }
+    } else if ((_writerbackend == WRITER_THREAD) && _writerqueuecount) {
+        pthread_mutex_lock(&_writermutex);
+        for (int i=0; i<_writerqueuecount; i++) {
+            _writerwork[(_writerworkhead + _writerworkcount) % WRITER_BUFFERS] = _writerqueue[i];
+            _writerworkcount++;
         }
+        _writerinflight += _writerqueuecount;
+        _writerqueuecount = 0;
+        pthread_cond_signal(&_writerworkcond);
+        pthread_mutex_unlock(&_writermutex);
     }
 }
 
-static void do_logout()
+/* While io_uring writes are in flight, waits for the input and the ring
+   together, so that a completion is collected when it arrives and not
+   after the next read */
+static void writer_wait_input(int fd)
 {
-    write_string("logout logout\r\n");
-    for(;;) {
-        read_line();
-        if (string_prefix_endp(_buf, "logout OK")) {
-            break;
+#if defined(__NR_io_uring_setup) && defined(IOSQE_ASYNC)
+    while ((_writerbackend == WRITER_IO_URING) && _writerinflight) {
+        struct pollfd pfd[2];
+        pfd[0].fd = fd;
+        pfd[0].events = POLLIN;
+        pfd[0].revents = 0;
+        pfd[1].fd = _ring.fd;
+        pfd[1].events = POLLIN;
+        pfd[1].revents = 0;
+        if (poll(pfd, 2, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            die("Unable to poll input");
         }
-        if (string_prefix_endp(_buf, "logout NO")
-         || string_prefix_endp(_buf, "logout BAD"))
-        {
-            debuglog("Unable to logout '%s'", _buf);
-            break;
+        if (pfd[1].revents) {
+            reap_io_ring();
+        }
+        if (pfd[0].revents) {
+            return;
         }
     }
+#endif
 }
 
-static void do_enable_qresync()
+/* Waits until a buffer is free, or if all is set, until every write has
+   completed. The time spent waiting is the part of the disk time that
+   did not overlap with receiving. */
+static void writer_wait(int all)
 {
-    write_string("qresync enable qresync\r\n");
+    long startus = 0;
+    if (_writerbackend == WRITER_IO_URING) {
+        while (all ? (_writerqueuecount || _writerinflight) : !_writerfreecount) {
+            if (!startus) {
+                startus = monotonic_microseconds();
+            }
+            writer_flush();
+            if (all ? _writerinflight : !_writerfreecount) {
+                enter_io_ring(0, 1);
+                reap_io_ring();
+            }
+        }
+    } else if (_writerbackend == WRITER_THREAD) {
+        pthread_mutex_lock(&_writermutex);
+        int waiting = all ? (_writerqueuecount || _writerinflight) : !_writerfreecount;
+        pthread_mutex_unlock(&_writermutex);
+        if (waiting) {
+            startus = monotonic_microseconds();
+            writer_flush();
+            pthread_mutex_lock(&_writermutex);
+            while (all ? _writerinflight : !_writerfreecount) {
+                pthread_cond_wait(&_writerdonecond, &_writermutex);
+            }
+            pthread_mutex_unlock(&_writermutex);
+        }
+    }
+    if (startus) {
+        _writerwaitus += monotonic_microseconds() - startus;
+    }
+    if (_writererror) {
+        die("Unable to write message (%s)", strerror(_writererror));
+    }
+}
+
+static struct writer_buffer *writer_get_buffer()
+{
+    writer_wait(0);
+    pthread_mutex_lock(&_writermutex);
+    int b = _writerfree[--_writerfreecount];
+    pthread_mutex_unlock(&_writermutex);
+    return &_writerbuffers[b];
+}
+
+static void writer_release_buffer(struct writer_buffer *wb)
+{
+    pthread_mutex_lock(&_writermutex);
+    _writerfree[_writerfreecount++] = wb - _writerbuffers;
+    pthread_mutex_unlock(&_writermutex);
+}
+
+/* Queues len bytes of the buffer to be written to fd at offset */
+static void writer_submit(struct writer_buffer *wb, int fd, off_t offset, int len)
+{
+    if (!len) {
+        writer_release_buffer(wb);
+        return;
+    }
+    wb->fd = fd;
+    wb->offset = offset;
+    wb->len = len;
+    if (_writerbackend == WRITER_SYNC) {
+        long startus = monotonic_microseconds();
+        int err = pwrite_all(fd, wb->data, len, offset);
+        if (err) {
+            die("Unable to write message (%s)", strerror(err));
+        }
+        long us = monotonic_microseconds() - startus;
+        _writerbusyus += us;
+        _writerwaitus += us;
+        writer_release_buffer(wb);
+        return;
+    }
+    _writerqueue[_writerqueuecount++] = wb - _writerbuffers;
+}
+
+/* Chooses the backend named in '.writer', by default io_uring or the
+   thread if io_uring is not available */
+static void start_writer(char *name)
+{
+    if (_writerpid != getpid()) {
+        /* after fork() the ring and the thread belong to the parent */
+        _writerpid = getpid();
+        pthread_mutex_init(&_writermutex, NULL);
+        pthread_cond_init(&_writerworkcond, NULL);
+        pthread_cond_init(&_writerdonecond, NULL);
+        _writerthreadstarted = 0;
+        _writerworkhead = 0;
+        _writerworkcount = 0;
+#if defined(__NR_io_uring_setup) && defined(IOSQE_ASYNC)
+        _ringready = 0;
+#endif
+        for (int i=0; i<WRITER_BUFFERS; i++) {
+            _writerfree[i] = i;
+        }
+        _writerfreecount = WRITER_BUFFERS;
+        _writerqueuecount = 0;
+        _writerinflight = 0;
+        _writererror = 0;
+        _writerbackend = -1;
+    }
+    if (_writerbackend >= 0) {
+        return;
+    }
+    if (!strcmp(name, "sync")) {
+        _writerbackend = WRITER_SYNC;
+    } else if (strcmp(name, "thread") && setup_io_ring()) {
+        _writerbackend = WRITER_IO_URING;
+    } else {
+        if (!_writerthreadstarted) {
+            pthread_t thread;
+            if (pthread_create(&thread, NULL, writer_thread, NULL) != 0) {
+                die("Unable to start writer thread");
+            }
+            pthread_detach(thread);
+            _writerthreadstarted = 1;
+        }
+        _writerbackend = WRITER_THREAD;
+    }
+tracelog("writer %s", _writernames[_writerbackend]);
+}
+
+/* Prints how much of the time spent writing message data overlapped
+   with receiving, the writes must have completed */
+static void stop_writer()
+{
+    if (_writerbackend < 0) {
+        return;
+    }
+    pthread_mutex_lock(&_writermutex);
+    long busyus = _writerbusyus;
+    long waitus = _writerwaitus;
+    _writerbusyus = 0;
+    _writerwaitus = 0;
+    pthread_mutex_unlock(&_writermutex);
+    if (busyus >= 1000) {
+        long overlapus = (busyus > waitus) ? busyus - waitus : 0;
+debuglog("writer %s: writing %ld ms, waited %ld ms, %ld%% overlapped with receiving", _writernames[_writerbackend], busyus/1000, waitus/1000, overlapus*100/busyus);
+    }
+    metric_add(diskwritemicroseconds, busyus);
+    metric_add(diskwaitmicroseconds, waitus);
+    _writerbackend = -1;
+}
+
+static int read_raw_input(char *buf, int len)
+{
+    writer_flush();
+    if (!_ssl || !SSL_pending(_ssl)) {
+        writer_wait_input(_infd);
+    }
+    while (_ssl) {
+        int n = SSL_read(_ssl, buf, len);
+        if (n > 0) {
+            metric_add(receivedbytes, n);
+            return n;
+        }
+        int err = SSL_get_error(_ssl, n);
+        if (err == SSL_ERROR_ZERO_RETURN) {
+            return 0;
+        }
+        if ((err == SSL_ERROR_SYSCALL) && (errno == EINTR)) {
+            continue;
+        }
+        die("Unable to read from TLS connection");
+    }
+    for(;;) {
+        int n = read(_infd, buf, len);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            die("Unable to read input");
+        }
+        metric_add(receivedbytes, n);
+        return n;
+    }
+}
+
+/* COMPRESS=DEFLATE (RFC 4978) runs raw deflate streams in both directions
+   under the line reader and write_string(). zlib allocates from a static
+   arena that is reset when compression ends. */
+static char _zarena[ZARENASIZE];
+static int _zarenaused;
+
+static voidpf zarena_alloc(voidpf opaque, uInt items, uInt size)
+{
+    unsigned long len = ((unsigned long)items*size + 15) & ~15UL;
+    if (_zarenaused + len > ZARENASIZE) {
+        return Z_NULL;
+    }
+    voidpf p = _zarena + _zarenaused;
+    _zarenaused += len;
+    return p;
+}
+
+static void zarena_free(voidpf opaque, voidpf address)
+{
+}
+
+static int read_input(char *buf, int len)
+{
+    if (!_compressing) {
+        return read_raw_input(buf, len);
+    }
+    for(;;) {
+        if (!_zin.avail_in) {
+            int n = read_raw_input(_zinbuf, ZBUFSIZE);
+            if (!n) {
+                return 0;
+            }
+            _zin.next_in = (Bytef *)_zinbuf;
+            _zin.avail_in = n;
+        }
+        _zin.next_out = (Bytef *)buf;
+        _zin.avail_out = len;
+        int result = inflate(&_zin, Z_SYNC_FLUSH);
+        if ((result != Z_OK) && (result != Z_BUF_ERROR)) {
+            die("Unable to inflate input");
+        }
+        int n = len - _zin.avail_out;
+        if (n) {
+            return n;
+        }
+    }
+}
+
+/* read_line() terminates the line in place, this puts back the first
+   character after it before the input buffer is used again */
+static void release_line()
+{
+    if (_lineend >= 0) {
+        _inbuf[_lineend] = _lineendchar;
+        _lineend = -1;
+    }
+}
+
+static int fill_input()
+{
+    release_line();
+    if (_inpos == _inlen) {
+        _inpos = 0;
+        _inlen = 0;
+    } else if (_inpos > 0) {
+        memmove(_inbuf, _inbuf+_inpos, _inlen-_inpos);
+        _inlen -= _inpos;
+        _inpos = 0;
+    }
+    if (_inlen == INBUFSIZE) {
+        return 0;
+    }
+    int n = read_input(_inbuf+_inlen, INBUFSIZE-_inlen);
+    _inlen += n;
+    return n;
+}
+
+/* Set when the line in _buf was split by read_line() and the next
+   read_line() gives the rest of it */
+static int _linecontinues;
+
+/* Returns the position of the last ',' in the full input buffer that is
+   not in a quoted string or a [...] section, which can only separate the
+   numbers of a sequence set, or -1 if there is none */
+static int last_sequence_comma()
+{
+    int comma = -1;
+    int quoted = 0;
+    int depth = 0;
+    for (int i=_inpos; i<_inlen; i++) {
+        char c = _inbuf[i];
+        if (quoted) {
+            if ((c == '\\') && (i+1 < _inlen)) {
+                i++;
+            } else if (c == '"') {
+                quoted = 0;
+            }
+        } else if (c == '"') {
+            quoted = 1;
+        } else if (c == '[') {
+            depth++;
+        } else if (c == ']') {
+            depth--;
+        } else if ((c == ',') && !depth) {
+            comma = i;
+        }
+    }
+    return comma;
+}
+
+/* Reads the next line into _buf without copying it. A line longer than
+   the input buffer, such as the VANISHED (EARLIER) response after many
+   expunges, is split before the last comma of a sequence set and
+   _linecontinues is set, the next line starts with that comma. */
+static void read_line()
+{
+    release_line();
+    int continuation = _linecontinues;
+    _linecontinues = 0;
+    int scanned = 0;
+    char *nl;
+    for(;;) {
+        nl = memchr(_inbuf+_inpos+scanned, '\n', _inlen-_inpos-scanned);
+        if (nl) {
+            break;
+        }
+        scanned = _inlen - _inpos;
+        if (!fill_input()) {
+            if (_inlen - _inpos == INBUFSIZE) {
+                int comma = last_sequence_comma();
+                if (comma <= _inpos) {
+                    die("Response line longer than %d bytes", INBUFSIZE);
+                }
+                _linecontinues = 1;
+                nl = _inbuf + comma - 1;
+                break;
+            }
+            die("Unable to read line");
+        }
+    }
+    _buf = _inbuf + _inpos;
+    _inpos = nl+1 - _inbuf;
+    _lineend = _inpos;
+    _lineendchar = _inbuf[_lineend];
+    _inbuf[_lineend] = 0;
+    if (_outstandingcount && !continuation && (_buf[0] != '*') && (_buf[0] != '+')) {
+        finish_command_timer(_buf);
+    }
+tracelog("recv '%s'", _buf);
+}
+
+/* Returns 1 if input is available within timeout milliseconds */
+static int input_ready(int timeout)
+{
+    if (_inpos < _inlen) {
+        return 1;
+    }
+    if (_compressing && _zin.avail_in) {
+        return 1;
+    }
+    if (_ssl && SSL_pending(_ssl)) {
+        return 1;
+    }
+    struct pollfd pfd;
+    pfd.fd = _infd;
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+    for(;;) {
+        int n = poll(&pfd, 1, timeout);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            die("Unable to poll input");
+        }
+        return n;
+    }
+}
+
+static void write_all(int fd, char *buf, int len)
+{
+    while (len > 0) {
+        int n = write(fd, buf, len);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            die("Unable to write");
+        }
+        buf += n;
+        len -= n;
+    }
+}
+
+/* CRLF to LF kernels. Each one converts from src to p, where p may trail
+   src because the output is written in place, and returns the new output
+   pointer. Bare CRs are kept as they are. A CR at the very end of the
+   input is held back in *pending_cr because its LF may arrive with the
+   next chunk. */
+
+static char *normalize_crlf_scalar(char *p, char *src, char *endp, int *pending_cr)
+{
+    while (src < endp) {
+        char c = *src++;
+        if (c == '\r') {
+            if (src == endp) {
+                *pending_cr = 1;
+                break;
+            }
+            if (*src == '\n') {
+                continue;
+            }
+        }
+        *p++ = c;
+    }
+    return p;
+}
+
+#if defined(__SSE2__)
+static char *normalize_crlf_sse2(char *p, char *src, char *endp, int *pending_cr)
+{
+    __m128i cr = _mm_set1_epi8('\r');
+    while (endp - src >= 16) {
+        __m128i v = _mm_loadu_si128((__m128i *)src);
+        unsigned int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(v, cr));
+        if (!mask) {
+            _mm_storeu_si128((__m128i *)p, v);
+            p += 16;
+            src += 16;
+            continue;
+        }
+        int i = __builtin_ctz(mask);
+        memmove(p, src, i);
+        p += i;
+        src += i;
+        if (src+1 == endp) {
+            break;
+        }
+        if (src[1] != '\n') {
+            *p++ = '\r';
+        }
+        src++;
+    }
+    return normalize_crlf_scalar(p, src, endp, pending_cr);
+}
+#endif
+
+#if defined(__x86_64__) && defined(__GNUC__)
+__attribute__((target("avx2")))
+static char *normalize_crlf_avx2(char *p, char *src, char *endp, int *pending_cr)
+{
+    __m256i cr = _mm256_set1_epi8('\r');
+    while (endp - src >= 32) {
+        __m256i v = _mm256_loadu_si256((__m256i *)src);
+        unsigned int mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, cr));
+        if (!mask) {
+            _mm256_storeu_si256((__m256i *)p, v);
+            p += 32;
+            src += 32;
+            continue;
+        }
+        int i = __builtin_ctz(mask);
+        memmove(p, src, i);
+        p += i;
+        src += i;
+        if (src+1 == endp) {
+            break;
+        }
+        if (src[1] != '\n') {
+            *p++ = '\r';
+        }
+        src++;
+    }
+    return normalize_crlf_scalar(p, src, endp, pending_cr);
+}
+#endif
+
+/* Converts CRLF to LF, dst may be one byte before src so that a held back
+   CR from the previous chunk can be emitted. Returns the number of bytes
+   written */
+static int normalize_crlf(char *dst, char *src, int len, int *pending_cr)
+{
+    static char *(*kernel)(char *, char *, char *, int *);
+    if (!kernel) {
+        kernel = normalize_crlf_scalar;
+#if defined(__SSE2__)
+        kernel = normalize_crlf_sse2;
+#endif
+#if defined(__x86_64__) && defined(__GNUC__)
+        if (__builtin_cpu_supports("avx2")) {
+            kernel = normalize_crlf_avx2;
+        }
+#endif
+    }
+
+    char *p = dst;
+    char *endp = src + len;
+    if (*pending_cr && (src < endp)) {
+        if (*src != '\n') {
+            *p++ = '\r';
+        }
+        *pending_cr = 0;
+    }
+    p = kernel(p, src, endp, pending_cr);
+    return p - dst;
+}
+
+/* SHA-256 from libcrypto, used to find identical messages for .store */
+struct sha256 {
+    EVP_MD_CTX *ctx;
+};
+
+static void sha256_init(struct sha256 *sha)
+{
+    sha->ctx = EVP_MD_CTX_new();
+    if (!sha->ctx || !EVP_DigestInit_ex(sha->ctx, EVP_sha256(), NULL)) {
+        die("Unable to initialize SHA-256");
+    }
+}
+
+static void sha256_update(struct sha256 *sha, const char *data, int len)
+{
+    if (!EVP_DigestUpdate(sha->ctx, data, len)) {
+        die("Unable to update SHA-256");
+    }
+}
+
+static void sha256_final(struct sha256 *sha, unsigned char *digest)
+{
+    if (!EVP_DigestFinal_ex(sha->ctx, digest, NULL)) {
+        die("Unable to finish SHA-256");
+    }
+    EVP_MD_CTX_free(sha->ctx);
+    sha->ctx = NULL;
+}
+
+/* Receives a literal of size bytes into fd through the writer, or
+   discards it if fd is -1. If sha is not NULL, it is updated with what
+   is written. Returns the number of bytes written, which is less than
+   size by the CRs that were removed. */
+static int receive_literal(int fd, int size, struct sha256 *sha)
+{
+    metric_add(literalbytes, size);
+    release_line();
+    int pending_cr = 0;
+    int remaining = size;
+    off_t offset = 0;
+    while (remaining > 0) {
+        int n = remaining;
+        if (n > LITBUFSIZE) {
+            n = LITBUFSIZE;
+        }
+        if (fd < 0) {
+            if (_inpos < _inlen) {
+                if (n > _inlen - _inpos) {
+                    n = _inlen - _inpos;
+                }
+                _inpos += n;
+            } else if (!(n = read_input(_litbuf, n))) {
+                die("Unexpected end of input in literal");
+            }
+            remaining -= n;
+            continue;
+        }
+        /* the CRLFs are converted straight into the writer's buffer,
+           from _inbuf or in place after reading into it */
+        struct writer_buffer *wb = writer_get_buffer();
+        int len;
+        if (_inpos < _inlen) {
+            if (n > _inlen - _inpos) {
+                n = _inlen - _inpos;
+            }
+            len = normalize_crlf(wb->data, _inbuf+_inpos, n, &pending_cr);
+            _inpos += n;
+        } else {
+            n = read_input(wb->data+1, n);
+            if (!n) {
+                die("Unexpected end of input in literal");
+            }
+            len = normalize_crlf(wb->data, wb->data+1, n, &pending_cr);
+        }
+        remaining -= n;
+        if (sha) {
+            sha256_update(sha, wb->data, len);
+        }
+        writer_submit(wb, fd, offset, len);
+        offset += len;
+    }
+    if (pending_cr) {
+        struct writer_buffer *wb = writer_get_buffer();
+        wb->data[0] = '\r';
+        if (sha) {
+            sha256_update(sha, "\r", 1);
+        }
+        writer_submit(wb, fd, offset, 1);
+        offset++;
+    }
+    return offset;
+}
+
+/* Receives a small literal into buf as a string, anything that does not
+   fit is discarded */
+static void receive_literal_string(int size, char *buf, int bufsize)
+{
+    metric_add(literalbytes, size);
+    release_line();
+    int len = 0;
+    while (size > 0) {
+        int n = size;
+        char *chunk;
+        if (_inpos < _inlen) {
+            if (n > _inlen - _inpos) {
+                n = _inlen - _inpos;
+            }
+            chunk = _inbuf + _inpos;
+            _inpos += n;
+        } else {
+            if (n > LITBUFSIZE) {
+                n = LITBUFSIZE;
+            }
+            n = read_input(_litbuf, n);
+            if (!n) {
+                die("Unexpected end of input in literal");
+            }
+            chunk = _litbuf;
+        }
+        int m = (n < bufsize-1-len) ? n : bufsize-1-len;
+        memcpy(buf+len, chunk, m);
+        len += m;
+        size -= n;
+    }
+    buf[len] = 0;
+}
+
+static void write_raw_output(char *buf, int len)
+{
+    if (_ssl) {
+        while (len > 0) {
+            int n = SSL_write(_ssl, buf, len);
+            if (n <= 0) {
+                die("Unable to write to TLS connection");
+            }
+            metric_add(sentbytes, n);
+            buf += n;
+            len -= n;
+        }
+        return;
+    }
+    if ((fwrite(buf, 1, len, _outfp) != len) || (fflush(_outfp) != 0)) {
+        die("Unable to write output");
+    }
+    metric_add(sentbytes, len);
+}
+
+static void write_output(char *buf, int len)
+{
+    if (!_compressing) {
+        write_raw_output(buf, len);
+        return;
+    }
+    _zout.next_in = (Bytef *)buf;
+    _zout.avail_in = len;
+    do {
+        _zout.next_out = (Bytef *)_zoutbuf;
+        _zout.avail_out = ZBUFSIZE;
+        if (deflate(&_zout, Z_SYNC_FLUSH) == Z_STREAM_ERROR) {
+            die("Unable to deflate output");
+        }
+        write_raw_output(_zoutbuf, ZBUFSIZE - _zout.avail_out);
+    } while (!_zout.avail_out);
+}
+
+static void write_string(char *fmt, ...)
+{
+    va_list args;
+    va_start(args, fmt);
+    int len = vsnprintf(_sendbuf, sizeof(_sendbuf), fmt, args);
+    va_end(args);
+    if (len >= sizeof(_sendbuf)) {
+        die("Command too long");
+    }
+    write_output(_sendbuf, len);
+    start_command_timer(_sendbuf);
+
+tracelog("send '%s'", _sendbuf);
+}
+
+static int file_exists(char *path)
+{
+    struct stat statbuf;
+    if (!stat(path, &statbuf)) {
+        return 1;
+    }
+    return 0;
+}
+
+static FILE *open_file_for_writing(char *path)
+{
+    int fd = open(path, O_WRONLY|O_CREAT|O_EXCL, 0600);
+    if (fd < 0) {
+        return NULL;
+    }
+    FILE *fp = fdopen(fd, "w");
+    return fp;
+}
+
+static char *string_prefix_endp(char *str, char *prefix)
+{
+    int len = strlen(prefix);
+    if (!len) {
+        return NULL;
+    }
+    if (!strncmp(str, prefix, len)) {
+        return str + len;
+    }
+    return NULL;
+}
+
+static char *string_suffix(char *str, char *suffix)
+{
+    int suffixlen = strlen(suffix);
+    if (!suffixlen) {
+        return NULL;
+    }
+    int len = strlen(str);
+    if (len < suffixlen) {
+        return NULL;
+    }
+    char *p = str + len-suffixlen;
+    if (!strcmp(p, suffix)) {
+        return p;
+    }
+    return NULL;
+}
+
+static char *str_validchars_endchar(char *str, char *validchars, char endchar)
+{
+    char *p = str;
+    for(;;) {
+        if (*p == endchar) {
+            if (p == str) {
+                return NULL;
+            }
+            return p;
+        }
+        if (!*p) {
+            return NULL;
+        }
+        if (!strchr(validchars, *p)) {
+            return NULL;
+        }
+        p++;
+    }
+    // not reached
+    return NULL;
+}
+
+static void chomp_string(char *str)
+{
+    int len = strlen(str);
+    if (len > 0) {
+        if (str[len-1] == '\n') {
+            str[len-1] = 0;
+        }
+    }
+}
+
+/* Grows the array at *arrayp of elements of size bytes so that it holds
+   at least count, the new elements are zero. The arrays are sized by the
+   mailbox instead of by MAX_MESSAGES. */
+static void grow_array(void *arrayp, int *capacity, long count, size_t size)
+{
+    if (count <= *capacity) {
+        return;
+    }
+    long newcapacity = *capacity ? *capacity : 1024;
+    while (newcapacity < count) {
+        newcapacity *= 2;
+    }
+    char *array = realloc(*(void **)arrayp, newcapacity*size);
+    if (!array) {
+        die("Out of memory");
+    }
+    memset(array + *capacity*size, 0, (newcapacity - *capacity)*size);
+    *(void **)arrayp = array;
+    *capacity = newcapacity;
+}
+
+static void uid_set_clear(struct uid_set *set)
+{
+    set->count = 0;
+}
+
+/* Returns the index of the first range that ends at or after uid-1, which
+   is the first range that could contain or be adjacent to uid */
+static int uid_set_search(struct uid_set *set, unsigned long uid)
+{
+    int lo = 0;
+    int hi = set->count;
+    while (lo < hi) {
+        int mid = lo + (hi-lo)/2;
+        if (set->ranges[mid].last + 1 < uid) {
+            lo = mid+1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+static void uid_set_add_range(struct uid_set *set, unsigned long first, unsigned long last)
+{
+    if (first > last) {
+        unsigned long tmp = first;
+        first = last;
+        last = tmp;
+    }
+    int i = uid_set_search(set, first);
+    if ((i == set->count) || (set->ranges[i].first > last + 1)) {
+        if (set->count >= MAX_UID_RANGES) {
+            die("Too many uid ranges");
+        }
+        grow_array(&set->ranges, &set->capacity, set->count+1, sizeof(struct uid_range));
+        memmove(&set->ranges[i+1], &set->ranges[i], (set->count-i)*sizeof(struct uid_range));
+        set->ranges[i].first = first;
+        set->ranges[i].last = last;
+        set->count++;
+        return;
+    }
+    struct uid_range *r = &set->ranges[i];
+    if (first < r->first) {
+        r->first = first;
+    }
+    if (last > r->last) {
+        r->last = last;
+    }
+    int j = i+1;
+    while ((j < set->count) && (set->ranges[j].first <= r->last + 1)) {
+        if (set->ranges[j].last > r->last) {
+            r->last = set->ranges[j].last;
+        }
+        j++;
+    }
+    if (j > i+1) {
+        memmove(&set->ranges[i+1], &set->ranges[j], (set->count-j)*sizeof(struct uid_range));
+        set->count -= j-(i+1);
+    }
+}
+
+static void uid_set_add(struct uid_set *set, unsigned long uid)
+{
+    uid_set_add_range(set, uid, uid);
+}
+
+static int uid_set_contains(struct uid_set *set, unsigned long uid)
+{
+    int i = uid_set_search(set, uid);
+    if (i == set->count) {
+        return 0;
+    }
+    if ((uid >= set->ranges[i].first) && (uid <= set->ranges[i].last)) {
+        return 1;
+    }
+    return 0;
+}
+
+static unsigned long uid_set_size(struct uid_set *set)
+{
+    unsigned long size = 0;
+    for (int i=0; i<set->count; i++) {
+        size += set->ranges[i].last - set->ranges[i].first + 1;
+    }
+    return size;
+}
+
+/* Returns the smallest uid in the set that is greater than uid, or 0 */
+static unsigned long uid_set_next(struct uid_set *set, unsigned long uid)
+{
+    int i = uid_set_search(set, uid+1);
+    if (i == set->count) {
+        return 0;
+    }
+    if (set->ranges[i].first > uid) {
+        return set->ranges[i].first;
+    }
+    if (set->ranges[i].last > uid) {
+        return uid+1;
+    }
+    if (i+1 < set->count) {
+        return set->ranges[i+1].first;
+    }
+    return 0;
+}
+
+/* Parses IMAP sequence-set syntax such as '1:5,7,9:*' and adds it to the
+   set, '*' is replaced with maxuid. Returns a pointer to the first
+   character not parsed, or NULL if the syntax is invalid */
+static char *uid_set_parse(struct uid_set *set, char *str, unsigned long maxuid)
+{
+    char *p = str;
+    for(;;) {
+        unsigned long number1;
+        unsigned long number2;
+        char *endp = NULL;
+        if (*p == '*') {
+            number1 = maxuid;
+            endp = p+1;
+        } else {
+            number1 = strtoul(p, &endp, 10);
+            if ((endp == p) || !strchr(DIGITCHARS, *p)) {
+                return NULL;
+            }
+        }
+        p = endp;
+        number2 = number1;
+        if (*p == ':') {
+            p++;
+            if (*p == '*') {
+                number2 = maxuid;
+                endp = p+1;
+            } else {
+                number2 = strtoul(p, &endp, 10);
+                if ((endp == p) || !strchr(DIGITCHARS, *p)) {
+                    return NULL;
+                }
+            }
+            p = endp;
+        }
+        uid_set_add_range(set, number1, number2);
+        if (*p != ',') {
+            return p;
+        }
+        p++;
+    }
+    // not reached
+    return NULL;
+}
+
+/* Formats up to maxuids uids of the set starting at uid start as a compact
+   sequence set such as '1:5,9'. Returns the next uid to format, or 0 when
+   the rest of the set has been formatted */
+static unsigned long uid_set_format(struct uid_set *set, unsigned long start, unsigned long maxuids, char *buf, int bufsize)
+{
+    char *p = buf;
+    char *endp = buf + bufsize;
+    *p = 0;
+    int i = uid_set_search(set, start);
+    while ((i < set->count) && (maxuids > 0)) {
+        unsigned long first = set->ranges[i].first;
+        unsigned long last = set->ranges[i].last;
+        if (first < start) {
+            first = start;
+        }
+        if (last - first + 1 > maxuids) {
+            last = first + maxuids - 1;
+        }
+        char tmp[64];
+        if (first == last) {
+            snprintf(tmp, sizeof(tmp), "%s%lu", (p == buf) ? "" : ",", first);
+        } else {
+            snprintf(tmp, sizeof(tmp), "%s%lu:%lu", (p == buf) ? "" : ",", first, last);
+        }
+        int len = strlen(tmp);
+        if (p + len >= endp) {
+            if (p == buf) {
+                die("Unable to format uid set");
+            }
+            return first;
+        }
+        strcpy(p, tmp);
+        p += len;
+        maxuids -= last - first + 1;
+        start = last + 1;
+        if (last < set->ranges[i].last) {
+            return start;
+        }
+        i++;
+    }
+    if (i < set->count) {
+        return set->ranges[i].first;
+    }
+    return 0;
+}
+
+static int is_filename_uid(char *str)
+{
+    char *p = str;
+    if (*p == '.') {
+        p++;
+        for(;;) {
+            if (!*p) {
+                if (p - str >= 2) {
+                    return 1;
+                }
+                return 0;
+            }
+            if ((*p >= '0') && (*p <= '9')) {
+                p++;
+                continue;
+            }
+            return 0;
+        }
+    }
+    return 0;
+}
+
+static int is_filename_partial_uid(char *str)
+{
+    char buf[64];
+    char *p = string_suffix(str, ".part");
+    if (!p || (p - str >= sizeof(buf))) {
+        return 0;
+    }
+    memcpy(buf, str, p - str);
+    buf[p - str] = 0;
+    return is_filename_uid(buf);
+}
+
+static void read_first_line_from_file(char *filename, char *buf)
+{
+    FILE *fp = fopen(filename, "r");
+    if (!fp) {
+        die("Unable to open '%s'", filename);
+    }
+    if (!fgets(buf, BUFSIZE, fp)) {
+        die("Unable to read line from '%s'", filename);
+    }
+    fclose(fp);
+    chomp_string(buf);
+}
+
+static unsigned long read_optional_number_from_file(char *filename, unsigned long defaultval)
+{
+    if (!file_exists(filename)) {
+        return defaultval;
+    }
+    char buf[BUFSIZE];
+    read_first_line_from_file(filename, buf);
+    char *q = str_validchars_endchar(buf, DIGITCHARS, 0);
+    if (!q) {
+        die("Invalid %s '%s'", filename, buf);
+    }
+    return strtoul(buf, NULL, 10);
+}
+
+static void write_string_to_new_file(char *str, char *path)
+{
+    FILE *fp = open_file_for_writing(path);
+    if (!fp) {
+        die("Unable to create file '%s'", path);
+    }
+    fprintf(fp, "%s", str);
+    fclose(fp);
+}
+
+static int open_current_directory()
+{
+    int dirfd = open(".", O_RDONLY|O_DIRECTORY);
+    if (dirfd < 0) {
+        die("Unable to open current directory");
+    }
+    return dirfd;
+}
+
+/* Returns the position of uid in the index, or where it would be inserted */
+static int index_search(unsigned long uid)
+{
+    int lo = 0;
+    int hi = _indexcount;
+    while (lo < hi) {
+        int mid = lo + (hi-lo)/2;
+        if (_index[mid].uid < uid) {
+            lo = mid+1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+static struct index_record *index_find(unsigned long uid)
+{
+    int i = index_search(uid);
+    if ((i < _indexcount) && (_index[i].uid == uid)) {
+        return &_index[i];
+    }
+    return NULL;
+}
+
+static struct index_record *index_add(unsigned long uid)
+{
+    int i = index_search(uid);
+    if ((i < _indexcount) && (_index[i].uid == uid)) {
+        return &_index[i];
+    }
+    if (_indexcount >= MAX_MESSAGES) {
+        die("Too many messages");
+    }
+    grow_array(&_index, &_indexcapacity, _indexcount+1, sizeof(struct index_record));
+    memmove(&_index[i+1], &_index[i], (_indexcount-i)*sizeof(struct index_record));
+    _indexcount++;
+    memset(&_index[i], 0, sizeof(struct index_record));
+    _index[i].uid = uid;
+    return &_index[i];
+}
+
+/* Messages are staged and made visible in groups: the data of a whole
+   group is flushed with fdatasync() on each file, then every file is
+   linked into place and the directory is fsynced once.  A crash never
+   leaves a partial .UID file behind, at worst the last group is fetched
+   again. */
+
+struct pending_message {
+    int fd;
+    int tmpfile; /* fd is an O_TMPFILE that is linked into place */
+    unsigned long uid;
+    uint64_t size;
+    uint64_t allocated; /* preallocated for the literal, beyond size once the CRs are gone */
+    int64_t internaldate;
+    int flags;
+    int replace;
+    int hashed;
+    unsigned char hash[32];
+};
+
+static struct pending_message _pending[MAX_GROUP_COMMIT];
+static int _pendingcount = 0;
+static int _groupcommit = 0;
+static long _pendingstartms = 0;
+static int _messagedirfd = -1;
+static int _storedirfd = -1;
+static int _storechecked = 0;
+
+static long monotonic_milliseconds()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec*1000 + ts.tv_nsec/1000000;
+}
+
+static int get_group_commit()
+{
+    if (!_groupcommit) {
+        _groupcommit = read_optional_number_from_file(".groupcommit", DEFAULT_GROUP_COMMIT);
+        if (_groupcommit < 1) {
+            _groupcommit = 1;
+        }
+        if (_groupcommit > MAX_GROUP_COMMIT) {
+            _groupcommit = MAX_GROUP_COMMIT;
+        }
+    }
+    return _groupcommit;
+}
+
+/* '.writer' names the backend for message data: io_uring, thread or sync */
+static void select_writer()
+{
+    if ((_writerbackend < 0) || (_writerpid != getpid())) {
+        char name[BUFSIZE];
+        strcpy(name, "io_uring");
+        if (file_exists(".writer")) {
+            read_first_line_from_file(".writer", name);
+        }
+        start_writer(name);
+    }
+}
+
+/* With '.store' naming a directory on the same filesystem, each message
+   is kept there once under its SHA-256, and the .UID files of every
+   folder are hardlinks to it */
+static int get_store_directory()
+{
+    if (!_storechecked) {
+        _storechecked = 1;
+        if (file_exists(".store")) {
+            char path[BUFSIZE];
+            read_first_line_from_file(".store", path);
+            _storedirfd = open(path, O_RDONLY|O_DIRECTORY);
+            if (_storedirfd < 0) {
+                die("Unable to open store directory '%s'", path);
+            }
+        }
+    }
+    return _storedirfd;
+}
+
+static void format_store_name(unsigned char *hash, char *name)
+{
+    for (int i=0; i<32; i++) {
+        sprintf(name+i*2, "%02x", hash[i]);
+    }
+}
+
+static int is_zero_hash(unsigned char *hash)
+{
+    for (int i=0; i<32; i++) {
+        if (hash[i]) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/* Removes the store object once no folder links to it anymore */
+static void release_store_object(unsigned char *hash)
+{
+    char objname[65];
+    format_store_name(hash, objname);
+    struct stat statbuf;
+    if (fstatat(_storedirfd, objname, &statbuf, AT_SYMLINK_NOFOLLOW) != 0) {
+        return;
+    }
+    if (statbuf.st_nlink == 1) {
+tracelog("removing store object '%s'", objname);
+        unlinkat(_storedirfd, objname, 0);
+    }
+}
+
+static void hash_file(int dirfd, char *name, unsigned char *hash)
+{
+    int fd = openat(dirfd, name, O_RDONLY);
+    if (fd < 0) {
+        die("Unable to open '%s'", name);
+    }
+    struct sha256 sha;
+    sha256_init(&sha);
+    for(;;) {
+        int n = read(fd, _litbuf, LITBUFSIZE);
+        if (n < 0) {
+            die("Unable to read '%s'", name);
+        }
+        if (!n) {
+            break;
+        }
+        sha256_update(&sha, _litbuf, n);
+    }
+    close(fd);
+    sha256_final(&sha, hash);
+}
+
+/* Puts the message into the store unless an identical one is there
+   already, then links the store object as linkname */
+static void link_message_from_store(struct pending_message *msg, char *partname, char *linkname)
+{
+    char objname[65];
+    format_store_name(msg->hash, objname);
+    for (int tries=0;; tries++) {
+        int result;
+        if (msg->tmpfile) {
+            char procname[64];
+            snprintf(procname, sizeof(procname), "/proc/self/fd/%d", msg->fd);
+            result = linkat(AT_FDCWD, procname, _storedirfd, objname, AT_SYMLINK_FOLLOW);
+        } else {
+            result = linkat(_messagedirfd, partname, _storedirfd, objname, 0);
+        }
+        if ((result != 0) && (errno != EEXIST)) {
+            die("Unable to link '%s' into the store, it must be on the same filesystem", objname);
+        }
+        if ((linkat(_storedirfd, objname, _messagedirfd, linkname, 0) == 0) || (errno == EEXIST)) {
+            return;
+        }
+        /* another folder may have removed the object in the meantime */
+        if ((errno != ENOENT) || tries) {
+            die("Unable to link '%s'", linkname);
+        }
+    }
+}
+
+static void commit_messages()
+{
+    if (!_pendingcount) {
+        return;
+    }
+debuglog("committing %d messages", _pendingcount);
+    long startus = monotonic_microseconds();
+    writer_wait(1);
+    /* the times are set once the last write has completed, a write
+       would move the mtime again */
+    for (int i=0; i<_pendingcount; i++) {
+        struct pending_message *msg = &_pending[i];
+        if (msg->internaldate) {
+            struct timespec times[2];
+            times[0].tv_sec = msg->internaldate;
+            times[0].tv_nsec = 0;
+            times[1] = times[0];
+            futimens(msg->fd, times);
+        } else {
+            struct stat statbuf;
+            if (fstat(msg->fd, &statbuf) != 0) {
+                die("Unable to stat message %lu", msg->uid);
+            }
+            msg->internaldate = statbuf.st_mtime;
+        }
+    }
+#ifdef __linux__
+    /* truncating to the size the file already has releases the blocks
+       fallocate() reserved past it for the CRs. Then writeback of the
+       whole group is started, so that each fdatasync() mostly waits for
+       writes that are already in flight */
+    for (int i=0; i<_pendingcount; i++) {
+        struct pending_message *msg = &_pending[i];
+        if ((msg->allocated > msg->size) && (ftruncate(msg->fd, msg->size) != 0)) {
+            die("Unable to truncate message %lu", msg->uid);
+        }
+        sync_file_range(msg->fd, 0, 0, SYNC_FILE_RANGE_WRITE);
+    }
+#endif
+    for (int i=0; i<_pendingcount; i++) {
+        long fsyncstartus = monotonic_microseconds();
+        if (fdatasync(_pending[i].fd) != 0) {
+            die("Unable to fdatasync message %lu", _pending[i].uid);
+        }
+        add_fsync_time(fsyncstartus);
+    }
+    for (int i=0; i<_pendingcount; i++) {
+        struct pending_message *msg = &_pending[i];
+        char filename[64];
+        snprintf(filename, sizeof(filename), ".%lu", msg->uid);
+        char partname[64];
+        snprintf(partname, sizeof(partname), ".%lu.part", msg->uid);
+        if (msg->hashed) {
+            link_message_from_store(msg, partname, msg->replace ? partname : filename);
+            close(msg->fd);
+            if (!msg->tmpfile && !msg->replace) {
+                unlinkat(_messagedirfd, partname, 0);
+            }
+            if (msg->replace && (renameat(_messagedirfd, partname, _messagedirfd, filename) != 0)) {
+                die("Unable to rename '%s' to '%s'", partname, filename);
+            }
+            continue;
+        }
+        if (msg->tmpfile) {
+            /* linkat() cannot replace a file, so a replacement is linked
+               under the partial name first */
+            char procname[64];
+            snprintf(procname, sizeof(procname), "/proc/self/fd/%d", msg->fd);
+            char *linkname = msg->replace ? partname : filename;
+            if ((linkat(AT_FDCWD, procname, _messagedirfd, linkname, AT_SYMLINK_FOLLOW) != 0) && (errno != EEXIST)) {
+                die("Unable to link '%s'", linkname);
+            }
+        }
+        close(msg->fd);
+        if (!msg->tmpfile || msg->replace) {
+            if (renameat(_messagedirfd, partname, _messagedirfd, filename) != 0) {
+                die("Unable to rename '%s' to '%s'", partname, filename);
+            }
+        }
+    }
+    long fsyncstartus = monotonic_microseconds();
+    if (fsync(_messagedirfd) != 0) {
+        die("Unable to fsync directory");
+    }
+    add_fsync_time(fsyncstartus);
+    if (_storedirfd >= 0) {
+        fsyncstartus = monotonic_microseconds();
+        if (fsync(_storedirfd) != 0) {
+            die("Unable to fsync store directory");
+        }
+        add_fsync_time(fsyncstartus);
+    }
+    for (int i=0; i<_pendingcount; i++) {
+        struct index_record *rec = index_add(_pending[i].uid);
+        rec->size = _pending[i].size;
+        rec->internaldate = _pending[i].internaldate;
+        rec->flags = _pending[i].flags;
+        if (_pending[i].hashed) {
+            memcpy(rec->hash, _pending[i].hash, 32);
+        } else {
+            memset(rec->hash, 0, 32);
+        }
+    }
+    if (_fetchstartms && (_fetchcommitted < FIRST_MESSAGES_METRIC) && (_fetchcommitted + _pendingcount >= FIRST_MESSAGES_METRIC)) {
+        long ms = monotonic_milliseconds() - _fetchstartms;
+debuglog("time to first %d messages %ld ms", FIRST_MESSAGES_METRIC, ms);
+        /* the first fetch to get there counts, also across processes */
+        uint64_t unset = 0;
+        __atomic_compare_exchange_n(&_metrics->firstmessagesmicroseconds, &unset, (uint64_t)ms*1000, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+    }
+    _fetchcommitted += _pendingcount;
+    metric_add(messageswritten, _pendingcount);
+    _pendingcount = 0;
+    add_phase_time(PHASE_COMMIT, startus);
+}
+
+static void close_message_directory()
+{
+    commit_messages();
+    stop_writer();
+    if (_messagedirfd >= 0) {
+        close(_messagedirfd);
+        _messagedirfd = -1;
+    }
+    if (_storedirfd >= 0) {
+        close(_storedirfd);
+        _storedirfd = -1;
+    }
+    _storechecked = 0;
+    _groupcommit = 0;
+}
+
+#define MESSAGE_SEEN 1
+#define MESSAGE_FLAGGED 2
+#define MESSAGE_ANSWERED 4
+#define MESSAGE_FLAGS (MESSAGE_SEEN|MESSAGE_FLAGGED|MESSAGE_ANSWERED)
+#define MESSAGE_PARTIAL 8 /* only the header has been downloaded */
+#define MESSAGE_PACKED 16 /* the message is in .pack.N and has no file or number */
+
+static int message_flag(char *p, int len)
+{
+    if ((len == 5) && !strncasecmp(p, "\\Seen", 5)) {
+        return MESSAGE_SEEN;
+    }
+    if ((len == 8) && !strncasecmp(p, "\\Flagged", 8)) {
+        return MESSAGE_FLAGGED;
+    }
+    if ((len == 9) && !strncasecmp(p, "\\Answered", 9)) {
+        return MESSAGE_ANSWERED;
+    }
+    return 0;
+}
+
+/* The flags are kept in the MH sequences unseen, flagged and replied,
+   messages without a body in partial, all other lines of .mh_sequences
+   are left alone */
+static struct {
+    char *name;
+    int flag;
+    int value;
+} _sequences[] = {
+    { "unseen", MESSAGE_SEEN, 0 },
+    { "flagged", MESSAGE_FLAGGED, MESSAGE_FLAGGED },
+    { "replied", MESSAGE_ANSWERED, MESSAGE_ANSWERED },
+    { "partial", MESSAGE_PARTIAL, MESSAGE_PARTIAL },
+};
+#define NUM_SEQUENCES (sizeof(_sequences)/sizeof(_sequences[0]))
+
+/* The flags of the message with each number while .mh_sequences is read */
+static uint64_t **_msgnumflags;
+static int _msgnumflagscapacity;
+
+static int find_sequence(char *line)
+{
+    for (int i=0; i<NUM_SEQUENCES; i++) {
+        int len = strlen(_sequences[i].name);
+        if (!strncmp(line, _sequences[i].name, len) && (line[len] == ':')) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/* Sets and clears the flags in _msgnumflags from .mh_sequences */
+static void apply_mh_sequences(unsigned long maxmsgnum)
+{
+    FILE *fp = fopen(".mh_sequences", "r");
+    if (!fp) {
+        return;
+    }
+    char *line = NULL;
+    size_t linesize = 0;
+    while (getline(&line, &linesize, fp) > 0) {
+        int seq = find_sequence(line);
+        if (seq < 0) {
+            continue;
+        }
+        char *p = strchr(line, ':') + 1;
+        for(;;) {
+            char *endp = NULL;
+            unsigned long first = strtoul(p, &endp, 10);
+            if (p == endp) {
+                break;
+            }
+            unsigned long last = first;
+            p = endp;
+            if (*p == '-') {
+                p++;
+                last = strtoul(p, &endp, 10);
+                if (p == endp) {
+                    break;
+                }
+                p = endp;
+            }
+            for (unsigned long msgnum=first; (msgnum<=last) && (msgnum<=maxmsgnum); msgnum++) {
+                uint64_t *flags = _msgnumflags[msgnum];
+                if (!flags) {
+                    continue;
+                }
+                if (_sequences[seq].value) {
+                    *flags |= _sequences[seq].flag;
+                } else {
+                    *flags &= ~_sequences[seq].flag;
+                }
+            }
+        }
+    }
+    free(line);
+    fclose(fp);
+}
+
+/* Sets the flags of the index from .mh_sequences, messages that are not
+   in the unseen sequence are seen */
+static void read_mh_sequences()
+{
+    grow_array(&_msgnumflags, &_msgnumflagscapacity, _indexmaxmsgnum+1, sizeof(uint64_t *));
+    for (int i=0; i<_indexcount; i++) {
+        if (_index[i].flags & MESSAGE_PACKED) {
+            continue;
+        }
+        _index[i].flags = MESSAGE_SEEN;
+        if (_index[i].msgnum) {
+            grow_array(&_msgnumflags, &_msgnumflagscapacity, _index[i].msgnum+1, sizeof(uint64_t *));
+            _msgnumflags[_index[i].msgnum] = &_index[i].flags;
+        }
+    }
+    apply_mh_sequences(_indexmaxmsgnum);
+    for (int i=0; i<_indexcount; i++) {
+        if (!(_index[i].flags & MESSAGE_PACKED)) {
+            _msgnumflags[_index[i].msgnum] = NULL;
+        }
+    }
+}
+
+static void write_mh_sequence(FILE *fp, int seq)
+{
+    unsigned long first = 0;
+    unsigned long last = 0;
+    for (int i=0; i<_indexcount; i++) {
+        struct index_record *rec = &_index[i];
+        if (!rec->msgnum || ((rec->flags & _sequences[seq].flag) != _sequences[seq].value)) {
+            continue;
+        }
+        if (first && (rec->msgnum == last+1)) {
+            last = rec->msgnum;
+            continue;
+        }
+        if (first) {
+            fprintf(fp, (first == last) ? " %lu" : " %lu-%lu", first, last);
+        } else {
+            fprintf(fp, "%s:", _sequences[seq].name);
+        }
+        first = last = rec->msgnum;
+    }
+    if (first) {
+        fprintf(fp, (first == last) ? " %lu\n" : " %lu-%lu\n", first, last);
+    }
+}
+
+/* Rewrites .mh_sequences in one pass from the flags in the index */
+static void write_mh_sequences()
+{
+    FILE *fp = fopen(".mh_sequences.tmp", "w");
+    if (!fp) {
+        die("Unable to create .mh_sequences.tmp");
+    }
+    FILE *oldfp = fopen(".mh_sequences", "r");
+    if (oldfp) {
+        char *line = NULL;
+        size_t linesize = 0;
+        while (getline(&line, &linesize, oldfp) > 0) {
+            if (find_sequence(line) < 0) {
+                fputs(line, fp);
+            }
+        }
+        free(line);
+        fclose(oldfp);
+    }
+    for (int i=0; i<NUM_SEQUENCES; i++) {
+        write_mh_sequence(fp, i);
+    }
+    if (fclose(fp) != 0) {
+        die("Unable to write .mh_sequences.tmp");
+    }
+    if (rename(".mh_sequences.tmp", ".mh_sequences") != 0) {
+        die("Unable to rename .mh_sequences.tmp");
+    }
+}
+
+/* Packed messages live in '.pack.N' as raw deflate streams, each after a
+   pack_record_header. '.packidx' lists them sorted by uid with fixed size
+   entries so that it can be mapped and searched in place. Removing a
+   packed message only sets its tombstone, compaction copies the live
+   records into '.pack.N+1' and switches to it by renaming '.packidx'. */
+struct pack_header {
+    char magic[8];
+    uint64_t generation;
+    uint64_t count;
+    uint64_t deadbytes;
+};
+
+struct pack_entry {
+    uint64_t uid;
+    uint64_t offset;
+    uint64_t clen;
+    uint64_t rlen;
+    int64_t internaldate;
+    uint64_t flags;
+    uint64_t tombstone;
+};
+
+struct pack_record_header {
+    uint64_t uid;
+    uint64_t clen;
+    uint64_t rlen;
+    int64_t internaldate;
+};
+
+static int _packidxfd = -1;
+static struct pack_header *_packheader;
+static struct pack_entry *_packentries;
+static size_t _packmapsize;
+
+static void unmap_pack_index()
+{
+    if (_packheader) {
+        munmap(_packheader, _packmapsize);
+        _packheader = NULL;
+        _packentries = NULL;
+    }
+    if (_packidxfd >= 0) {
+        close(_packidxfd);
+        _packidxfd = -1;
+    }
+}
+
+/* Returns 0 if the folder has no .packidx */
+static int map_pack_index()
+{
+    if (_packheader) {
+        return 1;
+    }
+    _packidxfd = open(".packidx", O_RDWR);
+    if (_packidxfd < 0) {
+        return 0;
+    }
+    struct stat statbuf;
+    if (fstat(_packidxfd, &statbuf) != 0) {
+        die("Unable to stat .packidx");
+    }
+    _packmapsize = statbuf.st_size;
+    if (_packmapsize < sizeof(struct pack_header)) {
+        die("Invalid .packidx");
+    }
+    _packheader = mmap(NULL, _packmapsize, PROT_READ, MAP_SHARED, _packidxfd, 0);
+    if (_packheader == MAP_FAILED) {
+        die("Unable to map .packidx");
+    }
+    _packentries = (struct pack_entry *)(_packheader + 1);
+    if (memcmp(_packheader->magic, PACK_MAGIC, 8)
+     || (sizeof(struct pack_header) + _packheader->count*sizeof(struct pack_entry) != _packmapsize))
+    {
+        die("Invalid .packidx");
+    }
+    return 1;
+}
+
+static struct pack_entry *find_pack_entry(unsigned long uid)
+{
+    if (!map_pack_index()) {
+        return NULL;
+    }
+    int lo = 0;
+    int hi = _packheader->count;
+    while (lo < hi) {
+        int mid = lo + (hi-lo)/2;
+        if (_packentries[mid].uid < uid) {
+            lo = mid+1;
+        } else {
+            hi = mid;
+        }
+    }
+    if ((lo < _packheader->count) && (_packentries[lo].uid == uid) && !_packentries[lo].tombstone) {
+        return &_packentries[lo];
+    }
+    return NULL;
+}
+
+static void tombstone_pack_entry(struct pack_entry *entry)
+{
+    uint64_t one = 1;
+    off_t offset = (char *)&entry->tombstone - (char *)_packheader;
+    if (pwrite(_packidxfd, &one, sizeof(one), offset) != sizeof(one)) {
+        die("Unable to write .packidx");
+    }
+    uint64_t deadbytes = _packheader->deadbytes + sizeof(struct pack_record_header) + entry->clen;
+    offset = (char *)&_packheader->deadbytes - (char *)_packheader;
+    if (pwrite(_packidxfd, &deadbytes, sizeof(deadbytes), offset) != sizeof(deadbytes)) {
+        die("Unable to write .packidx");
+    }
+tracelog("tombstoned packed uid %lu", (unsigned long)entry->uid);
+}
+
+static void rebuild_index()
+{
+    _indexcount = 0;
+    _indexmaxmsgnum = 0;
+
+    int dirfd = open_current_directory();
+    DIR *dir = fdopendir(dup(dirfd));
+    if (!dir) {
+        die("Unable to open current directory");
+    }
+    for(;;) {
+        struct dirent *ent = readdir(dir);
+        if (!ent) {
+            break;
+        }
+        char *p = ent->d_name;
+        if (is_filename_uid(p)) {
+            struct stat statbuf;
+            if (fstatat(dirfd, p, &statbuf, AT_SYMLINK_NOFOLLOW) != 0) {
+                die("Unable to stat '%s'", p);
+            }
+            struct index_record *rec = index_add(strtoul(p+1, NULL, 10));
+            rec->size = statbuf.st_size;
+            rec->internaldate = statbuf.st_mtime;
+            if ((statbuf.st_nlink > 1) && (get_store_directory() >= 0)) {
+                hash_file(dirfd, p, rec->hash);
+            }
+        } else if (is_filename_partial_uid(p)) {
+debuglog("discarding partial message '%s'", p);
+            if (unlinkat(dirfd, p, 0) != 0) {
+                die("Unable to unlink '%s'", p);
+            }
+        }
+    }
+    rewinddir(dir);
+    for(;;) {
+        struct dirent *ent = readdir(dir);
+        if (!ent) {
+            break;
+        }
+        char *p = ent->d_name;
+        if (!str_validchars_endchar(p, DIGITCHARS, 0)) {
+            continue;
+        }
+        char target[64];
+        int len = readlinkat(dirfd, p, target, sizeof(target)-1);
+        if ((len < 0) && (errno == EINVAL)) {
+tracelog("'%s' is not a symlink, it is uploaded by push", p);
+            continue;
+        }
+        if (len < 0) {
+            die("File '%s' is not a symlink", p);
+        }
+        target[len] = 0;
+        unsigned long msgnum = strtoul(p, NULL, 10);
+        if ((msgnum < 1) || (msgnum > MAX_MESSAGES)) {
+            die("Message number '%s' out of range", p);
+        }
+        if (msgnum > _indexmaxmsgnum) {
+            _indexmaxmsgnum = msgnum;
+        }
+        if (is_filename_uid(target)) {
+            struct index_record *rec = index_find(strtoul(target+1, NULL, 10));
+            if (rec) {
+                rec->msgnum = msgnum;
+            }
+        }
+    }
+    closedir(dir);
+    close(dirfd);
+    if (map_pack_index()) {
+        /* a file that is still there wins over its packed copy */
+        for (uint64_t i=0; i<_packheader->count; i++) {
+            struct pack_entry *entry = &_packentries[i];
+            if (entry->tombstone || index_find(entry->uid)) {
+                continue;
+            }
+            struct index_record *rec = index_add(entry->uid);
+            rec->size = entry->rlen;
+            rec->internaldate = entry->internaldate;
+            rec->flags = entry->flags | MESSAGE_PACKED;
+        }
+    }
+    read_mh_sequences();
+debuglog("rebuilt .index with %d messages", _indexcount);
+}
+
+static void load_index()
+{
+    if (_indexloaded) {
+        return;
+    }
+    _indexloaded = 1;
+    _indexcount = 0;
+    _indexmaxmsgnum = 0;
+    int fd = open(".index", O_RDONLY);
+    if (fd < 0) {
+        rebuild_index();
+        return;
+    }
+    struct index_header hdr;
+    if ((read(fd, &hdr, sizeof(hdr)) != sizeof(hdr))
+     || memcmp(hdr.magic, INDEX_MAGIC, 8)
+     || !hdr.clean
+     || (hdr.count > MAX_MESSAGES))
+    {
+        close(fd);
+debuglog(".index is not clean, rebuilding");
+        rebuild_index();
+        return;
+    }
+    grow_array(&_index, &_indexcapacity, hdr.count, sizeof(struct index_record));
+    int len = hdr.count*sizeof(struct index_record);
+    if (read(fd, _index, len) != len) {
+        close(fd);
+debuglog(".index is truncated, rebuilding");
+        rebuild_index();
+        return;
+    }
+    close(fd);
+    _indexcount = hdr.count;
+    _indexmaxmsgnum = hdr.maxmsgnum;
+}
+
+static void unload_index()
+{
+    close_message_directory();
+    _indexloaded = 0;
+    _indexcount = 0;
+    _indexmaxmsgnum = 0;
+}
+
+static void mark_index_dirty()
+{
+    int fd = open(".index", O_WRONLY);
+    if (fd < 0) {
+        return;
+    }
+    struct index_header hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, INDEX_MAGIC, 8);
+    if (pwrite(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr)) {
+        die("Unable to write .index");
+    }
+    fdatasync(fd);
+    close(fd);
+}
+
+static void save_index()
+{
+    commit_messages();
+    unlink(".index.tmp");
+    int fd = open(".index.tmp", O_WRONLY|O_CREAT|O_EXCL, 0600);
+    if (fd < 0) {
+        die("Unable to create .index.tmp");
+    }
+    struct index_header hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, INDEX_MAGIC, 8);
+    hdr.count = _indexcount;
+    hdr.maxmsgnum = _indexmaxmsgnum;
+    hdr.clean = 1;
+    write_all(fd, (char *)&hdr, sizeof(hdr));
+    write_all(fd, (char *)_index, _indexcount*sizeof(struct index_record));
+    long startus = monotonic_microseconds();
+    if (fsync(fd) != 0) {
+        die("Unable to fsync .index.tmp");
+    }
+    add_fsync_time(startus);
+    close(fd);
+    if (rename(".index.tmp", ".index") != 0) {
+        die("Unable to rename .index.tmp");
+    }
+}
+
+/* Returns whether message number msgnum is held by a file that is not
+   a symlink, such as a message added with inc that push has not
+   uploaded yet. Such numbers are skipped when numbering. */
+static int is_message_number_held(int dirfd, int msgnum)
+{
+    char name[64];
+    snprintf(name, sizeof(name), "%d", msgnum);
+    struct stat statbuf;
+    return (fstatat(dirfd, name, &statbuf, AT_SYMLINK_NOFOLLOW) == 0) && !S_ISLNK(statbuf.st_mode);
+}
+
+/* Points message number msgnum at the file of uid, or only removes the
+   number if uid is 0. Anything at that name that is not a symlink was
+   not made by imap-mh and is never removed. */
+static void set_message_symlink(int dirfd, int msgnum, unsigned long uid)
+{
+    char name[64];
+    char target[64];
+    snprintf(name, sizeof(name), "%d", msgnum);
+    struct stat statbuf;
+    if (fstatat(dirfd, name, &statbuf, AT_SYMLINK_NOFOLLOW) == 0) {
+        if (!S_ISLNK(statbuf.st_mode) && !uid) {
+debuglog("'%s' is not a symlink, it is left for push", name);
+            return;
+        }
+        if (!S_ISLNK(statbuf.st_mode)) {
+            die("File '%s' is not a symlink", name);
+        }
+        if (unlinkat(dirfd, name, 0) != 0) {
+            die("Unable to unlink '%s'", name);
+        }
+    } else if (errno != ENOENT) {
+        die("Unable to stat '%s'", name);
+    }
+    if (uid) {
+        snprintf(target, sizeof(target), ".%lu", uid);
+        if (symlinkat(target, dirfd, name) != 0) {
+            die("Unable to symlink '%s' -> '%s'", name, target);
+        }
+    }
+}
+
+/* Removes the messages in the set and their symlinks, packed messages
+   are tombstoned in .packidx */
+static void index_remove_set(struct uid_set *set)
+{
+    commit_messages();
+    if (!set->count) {
+        return;
+    }
+    long startus = monotonic_microseconds();
+    int dirfd = open_current_directory();
+    int storedirfd = get_store_directory();
+    int packed = map_pack_index();
+    int tombstoned = 0;
+    int n = 0;
+    for (int i=0; i<_indexcount; i++) {
+        struct index_record *rec = &_index[i];
+        if (!uid_set_contains(set, rec->uid)) {
+            _index[n++] = *rec;
+            continue;
+        }
+        char filename[64];
+        snprintf(filename, sizeof(filename), ".%lu", (unsigned long)rec->uid);
+        if ((unlinkat(dirfd, filename, 0) != 0) && (errno != ENOENT)) {
+            die("Unable to unlink '%s'", filename);
+        }
+tracelog("unlinked '%s'", filename);
+        if ((storedirfd >= 0) && !is_zero_hash(rec->hash)) {
+            release_store_object(rec->hash);
+        }
+        if (rec->msgnum) {
+            set_message_symlink(dirfd, rec->msgnum, 0);
+        }
+        struct pack_entry *entry = packed ? find_pack_entry(rec->uid) : NULL;
+        if (entry) {
+            tombstone_pack_entry(entry);
+            tombstoned++;
+        }
+    }
+    if (tombstoned && (fdatasync(_packidxfd) != 0)) {
+        die("Unable to sync .packidx");
+    }
+    _indexcount = n;
+    close(dirfd);
+    add_phase_time(PHASE_VANISH, startus);
+}
+
+/* Numbers the messages 1..N in uid order, keeping the symlinks before the
+   first message number that changed and rewriting the ones after it.
+   Packed messages are not numbered, and numbers held by plain files are
+   skipped. */
+static void renumber_message_symlinks(int dirfd)
+{
+    int changed = 0;
+    int msgnum = 0;
+    for (int i=0; i<_indexcount; i++) {
+        struct index_record *rec = &_index[i];
+        if (rec->flags & MESSAGE_PACKED) {
+            continue;
+        }
+        msgnum++;
+        if (rec->msgnum == msgnum) {
+            continue;
+        }
+        while (is_message_number_held(dirfd, msgnum)) {
+            msgnum++;
+        }
+        if (msgnum > MAX_MESSAGES) {
+            die("Too many messages");
+        }
+        if (rec->msgnum == msgnum) {
+            continue;
+        }
+        set_message_symlink(dirfd, msgnum, rec->uid);
+        rec->msgnum = msgnum;
+        changed++;
+    }
+    for (int i=msgnum+1; i<=_indexmaxmsgnum; i++) {
+        set_message_symlink(dirfd, i, 0);
+        changed++;
+    }
+    _indexmaxmsgnum = msgnum;
+debuglog("renumbered %d message symlinks", changed);
+}
+
+/* Keeps existing message numbers and appends new messages after the
+   highest number, the symlinks of removed messages are already gone.
+   Numbers held by plain files are skipped. */
+static void append_message_symlinks(int dirfd)
+{
+    int changed = 0;
+    int maxmsgnum = 0;
+    for (int i=0; i<_indexcount; i++) {
+        if (_index[i].msgnum > maxmsgnum) {
+            maxmsgnum = _index[i].msgnum;
+        }
+    }
+    for (int i=maxmsgnum+1; i<=_indexmaxmsgnum; i++) {
+        set_message_symlink(dirfd, i, 0);
+    }
+    for (int i=0; i<_indexcount; i++) {
+        struct index_record *rec = &_index[i];
+        if (rec->msgnum || (rec->flags & MESSAGE_PACKED)) {
+            continue;
+        }
+        maxmsgnum++;
+        while (is_message_number_held(dirfd, maxmsgnum)) {
+            maxmsgnum++;
+        }
+        if (maxmsgnum > MAX_MESSAGES) {
+            die("Too many messages");
+        }
+        set_message_symlink(dirfd, maxmsgnum, rec->uid);
+        rec->msgnum = maxmsgnum;
+        changed++;
+    }
+    _indexmaxmsgnum = maxmsgnum;
+debuglog("appended %d message symlinks", changed);
+}
+
+static int is_stable_numbering()
+{
+    if (!file_exists(".numbering")) {
+        return 0;
+    }
+    char buf[BUFSIZE];
+    read_first_line_from_file(".numbering", buf);
+    if (!strcmp(buf, "stable")) {
+        return 1;
+    }
+    if (!strcmp(buf, "compact")) {
+        return 0;
+    }
+    die("Invalid .numbering '%s', expecting 'stable' or 'compact'", buf);
+    return 0;
+}
+
+static void update_message_symlinks()
+{
+    int dirfd = open_current_directory();
+    if (is_stable_numbering()) {
+        append_message_symlinks(dirfd);
+    } else {
+        renumber_message_symlinks(dirfd);
+    }
+    close(dirfd);
+    write_mh_sequences();
+}
+
+/* Parses an INTERNALDATE such as '17-Jul-1996 02:44:25 -0700' */
+static time_t parse_internaldate(char *str)
+{
+    static char *months[] = { "Jan", "Feb", "Mar", "Apr", "May", "Jun", "Jul", "Aug", "Sep", "Oct", "Nov", "Dec" };
+    /* parsed by hand, sscanf() was half the time spent on a FETCH line */
+    char *p = str;
+    char *endp = NULL;
+    int day = strtol(p, &endp, 10);
+    if ((endp == p) || (*endp != '-')) {
+        return 0;
+    }
+    p = endp+1;
+    int month = -1;
+    for (int i=0; i<12; i++) {
+        if (!strncmp(p, months[i], 3)) {
+            month = i;
+            break;
+        }
+    }
+    if ((month < 0) || (p[3] != '-')) {
+        return 0;
+    }
+    p += 4;
+    int year = strtol(p, &endp, 10);
+    if ((endp == p) || (*endp != ' ')) {
+        return 0;
+    }
+    p = endp+1;
+    int hour = strtol(p, &endp, 10);
+    if ((endp == p) || (*endp != ':')) {
+        return 0;
+    }
+    p = endp+1;
+    int min = strtol(p, &endp, 10);
+    if ((endp == p) || (*endp != ':')) {
+        return 0;
+    }
+    p = endp+1;
+    int sec = strtol(p, &endp, 10);
+    if ((endp == p) || (*endp != ' ')) {
+        return 0;
+    }
+    char sign = endp[1];
+    if ((sign != '+') && (sign != '-')) {
+        return 0;
+    }
+    p = endp+2;
+    int zone = strtol(p, &endp, 10);
+    if (endp == p) {
+        return 0;
+    }
+    /* days since the epoch of a proleptic Gregorian date */
+    int y = year - (month < 2);
+    int era = (y >= 0 ? y : y-399) / 400;
+    int yoe = y - era*400;
+    int m = month + 1;
+    int doy = (153*(m + (m > 2 ? -3 : 9)) + 2)/5 + day-1;
+    int doe = yoe*365 + yoe/4 - yoe/100 + doy;
+    long days = (long)era*146097 + doe - 719468;
+    long offset = ((zone/100)*60 + zone%100)*60;
+    if (sign == '-') {
+        offset = -offset;
+    }
+    return days*86400 + hour*3600 + min*60 + sec - offset;
+}
+
+static void wait_for_initial_ok()
+{
+    read_line();
+    if (!string_prefix_endp(_buf, "* OK")) {
+        die("Expecting OK but received '%s'", _buf);
+    }
+}
+
+static char _capabilities[BUFSIZE];
+
+static void save_capabilities(char *str)
+{
+    snprintf(_capabilities, sizeof(_capabilities), " %s", str);
+    char *p = strpbrk(_capabilities, "]\r\n");
+    if (p) {
+        *p = 0;
+    }
+}
+
+static int has_capability(char *name)
+{
+    int len = strlen(name);
+    char *p = _capabilities;
+    for(;;) {
+        p = strcasestr(p, name);
+        if (!p) {
+            return 0;
+        }
+        if ((p[-1] == ' ') && (!p[len] || (p[len] == ' '))) {
+            return 1;
+        }
+        p += len;
+    }
+}
+
+static void do_capability()
+{
+    write_string("capability capability\r\n");
+    for(;;) {
+        read_line();
+        if (string_prefix_endp(_buf, "capability OK")) {
+            break;
+        }
+        if (string_prefix_endp(_buf, "capability NO")
+         || string_prefix_endp(_buf, "capability BAD"))
+        {
+            die("Unable to get capabilities '%s'", _buf);
+        }
+        char *p = string_prefix_endp(_buf, "* CAPABILITY ");
+        if (p) {
+            save_capabilities(p);
+        }
+    }
+}
+
+static void end_compression()
+{
+    if (!_compressing) {
+        return;
+    }
+    unsigned long received = _zin.total_in;
+    unsigned long inflated = _zin.total_out;
+    unsigned long sent = _zout.total_out;
+    unsigned long deflated = _zout.total_in;
+debuglog("COMPRESS received %lu bytes as %lu (%.1f%%), sent %lu bytes as %lu (%.1f%%), saved %ld bytes",
+    inflated, received, inflated ? 100.0*received/inflated : 100.0,
+    deflated, sent, deflated ? 100.0*sent/deflated : 100.0,
+    (long)(inflated + deflated) - (long)(received + sent));
+    inflateEnd(&_zin);
+    deflateEnd(&_zout);
+    _compressing = 0;
+    _zarenaused = 0;
+}
+
+/* Turns on COMPRESS=DEFLATE if the server advertises it */
+static void do_compress()
+{
+    if (!has_capability("COMPRESS=DEFLATE")) {
+debuglog("server does not support COMPRESS=DEFLATE");
+        return;
+    }
+    write_string("compress compress deflate\r\n");
+    for(;;) {
+        read_line();
+        if (string_prefix_endp(_buf, "compress OK")) {
+            break;
+        }
+        if (string_prefix_endp(_buf, "compress NO")
+         || string_prefix_endp(_buf, "compress BAD"))
+        {
+debuglog("Unable to compress '%s'", _buf);
+            return;
+        }
+    }
+
+    memset(&_zin, 0, sizeof(_zin));
+    memset(&_zout, 0, sizeof(_zout));
+    _zin.zalloc = _zout.zalloc = zarena_alloc;
+    _zin.zfree = _zout.zfree = zarena_free;
+    _zarenaused = 0;
+    if ((inflateInit2(&_zin, -15) != Z_OK)
+     || (deflateInit2(&_zout, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK))
+    {
+        die("Unable to initialize zlib");
+    }
+    /* anything after the OK is already compressed */
+    release_line();
+    int n = _inlen - _inpos;
+    memcpy(_zinbuf, _inbuf+_inpos, n);
+    _inpos = _inlen;
+    _zin.next_in = (Bytef *)_zinbuf;
+    _zin.avail_in = n;
+    _compressing = 1;
+}
+
+static void do_login(char *username, char *password)
+{
+    long startus = monotonic_microseconds();
+    _capabilities[0] = 0;
+    /* not write_string(), so that the password is not logged */
+    int len = snprintf(_sendbuf, sizeof(_sendbuf), "login login %s %s\r\n", username, password);
+    if (len >= sizeof(_sendbuf)) {
+        die("Command too long");
+    }
+    write_output(_sendbuf, len);
+    start_command_timer(_sendbuf);
+tracelog("send 'login login %s ****'", username);
+    for(;;) {
+        read_line();
+        char *p = strstr(_buf, "[CAPABILITY ");
+        if (p) {
+            save_capabilities(p+12);
+        }
+        p = string_prefix_endp(_buf, "* CAPABILITY ");
+        if (p) {
+            save_capabilities(p);
+        }
+        if (string_prefix_endp(_buf, "login OK")) {
+            break;
+        }
+        if (string_prefix_endp(_buf, "login NO")
+         || string_prefix_endp(_buf, "login BAD"))
+        {
+            die("Unable to login '%s'", _buf);
+        }
+    }
+    if (!_capabilities[0]) {
+        do_capability();
+    }
+    do_compress();
+    add_phase_time(PHASE_LOGIN, startus);
+}
+
+static void do_logout()
+{
+    write_string("logout logout\r\n");
+    for(;;) {
+        read_line();
+        if (string_prefix_endp(_buf, "logout OK")) {
+            break;
+        }
+        if (string_prefix_endp(_buf, "logout NO")
+         || string_prefix_endp(_buf, "logout BAD"))
+        {
+            debuglog("Unable to logout '%s'", _buf);
+            break;
+        }
+    }
+    end_compression();
+}
+
+static void do_enable_qresync()
+{
+    write_string("qresync enable qresync\r\n");
+    for(;;) {
+        read_line();
+        if (string_prefix_endp(_buf, "qresync OK")) {
+            break;
+        }
+        if (string_prefix_endp(_buf, "qresync NO")
+         || string_prefix_endp(_buf, "qresync BAD"))
+        {
+            die("Unable to enable qresync '%s'", _buf);
+        }
+    }
+}
+
+/* Receives a message literal into a new file. It is queued for the next
+   group commit by finish_message_file() once the rest of the response,
+   which may hold its flags and INTERNALDATE, has been parsed. The file
+   stays open until the commit, its writes may still be in flight. */
+static void receive_message_file(unsigned long uid, int fetch_size, int partial, int replace)
+{
+    if (_messagedirfd < 0) {
+        _messagedirfd = open_current_directory();
+    }
+
+    int emailfd = -1;
+#ifdef O_TMPFILE
+    emailfd = openat(_messagedirfd, ".", O_TMPFILE|O_WRONLY, 0600);
+#endif
+    int tmpfile = (emailfd >= 0);
+    char partname[64];
+    snprintf(partname, sizeof(partname), ".%lu.part", uid);
+    if (tmpfile && replace) {
+        unlinkat(_messagedirfd, partname, 0);
+    }
+    if (!tmpfile) {
+        emailfd = openat(_messagedirfd, partname, O_WRONLY|O_CREAT|O_TRUNC, 0600);
+        if (emailfd < 0) {
+            die("Unable to create file '%s'", partname);
+        }
+    }
+#ifdef __linux__
+    /* the literal is at least as long as the file, which loses the CRs,
+       commit_messages() releases what is left over */
+    if (fetch_size > 0) {
+        fallocate(emailfd, FALLOC_FL_KEEP_SIZE, 0, fetch_size);
+    }
+#endif
+
+    struct sha256 sha;
+    int hashed = (get_store_directory() >= 0) && !partial;
+    if (hashed) {
+        sha256_init(&sha);
+    }
+    select_writer();
+    int size = receive_literal(emailfd, fetch_size, hashed ? &sha : NULL);
+tracelog("success");
+
+    struct pending_message *msg = &_pending[_pendingcount];
+    msg->fd = emailfd;
+    msg->tmpfile = tmpfile;
+    msg->uid = uid;
+    msg->size = size;
+    msg->allocated = (fetch_size > 0) ? fetch_size : 0;
+    msg->internaldate = 0;
+    msg->flags = partial ? MESSAGE_PARTIAL : 0;
+    msg->replace = replace;
+    msg->hashed = hashed;
+    if (hashed) {
+        sha256_final(&sha, msg->hash);
+    }
+}
+
+static void finish_message_file(time_t internaldate, int flags, unsigned long rfc822size)
+{
+    struct pending_message *msg = &_pending[_pendingcount];
+    msg->internaldate = internaldate;
+    msg->flags |= flags;
+    /* only the header is in the file, the index has the size of the
+       whole message on the server */
+    if ((msg->flags & MESSAGE_PARTIAL) && rfc822size) {
+        msg->size = rfc822size;
+    }
+
+    if (!_pendingcount) {
+        _pendingstartms = monotonic_milliseconds();
+    }
+    _pendingcount++;
+    if ((_pendingcount >= get_group_commit())
+     || (monotonic_milliseconds() - _pendingstartms >= GROUP_COMMIT_MILLISECONDS))
+    {
+        commit_messages();
+    }
+}
+
+/* A tokenizer for the parts of a response after the first few words. It
+   works in place on the line in _buf, and a literal anywhere in the
+   response is returned as TOKEN_LITERAL with the size in num. Once the
+   caller has consumed the literal, read_line() gives the rest of the
+   response. */
+#define TOKEN_END 0
+#define TOKEN_ATOM 1
+#define TOKEN_QUOTED 2
+#define TOKEN_LITERAL 3
+#define TOKEN_OPEN 4
+#define TOKEN_CLOSE 5
+
+struct token {
+    int type;
+    char *str;
+    int len;
+    unsigned long num;
+};
+
+static int next_token(char **pp, struct token *tok)
+{
+    char *p = *pp;
+    while (*p == ' ') {
+        p++;
+    }
+    tok->str = p;
+    tok->len = 0;
+    tok->num = 0;
+    if (!*p || (*p == '\r') || (*p == '\n')) {
+        tok->type = TOKEN_END;
+    } else if (*p == '(') {
+        tok->type = TOKEN_OPEN;
+        p++;
+    } else if (*p == ')') {
+        tok->type = TOKEN_CLOSE;
+        p++;
+    } else if (*p == '"') {
+        /* unquoted in place */
+        tok->type = TOKEN_QUOTED;
+        tok->str = ++p;
+        char *q = p;
+        while (*p && (*p != '"')) {
+            if ((*p == '\\') && p[1]) {
+                p++;
+            }
+            *q++ = *p++;
+        }
+        if (*p != '"') {
+            die("Unterminated quoted string '%s'", tok->str);
+        }
+        tok->len = q - tok->str;
+        p++;
+    } else if (*p == '{') {
+        char *endp = NULL;
+        tok->type = TOKEN_LITERAL;
+        tok->num = strtoul(p+1, &endp, 10);
+        if (endp == p+1) {
+            die("Invalid literal '%s'", p);
+        }
+        p = endp;
+        if (*p == '+') {
+            p++;
+        }
+        if (strcmp(p, "}\r\n") && strcmp(p, "}\n")) {
+            die("Expecting literal at end of line '%s'", tok->str);
+        }
+        p += strlen(p);
+    } else {
+        /* an atom, the section of BODY[...] may contain spaces and lists */
+        tok->type = TOKEN_ATOM;
+        int depth = 0;
+        while (*p && (*p != '\r') && (*p != '\n')) {
+            if (*p == '[') {
+                depth++;
+            } else if (*p == ']') {
+                depth--;
+            } else if (!depth && ((*p == ' ') || (*p == '(') || (*p == ')') || (*p == '"') || (*p == '{'))) {
+                break;
+            }
+            p++;
+        }
+        tok->len = p - tok->str;
+    }
+    *pp = p;
+    return tok->type;
+}
+
+static int token_is(struct token *tok, char *str)
+{
+    return (tok->type == TOKEN_ATOM) && (tok->len == strlen(str)) && !strncasecmp(tok->str, str, tok->len);
+}
+
+/* Skips a value that is not needed, with any nested lists and literals */
+static void skip_token_value(char **pp, struct token *tok)
+{
+    int depth = 0;
+    for(;;) {
+        if (tok->type == TOKEN_OPEN) {
+            depth++;
+        } else if (tok->type == TOKEN_CLOSE) {
+            depth--;
+        } else if (tok->type == TOKEN_LITERAL) {
+            receive_literal(-1, tok->num, NULL);
+            read_line();
+            *pp = _buf;
+        } else if (tok->type == TOKEN_END) {
+            die("Unexpected end of response");
+        }
+        if (depth <= 0) {
+            return;
+        }
+        next_token(pp, tok);
+    }
+}
+
+/* Adds the uids of '* VANISHED (EARLIER) set' or '* VANISHED set' in _buf
+   to set, reading the rest of a set that read_line() had to split.
+   Returns 0 if _buf is not a VANISHED response. */
+static int receive_vanished_response(struct uid_set *set)
+{
+    char *p = string_prefix_endp(_buf, "* VANISHED ");
+    if (!p) {
+        return 0;
+    }
+    struct token tok;
+    if (next_token(&p, &tok) == TOKEN_OPEN) {
+        skip_token_value(&p, &tok);
+        next_token(&p, &tok);
+    }
+    for(;;) {
+        if ((tok.type != TOKEN_ATOM) || !uid_set_parse(set, tok.str, 0)) {
+debuglog("invalid vanished line '%s'", _buf);
+            while (_linecontinues) {
+                read_line();
+            }
+            return 1;
+        }
+        if (!_linecontinues) {
+            return 1;
+        }
+        read_line();
+        p = _buf+1;
+        next_token(&p, &tok);
+    }
+}
+
+/* The items of a FETCH response apart from the message */
+struct fetch_items {
+    unsigned long uid;
+    unsigned long rfc822size;
+    unsigned long modseq;
+    time_t internaldate;
+    int flags; /* -1 without a FLAGS item */
+};
+
+/* Returns the position after '* N FETCH (' in _buf, or NULL if the line
+   is not a FETCH response */
+static char *fetch_response_items()
+{
+    char *p = string_prefix_endp(_buf, "* ");
+    if (!p) {
+        return NULL;
+    }
+    p = str_validchars_endchar(p, DIGITCHARS, ' ');
+    if (!p) {
+        return NULL;
+    }
+    p = string_prefix_endp(p+1, "FETCH ");
+    if (!p) {
+        return NULL;
+    }
+    struct token tok;
+    if (next_token(&p, &tok) != TOKEN_OPEN) {
+        return NULL;
+    }
+    return p;
+}
+
+static void clear_fetch_items(struct fetch_items *items)
+{
+    memset(items, 0, sizeof(*items));
+    items->flags = -1;
+}
+
+/* Parses the value tok of the item name if it is one of fetch_items,
+   returns 0 for any other item */
+static int parse_fetch_item(char **pp, struct token *name, struct token *tok, struct fetch_items *items)
+{
+    if (token_is(name, "UID") && (tok->type == TOKEN_ATOM)) {
+        items->uid = strtoul(tok->str, NULL, 10);
+    } else if (token_is(name, "INTERNALDATE") && (tok->type == TOKEN_QUOTED)) {
+        items->internaldate = parse_internaldate(tok->str);
+    } else if (token_is(name, "RFC822.SIZE") && (tok->type == TOKEN_ATOM)) {
+        items->rfc822size = strtoul(tok->str, NULL, 10);
+    } else if (token_is(name, "FLAGS") && (tok->type == TOKEN_OPEN)) {
+        items->flags = 0;
+        while (next_token(pp, tok) == TOKEN_ATOM) {
+            items->flags |= message_flag(tok->str, tok->len);
+        }
+        if (tok->type != TOKEN_CLOSE) {
+            die("Invalid FLAGS in response");
+        }
+    } else if (token_is(name, "MODSEQ") && (tok->type == TOKEN_OPEN)) {
+        if (next_token(pp, tok) != TOKEN_ATOM) {
+            die("Invalid MODSEQ in response");
+        }
+        items->modseq = strtoul(tok->str, NULL, 10);
+        if (next_token(pp, tok) != TOKEN_CLOSE) {
+            die("Invalid MODSEQ in response");
+        }
+    } else {
+        return 0;
+    }
+    return 1;
+}
+
+/* Parses a FETCH response that carries no message, such as the sizes for
+   schedule_fetch() or a flag change, the literals of other items are
+   skipped. Returns 0 if _buf is not a FETCH response. */
+static int parse_fetch_response(struct fetch_items *items)
+{
+    clear_fetch_items(items);
+    char *p = fetch_response_items();
+    if (!p) {
+        return 0;
+    }
+    struct token tok;
+    for(;;) {
+        if (next_token(&p, &tok) == TOKEN_CLOSE) {
+            break;
+        }
+        if (tok.type != TOKEN_ATOM) {
+            die("Expecting FETCH item '%s'", tok.str);
+        }
+        struct token name = tok;
+        next_token(&p, &tok);
+        if (!parse_fetch_item(&p, &name, &tok, items)) {
+            skip_token_value(&p, &tok);
+        }
+    }
+    if (next_token(&p, &tok) != TOKEN_END) {
+        die("Expecting end of FETCH response '%s'", tok.str);
+    }
+    return 1;
+}
+
+/* Parses a FETCH response with its items in any order. The message in an
+   RFC822 or BODY[HEADER] literal is written as it arrives, a UID item
+   must come before it. Returns the MODSEQ item, or 0. */
+static unsigned long receive_fetch_response()
+{
+    char *p = fetch_response_items();
+    if (!p) {
+debuglog("Error, not a FETCH response");
+        return 0;
+    }
+
+    struct token tok;
+    struct fetch_items items;
+    clear_fetch_items(&items);
+    int received = 0;
+    struct index_record *rec = NULL;
+    for(;;) {
+        if (next_token(&p, &tok) == TOKEN_CLOSE) {
+            break;
+        }
+        if (tok.type != TOKEN_ATOM) {
+            die("Expecting FETCH item '%s'", tok.str);
+        }
+        struct token name = tok;
+        next_token(&p, &tok);
+        if (parse_fetch_item(&p, &name, &tok, &items)) {
+            continue;
+        }
+        if ((token_is(&name, "RFC822") || token_is(&name, "BODY[HEADER]")) && (tok.type == TOKEN_LITERAL)) {
+            int partial = token_is(&name, "BODY[HEADER]");
+            if (!items.uid) {
+                die("FETCH response without UID before the message");
+            }
+tracelog("uid %lu fetch_size %lu", items.uid, tok.num);
+            rec = index_find(items.uid);
+            if (rec && (!(rec->flags & MESSAGE_PARTIAL) || partial)) {
+tracelog("uid %lu already exists, skipping", items.uid);
+                receive_literal(-1, tok.num, NULL);
+            } else {
+                receive_message_file(items.uid, tok.num, partial, (rec != NULL));
+                received = 1;
+            }
+            read_line();
+            p = _buf;
+        } else {
+            skip_token_value(&p, &tok);
+        }
+    }
+    if (next_token(&p, &tok) != TOKEN_END) {
+        die("Expecting end of FETCH response '%s'", tok.str);
+    }
+    if (!items.uid) {
+debuglog("Error, 'UID' not found");
+        return items.modseq;
+    }
+
+    int flags = items.flags;
+    if (received) {
+        if (flags < 0) {
+            flags = rec ? (rec->flags & MESSAGE_FLAGS) : 0;
+        }
+        finish_message_file(items.internaldate, flags, items.rfc822size);
+        return items.modseq;
+    }
+    rec = index_find(items.uid);
+    if (rec && (flags >= 0)) {
+tracelog("uid %lu flags %d", items.uid, flags);
+        rec->flags = (rec->flags & ~MESSAGE_FLAGS) | flags;
+    }
+    return items.modseq;
+}
+
+static int _headersfirst;
+
+/* With .headersfirst only the header of new messages is downloaded, the
+   body is fetched later by get or backfill */
+static void read_headersfirst()
+{
+    _headersfirst = file_exists(".headersfirst");
+}
+
+static char *message_fetch_items()
+{
+    if (_headersfirst) {
+        return "FLAGS INTERNALDATE RFC822.SIZE BODY.PEEK[HEADER]";
+    }
+    return "FLAGS INTERNALDATE RFC822";
+}
+
+static char *fetch_tag_status(char *str)
+{
+    char *p = string_prefix_endp(str, "fetch");
+    if (!p) {
+        return NULL;
+    }
+    char *q = str_validchars_endchar(p, DIGITCHARS, ' ');
+    if (!q) {
+        return NULL;
+    }
+    return q+1;
+}
+
+/* Fetches only the flags, the message bodies are not downloaded again */
+static void do_fetch_flags(char *range)
+{
+    long startus = monotonic_microseconds();
+    write_string("flags uid fetch %s (FLAGS)\r\n", range);
+    for(;;) {
+        read_line();
+        if (string_prefix_endp(_buf, "flags OK")) {
+            break;
+        }
+        if (string_prefix_endp(_buf, "flags NO")
+         || string_prefix_endp(_buf, "flags BAD"))
+        {
+            die("Unable to fetch flags %s '%s'", range, _buf);
+        }
+        receive_fetch_response();
+    }
+    add_phase_time(PHASE_FETCH, startus);
+}
+
+static char *sizes_tag_status(char *str)
+{
+    char *p = string_prefix_endp(str, "sizes");
+    if (!p) {
+        return NULL;
+    }
+    char *q = str_validchars_endchar(p, DIGITCHARS, ' ');
+    if (!q) {
+        return NULL;
+    }
+    return q+1;
+}
+
+static int compare_fetch_entries(const void *a, const void *b)
+{
+    const struct fetch_entry *x = a;
+    const struct fetch_entry *y = b;
+    int xlarge = (x->size > LARGE_MESSAGE_SIZE);
+    int ylarge = (y->size > LARGE_MESSAGE_SIZE);
+    if (xlarge != ylarge) {
+        return xlarge - ylarge;
+    }
+    if (x->internaldate != y->internaldate) {
+        return (x->internaldate > y->internaldate) ? -1 : 1;
+    }
+    if (x->uid != y->uid) {
+        return (x->uid > y->uid) ? -1 : 1;
+    }
+    return 0;
+}
+
+/* Gets RFC822.SIZE and INTERNALDATE of the uids in set and orders them
+   so that small messages come before large ones, newest first */
+static void schedule_fetch(struct uid_set *set, int window)
+{
+    char rangebuf[SENDBUFSIZE/2];
+    unsigned long next = set->count ? set->ranges[0].first : 0;
+    int tagnum = 0;
+    int inflight = 0;
+    _fetchordercount = 0;
+    for(;;) {
+        while ((inflight < window) && next) {
+            next = uid_set_format(set, next, MAX_UID, rangebuf, sizeof(rangebuf));
+            tagnum++;
+            write_string("sizes%d uid fetch %s (RFC822.SIZE INTERNALDATE)\r\n", tagnum, rangebuf);
+            inflight++;
+        }
+        if (!inflight) {
+            break;
+        }
+        read_line();
+        char *status = sizes_tag_status(_buf);
+        if (status) {
+            if (string_prefix_endp(status, "OK")) {
+                inflight--;
+                continue;
+            }
+            die("Unable to fetch sizes '%s'", _buf);
+        }
+        struct fetch_items items;
+        if (!parse_fetch_response(&items) || !items.uid || !uid_set_contains(set, items.uid)) {
+            continue;
+        }
+        struct index_record *rec = index_find(items.uid);
+        if (rec && (_headersfirst || !(rec->flags & MESSAGE_PARTIAL))) {
+            continue;
+        }
+        if (_fetchordercount >= MAX_MESSAGES) {
+            die("Too many messages");
+        }
+        grow_array(&_fetchorder, &_fetchordercapacity, _fetchordercount+1, sizeof(struct fetch_entry));
+        struct fetch_entry *entry = &_fetchorder[_fetchordercount++];
+        entry->uid = items.uid;
+        entry->size = items.rfc822size;
+        entry->internaldate = items.internaldate;
+    }
+    qsort(_fetchorder, _fetchordercount, sizeof(struct fetch_entry), compare_fetch_entries);
+}
+
+/* Fetches the uids in set in the order of schedule_fetch(), with several
+   batches in flight. A batch ends after FETCH_BATCH_UIDS messages or
+   FETCH_BATCH_BYTES, so that a large message does not hold up the small
+   ones behind it. */
+static void do_pipelined_fetch(struct uid_set *set, int window)
+{
+    long startus = monotonic_microseconds();
+    _fetchstartms = monotonic_milliseconds();
+    _fetchcommitted = 0;
+    schedule_fetch(set, window);
+debuglog("scheduled %d messages in %ld ms", _fetchordercount, monotonic_milliseconds() - _fetchstartms);
+
+    char rangebuf[SENDBUFSIZE/2];
+    int pos = 0;
+    int tagnum = 0;
+    int inflight = 0;
+    for(;;) {
+        while ((inflight < window) && (pos < _fetchordercount)) {
+            uid_set_clear(&_batchset);
+            int count = 0;
+            unsigned long bytes = 0;
+            while ((pos < _fetchordercount) && (count < FETCH_BATCH_UIDS)) {
+                struct fetch_entry *entry = &_fetchorder[pos];
+                if (count && (bytes + entry->size > FETCH_BATCH_BYTES)) {
+                    break;
+                }
+                uid_set_add(&_batchset, entry->uid);
+                bytes += entry->size;
+                count++;
+                pos++;
+            }
+            uid_set_format(&_batchset, _batchset.ranges[0].first, FETCH_BATCH_UIDS, rangebuf, sizeof(rangebuf));
+            tagnum++;
+            write_string("fetch%d uid fetch %s (%s)\r\n", tagnum, rangebuf, message_fetch_items());
+            inflight++;
+        }
+        if (!inflight) {
+            break;
+        }
+        read_line();
+        char *status = fetch_tag_status(_buf);
+        if (status) {
+            if (string_prefix_endp(status, "OK")) {
+                inflight--;
+                continue;
+            }
+            die("Unable to uid fetch '%s'", _buf);
+        }
+        receive_fetch_response();
+    }
+    commit_messages();
+    stop_writer();
+debuglog("fetched %d messages in %ld ms", _fetchcommitted, monotonic_milliseconds() - _fetchstartms);
+    _fetchstartms = 0;
+    add_phase_time(PHASE_FETCH, startus);
+}
+
+static int get_fetch_window()
+{
+    int window = read_optional_number_from_file(".fetchwindow", DEFAULT_FETCH_WINDOW);
+    if (window < 1) {
+        window = 1;
+    }
+    if (window > MAX_FETCH_WINDOW) {
+        window = MAX_FETCH_WINDOW;
+    }
+    return window;
+}
+
+static int read_journal_header(int fd, struct journal_header *hdr)
+{
+    if (pread(fd, hdr, sizeof(*hdr), 0) != sizeof(*hdr)) {
+        return 0;
+    }
+    if (memcmp(hdr->magic, JOURNAL_MAGIC, 8) != 0) {
+        return 0;
+    }
+    return 1;
+}
+
+static void write_journal_header(int fd, struct journal_header *hdr)
+{
+    if (pwrite(fd, hdr, sizeof(*hdr), 0) != sizeof(*hdr)) {
+        die("Unable to write .journal header");
+    }
+}
+
+static FILE *create_journal(unsigned long uidvalidity)
+{
+    int fd = open(".journal", O_RDWR|O_CREAT|O_EXCL, 0600);
+    if (fd < 0) {
+        die("Unable to create .journal");
+    }
+    FILE *fp = fdopen(fd, "w+");
+    if (!fp) {
+        die("Unable to create .journal");
+    }
+    struct journal_header hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, JOURNAL_MAGIC, 8);
+    hdr.uidvalidity = uidvalidity;
+    if (fwrite(&hdr, sizeof(hdr), 1, fp) != 1) {
+        die("Unable to write .journal");
+    }
+    return fp;
+}
+
+static void append_journal_record(FILE *fp, int type, unsigned long first, unsigned long last)
+{
+    struct journal_record rec;
+    rec.type = type;
+    rec.first = first;
+    rec.last = last;
+    if (fwrite(&rec, sizeof(rec), 1, fp) != 1) {
+        die("Unable to write .journal");
+    }
+}
+
+static void complete_journal(FILE *fp, unsigned long highestmodseq)
+{
+    if (fflush(fp) != 0) {
+        die("Unable to write .journal");
+    }
+    int fd = fileno(fp);
+    struct journal_header hdr;
+    if (!read_journal_header(fd, &hdr)) {
+        die("Invalid .journal");
+    }
+    hdr.highestmodseq = highestmodseq;
+    hdr.complete = 1;
+    write_journal_header(fd, &hdr);
+    fsync(fd);
+    fclose(fp);
+}
+
+static void apply_pending_journal_records(int fd, struct journal_header *hdr, unsigned long cursor)
+{
+    if (_fetchset.count) {
+debuglog("fetching %lu uids", uid_set_size(&_fetchset));
+        do_pipelined_fetch(&_fetchset, get_fetch_window());
+        uid_set_clear(&_fetchset);
+    }
+    if (_vanishedset.count) {
+        index_remove_set(&_vanishedset);
+        uid_set_clear(&_vanishedset);
+    }
+    if (hdr->cursor != cursor) {
+        hdr->cursor = cursor;
+        write_journal_header(fd, hdr);
+    }
+}
+
+/* Applies the journal records after the cursor in a single pass, then the
+   saved highestmodseq, and removes the journal. Consecutive fetch records
+   are batched into one pipelined fetch and consecutive vanished records
+   into one directory pass, the cursor is advanced after each batch.
+   Marks the index dirty if the journal has any record and returns the
+   number of records. */
+static unsigned long replay_journal()
+{
+    int fd = open(".journal", O_RDWR);
+    if (fd < 0) {
+        die("Unable to open .journal");
+    }
+    struct journal_header hdr;
+    if (!read_journal_header(fd, &hdr) || !hdr.complete) {
+        die("Invalid .journal");
+    }
+    FILE *fp = fdopen(fd, "r");
+    if (!fp) {
+        die("Unable to open .journal");
+    }
+    if (fseek(fp, sizeof(hdr), SEEK_SET) != 0) {
+        die("Unable to seek .journal");
+    }
+
+    /* Flag changes only live in the index until it is saved, so they are
+       applied again from the start of the journal */
+    unsigned long records = 0;
+    for(;;) {
+        struct journal_record rec;
+        if (fread(&rec, sizeof(rec), 1, fp) != 1) {
+            break;
+        }
+        records++;
+        if (rec.type == JOURNAL_FLAGS) {
+            struct index_record *indexrec = index_find(rec.first);
+            if (indexrec) {
+                indexrec->flags = (indexrec->flags & ~MESSAGE_FLAGS) | rec.last;
+            }
+        }
+    }
+    if (fseek(fp, sizeof(hdr) + hdr.cursor*sizeof(struct journal_record), SEEK_SET) != 0) {
+        die("Unable to seek .journal");
+    }
+debuglog("replaying .journal from record %lu of %lu", (unsigned long)hdr.cursor, records);
+    if (records) {
+        mark_index_dirty();
+    }
+
+    uid_set_clear(&_fetchset);
+    uid_set_clear(&_vanishedset);
+    unsigned long cursor = hdr.cursor;
+    int lasttype = 0;
+    for(;;) {
+        struct journal_record rec;
+        if (fread(&rec, sizeof(rec), 1, fp) != 1) {
+            break;
+        }
+        if (rec.type == JOURNAL_FLAGS) {
+            cursor++;
+            continue;
+        }
+        if ((int)rec.type != lasttype) {
+            apply_pending_journal_records(fd, &hdr, cursor);
+            lasttype = rec.type;
+        }
+        if (rec.type == JOURNAL_FETCH) {
+            if (!index_find(rec.first)) {
+                uid_set_add(&_fetchset, rec.first);
+            }
+        } else if (rec.type == JOURNAL_VANISHED) {
+            uid_set_add_range(&_vanishedset, rec.first, rec.last);
+        } else {
+            die("Invalid .journal record type %lu", (unsigned long)rec.type);
+        }
+        cursor++;
+    }
+    apply_pending_journal_records(fd, &hdr, cursor);
+    fclose(fp);
+    return records;
+}
+
+/* Called once the index and .mh_sequences are saved, the journal is
+   not needed anymore */
+static void finish_journal()
+{
+    int fd = open(".journal", O_RDONLY);
+    if (fd < 0) {
+        die("Unable to open .journal");
+    }
+    struct journal_header hdr;
+    if (!read_journal_header(fd, &hdr) || !hdr.complete) {
+        die("Invalid .journal");
+    }
+    close(fd);
+
+    if (hdr.highestmodseq) {
+        char highestmodseqbuf[64];
+        snprintf(highestmodseqbuf, sizeof(highestmodseqbuf), "%lu", (unsigned long)hdr.highestmodseq);
+debuglog("highestmodseq '%s'", highestmodseqbuf);
+        unlink(".highestmodseq");
+        write_string_to_new_file(highestmodseqbuf, ".highestmodseq");
+    }
+    unlink(".journal");
+}
+
+static int is_directory_empty(char *path)
+{
+    DIR *dir = opendir(path);
+    if (!dir) {
+debuglog("Error, unable to open directory '%s'", path);
+        return 0;
+    }
+    for(;;) {
+        struct dirent *ent = readdir(dir);
+        if (!ent) {
+            break;
+        }
+        if (!strcmp(ent->d_name, ".")) {
+            continue;
+        }
+        if (!strcmp(ent->d_name, "..")) {
+            continue;
+        }
+        return 0;
+    }
+    closedir(dir);
+    return 1;
+}
+
+/* The dotfiles that configure a folder before its first download */
+static char *_initfiles[] = {
+    ".username", ".password", ".mailbox", ".transport", ".shards",
+    ".connections", ".folders", ".fetchwindow", ".numbering", ".groupcommit",
+    ".headersfirst", ".store", ".packdays", ".loglevel", ".metrics", ".writer",
+    NULL
+};
+
+static int is_init_file(char *name)
+{
+    for (int i=0; _initfiles[i]; i++) {
+        if (!strcmp(name, _initfiles[i])) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static int is_directory_empty_except_for_init(char *path)
+{
+    DIR *dir = opendir(path);
+    if (!dir) {
+debuglog("Error, unable to open directory '%s'", path);
+        return 0;
+    }
+    int empty = 1;
+    for(;;) {
+        struct dirent *ent = readdir(dir);
+        if (!ent) {
+            break;
+        }
+        if (!strcmp(ent->d_name, ".") || !strcmp(ent->d_name, "..") || is_init_file(ent->d_name)) {
+            continue;
+        }
+        empty = 0;
+        break;
+    }
+    closedir(dir);
+    return empty;
+}
+
+/* Returns the UIDVALIDITY of an interrupted download, or 0 if there is
+   none. .download is written before .uidvalidity and nothing is fetched
+   before both exist, so a .download on its own is removed and the
+   download starts again. */
+static unsigned long interrupted_download_uidvalidity()
+{
+    if (!file_exists(".download")) {
+        return 0;
+    }
+    unsigned long uidvalidity = read_optional_number_from_file(".uidvalidity", 0);
+    if (!uidvalidity) {
+debuglog("removing .download without .uidvalidity");
+        unlink(".download");
+    }
+    return uidvalidity;
+}
+
+/* Called before the first message is fetched, .download keeps the
+   HIGHESTMODSEQ the download started at until it is complete */
+static void begin_download(char *uidvalidity, char *highestmodseq)
+{
+    write_string_to_new_file(highestmodseq, ".download");
+    write_string_to_new_file(uidvalidity, ".uidvalidity");
+}
+
+static void finish_download()
+{
+    char downloadbuf[BUFSIZE];
+    downloadbuf[0] = 0;
+    {
+        FILE *fp = fopen(".download", "r");
+        if (fp) {
+            if (!fgets(downloadbuf, BUFSIZE, fp)) {
+                downloadbuf[0] = 0;
+            }
+            fclose(fp);
+        }
+    }
+    if (downloadbuf[0]) {
+        if (rename(".download", ".highestmodseq") != 0) {
+            die("Unable to rename .download to .highestmodseq");
+        }
+    } else {
+        unlink(".download");
+    }
+}
+
+/* Downloads mailbox into the folder in the current directory, on a
+   connection that is logged in with QRESYNC enabled. While the download
+   is in progress, the HIGHESTMODSEQ of the first SELECT is kept in
+   .download, if it exists the download resumes and skips the messages
+   that were completed. */
+static void download_folder(char *mailbox)
+{
+    read_headersfirst();
+    unsigned long uidvalidity = interrupted_download_uidvalidity();
+    int resume = (uidvalidity != 0);
+    char uidvaliditybuf[BUFSIZE];
+    char highestmodseqbuf[BUFSIZE];
+    uidvaliditybuf[0] = 0;
+    highestmodseqbuf[0] = 0;
+
+    load_index();
+
+    long startus = monotonic_microseconds();
+    write_string("select select %s\r\n", mailbox);
+    for(;;) {
+        read_line();
+        if (string_prefix_endp(_buf, "select OK")) {
+            break;
+        }
+        if (string_prefix_endp(_buf, "select NO")
+         || string_prefix_endp(_buf, "select BAD"))
+        {
+            die("Unable to select mailbox %s '%s'", mailbox, _buf);
+        }
+
+        char *p = string_prefix_endp(_buf, "* ");
+        if (p) {
+            char *q = str_validchars_endchar(p, DIGITCHARS, ' ');
+            if (q) {
+                if (!strcmp(q+1, "EXISTS\r\n")) {
+                    int num_exists = strtoul(p, NULL, 10);
+debuglog("num_exists %d", num_exists);
+                    continue;
+                }
+            }
+        }
+
+        p = string_prefix_endp(_buf, "* OK [UIDVALIDITY ");
+        if (p) {
+            char *q = strchr(p, ']');
+            if (q) {
+                *q = 0;
+debuglog("uidvalidity '%s'", p);
+                snprintf(uidvaliditybuf, sizeof(uidvaliditybuf), "%s", p);
+                if (resume && (strtoul(p, NULL, 10) != uidvalidity)) {
+                    die("UIDVALIDITY '%s' does not match .uidvalidity '%lu', the mailbox may have changed, run 'imap-mh reconcile'", p, uidvalidity);
+                }
+                continue;
+            }
+        }
+        p = string_prefix_endp(_buf, "* OK [HIGHESTMODSEQ ");
+        if (p) {
+            char *q = strchr(p, ']');
+            if (q) {
+                *q = 0;
+debuglog("highestmodseq '%s'", p);
+                snprintf(highestmodseqbuf, sizeof(highestmodseqbuf), "%s", p);
+                continue;
+            }
+        }
+    }
+    add_phase_time(PHASE_SELECT, startus);
+
+    if (!uidvaliditybuf[0]) {
+        die("No UIDVALIDITY for mailbox %s", mailbox);
+    }
+
+    if (!resume) {
+        begin_download(uidvaliditybuf, highestmodseqbuf);
+    } else if (_indexcount) {
+        /* the index of an interrupted download is rebuilt without flags */
+        do_fetch_flags("1:*");
+    }
+
+    /* messages are not fetched in uid order, so a resumed download asks
+       for everything and skips what is already in the index */
+    if (resume) {
+debuglog("resuming download, %d messages are already in the index", _indexcount);
+    }
+    uid_set_clear(&_fetchset);
+    uid_set_add_range(&_fetchset, 1, MAX_UID);
+    do_pipelined_fetch(&_fetchset, get_fetch_window());
+
+    update_message_symlinks();
+    save_index();
+    finish_download();
+}
+
+static void reset_input()
+{
+    _inpos = 0;
+    _inlen = 0;
+    _lineend = -1;
+    _linecontinues = 0;
+    _buf = "";
+}
+
+/* Connects to 'tls:host:port' and verifies the certificate against the
+   system CAs and the host name, unless ',verify=0' is appended as with
+   socat. Reads go straight from the socket into the line reader. */
+static void open_tls_transport(char *address)
+{
+    char host[BUFSIZE];
+    snprintf(host, sizeof(host), "%s", address+4);
+    int verify = 1;
+    char *p = strstr(host, ",verify=0");
+    if (p) {
+        *p = 0;
+        verify = 0;
+    }
+    char *port = strrchr(host, ':');
+    if (!port) {
+        die("Invalid address '%s', expecting 'tls:host:port'", address);
+    }
+    *port++ = 0;
+
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    struct addrinfo *res = NULL;
+    int result = getaddrinfo(host, port, &hints, &res);
+    if (result != 0) {
+        die("Unable to resolve '%s': %s", host, gai_strerror(result));
+    }
+    int fd = -1;
+    for (struct addrinfo *ai=res; ai; ai=ai->ai_next) {
+        fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+        if (fd < 0) {
+            continue;
+        }
+        if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0) {
+            break;
+        }
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(res);
+    if (fd < 0) {
+        die("Unable to connect to %s:%s", host, port);
+    }
+    /* pipelined commands are small, they should not wait for an ACK */
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    SSL_CTX *ctx = SSL_CTX_new(TLS_client_method());
+    if (!ctx) {
+        die("Unable to create TLS context");
+    }
+    SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
+    SSL_CTX_set_default_verify_paths(ctx);
+    SSL_CTX_set_verify(ctx, verify ? SSL_VERIFY_PEER : SSL_VERIFY_NONE, NULL);
+    _ssl = SSL_new(ctx);
+    SSL_CTX_free(ctx);
+    if (!_ssl
+     || !SSL_set_fd(_ssl, fd)
+     || !SSL_set_tlsext_host_name(_ssl, host)
+     || (verify && !SSL_set1_host(_ssl, host)))
+    {
+        die("Unable to set up TLS connection");
+    }
+    if (SSL_connect(_ssl) != 1) {
+        ERR_print_errors_fp(stderr);
+        die("Unable to establish TLS connection to %s:%s", host, port);
+    }
+debuglog("connected to %s:%s with %s", host, port, SSL_get_version(_ssl));
+    _infd = fd;
+    _outfp = NULL;
+    reset_input();
+}
+
+static void close_tls_transport()
+{
+    SSL_shutdown(_ssl);
+    SSL_free(_ssl);
+    _ssl = NULL;
+    close(_infd);
+    _infd = -1;
+}
+
+static char *_tlsaddress;
+
+/* Uses stdin and stdout as the connection, as when run by socat with
+   system:, unless a tls:host:port address was given */
+static void open_connection()
+{
+    if (_tlsaddress) {
+        open_tls_transport(_tlsaddress);
+        return;
+    }
+    _infd = 0;
+    _outfp = stdout;
+}
+
+/* Runs the command with sh -c and uses its stdin/stdout as the connection,
+   the same way socat runs imap-mh with system:, or connects by itself if
+   the command is tls:host:port */
+static pid_t spawn_transport(char *command)
+{
+    if (string_prefix_endp(command, "tls:")) {
+        open_tls_transport(command);
+        return 0;
+    }
+    int tochild[2];
+    int fromchild[2];
+    if ((pipe(tochild) != 0) || (pipe(fromchild) != 0)) {
+        die("Unable to create pipe");
+    }
+    pid_t pid = fork();
+    if (pid < 0) {
+        die("Unable to fork");
+    }
+    if (!pid) {
+        dup2(tochild[0], 0);
+        dup2(fromchild[1], 1);
+        close(tochild[0]);
+        close(tochild[1]);
+        close(fromchild[0]);
+        close(fromchild[1]);
+        execl("/bin/sh", "sh", "-c", command, (char *)NULL);
+        _exit(127);
+    }
+    close(tochild[0]);
+    close(fromchild[1]);
+    _infd = fromchild[0];
+    reset_input();
+    _outfp = fdopen(tochild[1], "w");
+    if (!_outfp) {
+        die("Unable to open transport");
+    }
+    return pid;
+}
+
+static void close_transport(pid_t pid)
+{
+    end_compression();
+    if (_ssl) {
+        close_tls_transport();
+        return;
+    }
+    fclose(_outfp);
+    _outfp = NULL;
+    close(_infd);
+    _infd = -1;
+    waitpid(pid, NULL, 0);
+}
+
+static void imap_mh_download()
+{
+    if (!file_exists(".download") && !is_directory_empty_except_for_init(".")) {
+        die("Current directory is not empty (excluding .username .password .mailbox)");
+    }
+
+    char usernamebuf[BUFSIZE];
+    char passwordbuf[BUFSIZE];
+    char mailboxbuf[BUFSIZE];
+    read_first_line_from_file(".username", usernamebuf);
+    read_first_line_from_file(".password", passwordbuf);
+    read_first_line_from_file(".mailbox", mailboxbuf);
+
+    open_connection();
+
+    wait_for_initial_ok();
+
+    do_login(usernamebuf, passwordbuf);
+
+    do_enable_qresync();
+
+    download_folder(mailboxbuf);
+
+    do_logout();
+
+    exit(0);
+}
+
+static void select_mailbox_status(char *command, char *mailbox, unsigned long *uidvalidity, unsigned long *highestmodseq, unsigned long *uidnext)
+{
+    long startus = monotonic_microseconds();
+    *uidvalidity = 0;
+    *highestmodseq = 0;
+    *uidnext = 0;
+    write_string("%s %s %s\r\n", command, command, mailbox);
+    for(;;) {
+        read_line();
+        char *p = string_prefix_endp(_buf, command);
+        if (p && (*p == ' ')) {
+            if (string_prefix_endp(p+1, "OK")) {
+                break;
+            }
+            die("Unable to %s mailbox %s '%s'", command, mailbox, _buf);
+        }
+        p = string_prefix_endp(_buf, "* OK [UIDVALIDITY ");
+        if (p) {
+            *uidvalidity = strtoul(p, NULL, 10);
+            continue;
+        }
+        p = string_prefix_endp(_buf, "* OK [HIGHESTMODSEQ ");
+        if (p) {
+            *highestmodseq = strtoul(p, NULL, 10);
+            continue;
+        }
+        p = string_prefix_endp(_buf, "* OK [UIDNEXT ");
+        if (p) {
+            *uidnext = strtoul(p, NULL, 10);
+            continue;
+        }
+    }
+    if (!*uidvalidity) {
+        die("No UIDVALIDITY for mailbox %s", mailbox);
+    }
+    add_phase_time(PHASE_SELECT, startus);
+}
+
+static void lock_download_state()
+{
+    while (__sync_lock_test_and_set(&_download->lock, 1)) {
+        sched_yield();
+    }
+}
+
+static void unlock_download_state()
+{
+    __sync_lock_release(&_download->lock);
+}
+
+/* Takes the next chunk of the worker's own shard. When the shard is used
+   up, steals the upper half of the shard with the most uids left. */
+static int claim_download_chunk(int shard, unsigned long *first, unsigned long *last)
+{
+    lock_download_state();
+    struct download_shard *own = &_download->shards[shard];
+    if (own->next >= own->end) {
+        struct download_shard *victim = NULL;
+        for (int i=0; i<_download->numshards; i++) {
+            struct download_shard *s = &_download->shards[i];
+            if (s->next >= s->end) {
+                continue;
+            }
+            if (!victim || (s->end - s->next > victim->end - victim->next)) {
+                victim = s;
+            }
+        }
+        if (!victim) {
+            unlock_download_state();
+            return 0;
+        }
+        unsigned long remaining = victim->end - victim->next;
+        unsigned long mid = victim->next + remaining/2;
+        if (remaining <= DOWNLOAD_CHUNK_UIDS) {
+            mid = victim->next;
+        }
+        own->next = mid;
+        own->end = victim->end;
+        victim->end = mid;
+debuglog("shard %d stole uids %lu:%lu", shard, own->next, own->end-1);
+    }
+    *first = own->next;
+    *last = own->next + DOWNLOAD_CHUNK_UIDS - 1;
+    if (*last >= own->end) {
+        *last = own->end - 1;
+    }
+    own->next = *last + 1;
+    unlock_download_state();
+    return 1;
+}
+
+static void format_shard_name(int shard, char *name)
+{
+    sprintf(name, ".shard.%d", shard);
+}
+
+/* Writes the index records of the uids the worker claimed, for the
+   parent to merge with merge_download_shard() */
+static void save_download_shard(int shard)
+{
+    char name[64];
+    format_shard_name(shard, name);
+    unlink(name);
+    int fd = open(name, O_WRONLY|O_CREAT|O_EXCL, 0600);
+    if (fd < 0) {
+        die("Unable to create '%s'", name);
+    }
+    for (int i=0; i<_indexcount; i++) {
+        if (uid_set_contains(&_claimedset, _index[i].uid)) {
+            write_all(fd, (char *)&_index[i], sizeof(struct index_record));
+        }
+    }
+    close(fd);
+}
+
+static void merge_download_shard(int shard)
+{
+    char name[64];
+    format_shard_name(shard, name);
+    FILE *fp = fopen(name, "r");
+    if (!fp) {
+        die("Unable to open '%s'", name);
+    }
+    int count = 0;
+    struct index_record rec;
+    while (fread(&rec, sizeof(rec), 1, fp) == 1) {
+        *index_add(rec.uid) = rec;
+        count++;
+    }
+    fclose(fp);
+    unlink(name);
+debuglog("merged %d messages of shard %d", count, shard);
+}
+
+/* The shards of failed workers are not needed, a resumed download
+   rebuilds the index from the directory */
+static void remove_download_shards()
+{
+    for (int i=0; i<MAX_DOWNLOAD_SHARDS; i++) {
+        char name[64];
+        format_shard_name(i, name);
+        unlink(name);
+    }
+}
+
+static void run_download_worker(int shard, char *transport, char *username, char *password, char *mailbox, unsigned long uidvalidity)
+{
+    pid_t pid = spawn_transport(transport);
+    wait_for_initial_ok();
+    do_login(username, password);
+
+    unsigned long worker_uidvalidity, highestmodseq, uidnext;
+    select_mailbox_status("examine", mailbox, &worker_uidvalidity, &highestmodseq, &uidnext);
+    if (worker_uidvalidity != uidvalidity) {
+        die("UIDVALIDITY changed during download");
+    }
+
+    /* the index is the one of the parent, when resuming the messages in
+       it are left out of the chunk */
+    unsigned long first, last;
+    uid_set_clear(&_claimedset);
+    int window = get_fetch_window();
+    while (claim_download_chunk(shard, &first, &last)) {
+        uid_set_add_range(&_claimedset, first, last);
+        uid_set_clear(&_fetchset);
+        unsigned long next = first;
+        for (int i=index_search(first); (i < _indexcount) && (_index[i].uid <= last); i++) {
+            if (!_headersfirst && (_index[i].flags & MESSAGE_PARTIAL)) {
+                continue;
+            }
+            if (_index[i].uid > next) {
+                uid_set_add_range(&_fetchset, next, _index[i].uid-1);
+            }
+            next = _index[i].uid+1;
+        }
+        if (next <= last) {
+            uid_set_add_range(&_fetchset, next, last);
+        }
+        if (_fetchset.count) {
+            do_pipelined_fetch(&_fetchset, window);
+        }
+    }
+    save_download_shard(shard);
+
+    do_logout();
+    close_transport(pid);
+    exit(0);
+}
+
+static void imap_mh_parallel_download()
+{
+    if (!file_exists(".download") && !is_directory_empty_except_for_init(".")) {
+        die("Current directory is not empty (excluding .username .password .mailbox .transport .shards)");
+    }
+
+    char usernamebuf[BUFSIZE];
+    char passwordbuf[BUFSIZE];
+    char mailboxbuf[BUFSIZE];
+    char transportbuf[BUFSIZE];
+    read_first_line_from_file(".username", usernamebuf);
+    read_first_line_from_file(".password", passwordbuf);
+    read_first_line_from_file(".mailbox", mailboxbuf);
+    read_first_line_from_file(".transport", transportbuf);
+    int numshards = read_optional_number_from_file(".shards", DEFAULT_DOWNLOAD_SHARDS);
+    if (numshards < 1) {
+        numshards = 1;
+    }
+    if (numshards > MAX_DOWNLOAD_SHARDS) {
+        numshards = MAX_DOWNLOAD_SHARDS;
+    }
+
+    load_index();
+    read_headersfirst();
+    unsigned long resume_uidvalidity = interrupted_download_uidvalidity();
+
+    unsigned long uidvalidity, highestmodseq, uidnext;
+    {
+        pid_t pid = spawn_transport(transportbuf);
+        wait_for_initial_ok();
+        do_login(usernamebuf, passwordbuf);
+        do_enable_qresync();
+        select_mailbox_status("examine", mailboxbuf, &uidvalidity, &highestmodseq, &uidnext);
+        if ((resume_uidvalidity == uidvalidity) && _indexcount) {
+            /* the index of an interrupted download is rebuilt without flags */
+            do_fetch_flags("1:*");
+        }
+        do_logout();
+        close_transport(pid);
+    }
+    if (!uidnext) {
+        die("No UIDNEXT for mailbox %s", mailboxbuf);
+    }
+debuglog("uidvalidity %lu highestmodseq %lu uidnext %lu", uidvalidity, highestmodseq, uidnext);
+    if (!resume_uidvalidity) {
+        char uidvaliditybuf[64];
+        char highestmodseqbuf[64];
+        snprintf(uidvaliditybuf, sizeof(uidvaliditybuf), "%lu", uidvalidity);
+        snprintf(highestmodseqbuf, sizeof(highestmodseqbuf), "%lu", highestmodseq);
+        begin_download(uidvaliditybuf, highestmodseqbuf);
+    } else if (resume_uidvalidity != uidvalidity) {
+        die("UIDVALIDITY '%lu' does not match .uidvalidity '%lu', the mailbox may have changed, run 'imap-mh reconcile'", uidvalidity, resume_uidvalidity);
+    } else {
+debuglog("resuming download, %d messages are already in the index", _indexcount);
+    }
+
+    _download = mmap(NULL, sizeof(struct download_state), PROT_READ|PROT_WRITE, MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+    if (_download == MAP_FAILED) {
+        die("Unable to map download state");
+    }
+    memset(_download, 0, sizeof(struct download_state));
+    remove_download_shards();
+    _download->numshards = numshards;
+    unsigned long total = uidnext - 1;
+    for (int i=0; i<numshards; i++) {
+        _download->shards[i].next = 1 + total*i/numshards;
+        _download->shards[i].end = 1 + total*(i+1)/numshards;
+    }
+
+    pid_t workers[MAX_DOWNLOAD_SHARDS];
+    for (int i=0; i<numshards; i++) {
+        workers[i] = fork();
+        if (workers[i] < 0) {
+            die("Unable to fork");
+        }
+        if (!workers[i]) {
+            run_download_worker(i, transportbuf, usernamebuf, passwordbuf, mailboxbuf, uidvalidity);
+        }
+    }
+    int failed = 0;
+    for (int i=0; i<numshards; i++) {
+        int status;
+        if ((waitpid(workers[i], &status, 0) < 0) || !WIFEXITED(status) || WEXITSTATUS(status)) {
+debuglog("download worker %d failed", i);
+            failed = 1;
+        }
+    }
+    if (failed) {
+        remove_download_shards();
+        die("Download incomplete, run 'imap-mh parallel-download' or 'imap-mh download' again to resume");
+    }
+
+    /* The workers are separate processes, the records of the messages
+       they fetched, with their flags, are merged into the index */
+    for (int i=0; i<numshards; i++) {
+        merge_download_shard(i);
+    }
+
+    update_message_symlinks();
+    save_index();
+    finish_download();
+
+    exit(0);
+}
+
+static void select_mailbox_with_uidvalidity(char *mailbox, unsigned long uidvalidity)
+{
+    long startus = monotonic_microseconds();
+    write_string("select select %s\r\n", mailbox);
+    int uidvalidity_ok = 0;
+    for(;;) {
+        read_line();
+        if (string_prefix_endp(_buf, "select OK")) {
+            break;
+        }
+        if (string_prefix_endp(_buf, "select NO")
+         || string_prefix_endp(_buf, "select BAD"))
+        {
+            die("Unable to select mailbox %s '%s'", mailbox, _buf);
+        }
+        char *p = string_prefix_endp(_buf, "* OK [UIDVALIDITY ");
+        if (p) {
+            if (strtoul(p, NULL, 10) != uidvalidity) {
+                die("UIDVALIDITY '%s' does not match %lu, the mailbox may have changed, run 'imap-mh reconcile'", p, uidvalidity);
+            }
+            uidvalidity_ok = 1;
+        }
+    }
+    if (!uidvalidity_ok) {
+        die("No UIDVALIDITY for mailbox %s", mailbox);
+    }
+    add_phase_time(PHASE_SELECT, startus);
+}
+
+/* Updates the folder in the current directory from mailbox, which must not
+   be selected yet, on a connection that is logged in with QRESYNC enabled */
+static void update_folder(char *mailbox)
+{
+    read_headersfirst();
+    int resume = 0;
+    {
+        int fd = open(".journal", O_RDONLY);
+        if (fd >= 0) {
+            struct journal_header hdr;
+            if (read_journal_header(fd, &hdr) && hdr.complete) {
+debuglog("resuming interrupted update");
+                resume = 1;
+            } else {
+debuglog("discarding incomplete .journal");
+                unlink(".journal");
+            }
+            close(fd);
+        }
+    }
+
+    char uidvaliditybuf[BUFSIZE];
+    char highestmodseqbuf[BUFSIZE];
+    {
+        read_first_line_from_file(".uidvalidity", uidvaliditybuf);
+        char *q = str_validchars_endchar(uidvaliditybuf, DIGITCHARS, 0);
+        if (!q) {
+            die("Invalid .uidvalidity '%s'", uidvaliditybuf);
+        }
+        *q = 0;
+    }
+    {
+        read_first_line_from_file(".highestmodseq", highestmodseqbuf);
+        char *q = str_validchars_endchar(highestmodseqbuf, DIGITCHARS, 0);
+        if (!q) {
+            die("Invalid .highestmodseq '%s'", highestmodseqbuf);
+        }
+        *q = 0;
+    }
+
+    load_index();
+
+    if (resume) {
+        select_mailbox_with_uidvalidity(mailbox, strtoul(uidvaliditybuf, NULL, 10));
+        mark_index_dirty();
+        replay_journal();
+        update_message_symlinks();
+        save_index();
+        finish_journal();
+        return;
+    }
+
+    FILE *journalfp = create_journal(strtoul(uidvaliditybuf, NULL, 10));
+    unsigned long new_highestmodseq = 0;
+
+    long startus = monotonic_microseconds();
+    write_string("select select %s (qresync (%s %s))\r\n", mailbox, uidvaliditybuf, highestmodseqbuf);
+    for(;;) {
+        read_line();
+        if (string_prefix_endp(_buf, "select OK")) {
+            break;
+        }
+        if (string_prefix_endp(_buf, "select NO")
+         || string_prefix_endp(_buf, "select BAD"))
+        {
+            die("Unable to select mailbox %s uidvalidity %s highestmodseq %s '%s'", mailbox, uidvaliditybuf, highestmodseqbuf, _buf);
+        }
+        char *p = string_prefix_endp(_buf, "* ");
+        if (p) {
+            char *q = str_validchars_endchar(p, DIGITCHARS, ' ');
+            if (q) {
+                if (!strcmp(q+1, "EXISTS\r\n")) {
+                    int num_exists = strtoul(p, NULL, 10);
+debuglog("num_exists %d", num_exists);
+                    continue;
+                }
+            }
+        }
+        p = string_prefix_endp(_buf, "* OK [UIDVALIDITY ");
+        if (p) {
+            char *q = strchr(p, ']');
+            if (q) {
+                *q = 0;
+                if (strcmp(p, uidvaliditybuf) != 0) {
+                    unlink(".journal");
+                    die("UIDVALIDITY '%s' does not match .uidvalidity '%s', the mailbox may have changed, run 'imap-mh reconcile'", p, uidvaliditybuf);
+                }
+                continue;
+            }
+        }
+        p = string_prefix_endp(_buf, "* OK [HIGHESTMODSEQ ");
+        if (p) {
+            char *q = strchr(p, ']');
+            if (q) {
+                *q = 0;
+                if (!strcmp(p, highestmodseqbuf)) {
+debuglog("HIGHESTMODSEQ '%s' is the same as before", p);
+                } else {
+                    new_highestmodseq = strtoul(p, NULL, 10);
+                }
+                continue;
+            }
+        }
+
+        struct fetch_items items;
+        if (parse_fetch_response(&items)) {
+            if (!items.uid) {
+debuglog("Error, 'UID' not found");
+                continue;
+            }
+            if (index_find(items.uid) && (items.flags >= 0)) {
+                append_journal_record(journalfp, JOURNAL_FLAGS, items.uid, items.flags);
+            } else {
+                append_journal_record(journalfp, JOURNAL_FETCH, items.uid, items.uid);
+            }
+            continue;
+        }
+
+        uid_set_clear(&_vanishedset);
+        if (receive_vanished_response(&_vanishedset)) {
+            for (int i=0; i<_vanishedset.count; i++) {
+                append_journal_record(journalfp, JOURNAL_VANISHED, _vanishedset.ranges[i].first, _vanishedset.ranges[i].last);
+            }
+            continue;
+        }
+    }
+    add_phase_time(PHASE_SELECT, startus);
+
+    complete_journal(journalfp, new_highestmodseq);
+
+    if (new_highestmodseq) {
+        mark_index_dirty();
+    }
+
+    unsigned long records = replay_journal();
+
+    if (new_highestmodseq || records) {
+        update_message_symlinks();
+        save_index();
+    }
+    finish_journal();
+}
+
+static void imap_mh_update()
+{
+    char usernamebuf[BUFSIZE];
+    char passwordbuf[BUFSIZE];
+    char mailboxbuf[BUFSIZE];
+    read_first_line_from_file(".username", usernamebuf);
+    read_first_line_from_file(".password", passwordbuf);
+    read_first_line_from_file(".mailbox", mailboxbuf);
+
+    open_connection();
+
+    wait_for_initial_ok();
+
+    do_login(usernamebuf, passwordbuf);
+
+    do_enable_qresync();
+
+    update_folder(mailboxbuf);
+
+    do_logout();
+
+    exit(0);
+}
+
+static void read_folder_list()
+{
+    FILE *fp = fopen(".folders", "r");
+    if (!fp) {
+        die("Unable to open .folders");
+    }
+    _numfolders = 0;
+    char line[BUFSIZE];
+    for(;;) {
+        if (!fgets(line, sizeof(line), fp)) {
+            break;
+        }
+        chomp_string(line);
+        if (!line[0] || (line[0] == '#')) {
+            continue;
+        }
+        char *p = strchr(line, ' ');
+        if (!p) {
+            die("Invalid .folders line '%s', expecting 'directory mailbox'", line);
+        }
+        *p = 0;
+        if (_numfolders >= MAX_FOLDERS) {
+            die("Too many folders");
+        }
+        struct sync_folder *folder = &_folders[_numfolders++];
+        memset(folder, 0, sizeof(*folder));
+        strcpy(folder->directory, line);
+        strcpy(folder->mailbox, p+1);
+        char path[BUFSIZE*2];
+        snprintf(path, sizeof(path), "%s/.highestmodseq", folder->directory);
+        if (file_exists(path)) {
+            read_first_line_from_file(path, path);
+            folder->highestmodseq = strtoul(path, NULL, 10);
+        } else {
+            folder->needs_download = 1;
+        }
+    }
+    fclose(fp);
+}
+
+static char *status_tag_status(char *str, int *num)
+{
+    char *p = string_prefix_endp(str, "status");
+    if (!p) {
+        return NULL;
+    }
+    char *q = str_validchars_endchar(p, DIGITCHARS, ' ');
+    if (!q) {
+        return NULL;
+    }
+    *num = strtoul(p, NULL, 10);
+    return q+1;
+}
+
+/* Returns whether the mailbox of folder is the one named by tok, INBOX in
+   any case is the same mailbox */
+static int folder_has_mailbox(struct sync_folder *folder, struct token *tok)
+{
+    char name[BUFSIZE];
+    strcpy(name, folder->mailbox);
+    char *p = name;
+    struct token nametok;
+    int type = next_token(&p, &nametok);
+    if (((type != TOKEN_ATOM) && (type != TOKEN_QUOTED)) || (nametok.len != tok->len)) {
+        return 0;
+    }
+    if ((tok->len == 5) && !strncasecmp(tok->str, "INBOX", 5) && !strncasecmp(nametok.str, "INBOX", 5)) {
+        return 1;
+    }
+    return !memcmp(nametok.str, tok->str, tok->len);
+}
+
+/* Asks for the HIGHESTMODSEQ of every folder with pipelined STATUS
+   commands. Each untagged STATUS response is matched to its folders by
+   mailbox name, a folder without a response or without a HIGHESTMODSEQ
+   in it counts as changed. */
+static void check_folder_status()
+{
+    for (int i=0; i<_numfolders; i++) {
+        _folders[i].changed = 1;
+        write_string("status%d status %s (highestmodseq)\r\n", i, _folders[i].mailbox);
+    }
+    int completed = 0;
+    while (completed < _numfolders) {
+        read_line();
+        int num;
+        char *status = status_tag_status(_buf, &num);
+        if (status) {
+            if (!string_prefix_endp(status, "OK")) {
+debuglog("status failed for %s '%s'", _folders[num].mailbox, _buf);
+            }
+            completed++;
+            continue;
+        }
+        char *p = string_prefix_endp(_buf, "* STATUS ");
+        if (!p) {
+            continue;
+        }
+        struct token mailbox;
+        int type = next_token(&p, &mailbox);
+        if ((type != TOKEN_ATOM) && (type != TOKEN_QUOTED)) {
+debuglog("unable to match '%s' to a folder", _buf);
+            continue;
+        }
+        unsigned long highestmodseq = 0;
+        struct token tok;
+        if (next_token(&p, &tok) == TOKEN_OPEN) {
+            for(;;) {
+                type = next_token(&p, &tok);
+                if ((type == TOKEN_CLOSE) || (type == TOKEN_END)) {
+                    break;
+                }
+                if (token_is(&tok, "HIGHESTMODSEQ")) {
+                    next_token(&p, &tok);
+                    highestmodseq = strtoul(tok.str, NULL, 10);
+                }
+            }
+        }
+        for (int i=0; i<_numfolders; i++) {
+            if (folder_has_mailbox(&_folders[i], &mailbox)) {
+                _folders[i].changed = !highestmodseq || (highestmodseq != _folders[i].highestmodseq);
+            }
+        }
+    }
+}
+
+static void run_sync_worker(char *transport, char *username, char *password, int topdirfd)
+{
+    pid_t pid = spawn_transport(transport);
+    wait_for_initial_ok();
+    do_login(username, password);
+    do_enable_qresync();
+
+    for(;;) {
+        int n = __sync_fetch_and_add(&_sync->nextfolder, 1);
+        if (n >= _numfolders) {
+            break;
+        }
+        struct sync_folder *folder = &_folders[_schedule[n]];
+        if (!folder->changed && !folder->needs_download) {
+            continue;
+        }
+        if (fchdir(topdirfd) != 0) {
+            die("Unable to change to top directory");
+        }
+        if (chdir(folder->directory) != 0) {
+debuglog("Unable to change to directory '%s'", folder->directory);
+            _sync->failed[_schedule[n]] = 1;
+            continue;
+        }
+debuglog("syncing folder '%s' mailbox %s", folder->directory, folder->mailbox);
+        unload_index();
+        if (folder->needs_download) {
+            if (!file_exists(".download") && !is_directory_empty_except_for_init(".")) {
+debuglog("Directory '%s' is not empty and has no .highestmodseq", folder->directory);
+                _sync->failed[_schedule[n]] = 1;
+                continue;
+            }
+            download_folder(folder->mailbox);
+        } else {
+            update_folder(folder->mailbox);
+        }
+        /* CLOSE would expunge the messages marked \Deleted in a mailbox
+           that is selected read-write, UNSELECT leaves them alone, and so
+           does the SELECT of the next folder */
+        if (has_capability("UNSELECT")) {
+            write_string("unselect unselect\r\n");
+            for(;;) {
+                read_line();
+                if (string_prefix_endp(_buf, "unselect ")) {
+                    break;
+                }
+            }
+        }
+    }
+
+    do_logout();
+    close_transport(pid);
+    exit(0);
+}
+
+static void imap_mh_sync()
+{
+    char usernamebuf[BUFSIZE];
+    char passwordbuf[BUFSIZE];
+    char transportbuf[BUFSIZE];
+    read_first_line_from_file(".username", usernamebuf);
+    read_first_line_from_file(".password", passwordbuf);
+    read_first_line_from_file(".transport", transportbuf);
+    int numconnections = read_optional_number_from_file(".connections", DEFAULT_SYNC_CONNECTIONS);
+    if (numconnections < 1) {
+        numconnections = 1;
+    }
+    if (numconnections > MAX_SYNC_CONNECTIONS) {
+        numconnections = MAX_SYNC_CONNECTIONS;
+    }
+
+    read_folder_list();
+
+    {
+        pid_t pid = spawn_transport(transportbuf);
+        wait_for_initial_ok();
+        do_login(usernamebuf, passwordbuf);
+        check_folder_status();
+        do_logout();
+        close_transport(pid);
+    }
+
+    int numpending = 0;
+    for (int i=0; i<_numfolders; i++) {
+        if (_folders[i].changed) {
+            _schedule[numpending++] = i;
+        }
+    }
+    for (int i=0; i<_numfolders; i++) {
+        if (!_folders[i].changed && _folders[i].needs_download) {
+            _schedule[numpending++] = i;
+        }
+    }
+debuglog("%d of %d folders need syncing", numpending, _numfolders);
+    int n = numpending;
+    for (int i=0; i<_numfolders; i++) {
+        if (!_folders[i].changed && !_folders[i].needs_download) {
+            _schedule[n++] = i;
+        }
+    }
+    if (!numpending) {
+        exit(0);
+    }
+    if (numconnections > numpending) {
+        numconnections = numpending;
+    }
+
+    _sync = mmap(NULL, sizeof(struct sync_state), PROT_READ|PROT_WRITE, MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+    if (_sync == MAP_FAILED) {
+        die("Unable to map sync state");
+    }
+    memset((void *)_sync, 0, sizeof(struct sync_state));
+
+    int topdirfd = open_current_directory();
+    pid_t workers[MAX_SYNC_CONNECTIONS];
+    for (int i=0; i<numconnections; i++) {
+        workers[i] = fork();
+        if (workers[i] < 0) {
+            die("Unable to fork");
+        }
+        if (!workers[i]) {
+            run_sync_worker(transportbuf, usernamebuf, passwordbuf, topdirfd);
+        }
+    }
+    int failed = 0;
+    for (int i=0; i<numconnections; i++) {
+        int status;
+        if ((waitpid(workers[i], &status, 0) < 0) || !WIFEXITED(status) || WEXITSTATUS(status)) {
+debuglog("sync worker %d failed", i);
+            failed = 1;
+        }
+    }
+    for (int i=0; i<_numfolders; i++) {
+        if (_sync->failed[i]) {
+            fprintf(stderr, "Unable to sync folder '%s'\n", _folders[i].directory);
+            failed = 1;
+        }
+    }
+    if (failed) {
+        die("Sync incomplete");
+    }
+    exit(0);
+}
+
+static void imap_mh_idle()
+{
+    char usernamebuf[BUFSIZE];
+    char passwordbuf[BUFSIZE];
+    char mailboxbuf[BUFSIZE];
+    read_first_line_from_file(".username", usernamebuf);
+    read_first_line_from_file(".password", passwordbuf);
+    read_first_line_from_file(".mailbox", mailboxbuf);
+    open_connection();
+
+    wait_for_initial_ok();
+
+    do_login(usernamebuf, passwordbuf);
+
+    write_string("select select %s\r\n", mailboxbuf);
+    for(;;) {
+        read_line();
+        if (string_prefix_endp(_buf, "select OK")) {
+            break;
+        }
+        if (string_prefix_endp(_buf, "select NO")
+         || string_prefix_endp(_buf, "select BAD"))
+        {
+            die("Unable to select mailbox %s '%s'", mailboxbuf, _buf);
+        }
+    }
+
+    write_string("idle idle\r\n");
+    for(;;) {
+        read_line();
+        if (string_prefix_endp(_buf, "+ ")) {
+            break;
+        }
+    }
+    for(;;) {
+        read_line();
+        char *p = string_prefix_endp(_buf, "* ");
+        if (p) {
+            char *q = str_validchars_endchar(p, DIGITCHARS, ' ');
+            if (q) {
+                if (!strcmp(q+1, "EXISTS\r\n")) {
+                    int num_exists = strtoul(p, NULL, 10);
+debuglog("num_exists %d", num_exists);
+                    break;
+                }
+            }
+        }
+    }
+
+    write_string("DONE\r\n");
+    for(;;) {
+        read_line();
+        if (string_prefix_endp(_buf, "idle OK")) {
+            break;
+        }
+        if (string_prefix_endp(_buf, "idle NO")
+         || string_prefix_endp(_buf, "idle BAD")) {
+            die("Somehow IDLE failed '%s'", _buf);
+        }
+    }
+
+    do_logout();
+
+    exit(0);
+}
+
+static int is_idle_notification(char *str)
+{
+    char *p = string_prefix_endp(str, "* ");
+    if (!p) {
+        return 0;
+    }
+    if (string_prefix_endp(p, "VANISHED ")) {
+        return 1;
+    }
+    char *q = str_validchars_endchar(p, DIGITCHARS, ' ');
+    if (!q) {
+        return 0;
+    }
+    if (string_prefix_endp(q+1, "EXISTS")
+     || string_prefix_endp(q+1, "EXPUNGE")
+     || string_prefix_endp(q+1, "FETCH "))
+    {
+        return 1;
+    }
+    return 0;
+}
+
+/* Sends IDLE and waits for changes, re-issuing IDLE before the server
+   times out. After the first notification, waits a little longer so a
+   burst of notifications is handled with one fetch. */
+static void wait_for_idle_notification()
+{
+    for(;;) {
+        write_string("idle idle\r\n");
+        for(;;) {
+            read_line();
+            if (string_prefix_endp(_buf, "+ ")) {
+                break;
+            }
+            if (string_prefix_endp(_buf, "idle NO")
+             || string_prefix_endp(_buf, "idle BAD")) {
+                die("Unable to idle '%s'", _buf);
+            }
+        }
+        int notified = 0;
+        time_t start = time(NULL);
+        for(;;) {
+            int timeout = notified ? IDLE_COALESCE_MILLISECONDS : 1000;
+            if (!input_ready(timeout)) {
+                if (notified) {
+                    break;
+                }
+                if (time(NULL) - start >= IDLE_REISSUE_SECONDS) {
+debuglog("re-issuing idle");
+                    break;
+                }
+                continue;
+            }
+            read_line();
+            if (is_idle_notification(_buf)) {
+                notified = 1;
+            }
+        }
+        write_string("DONE\r\n");
+        for(;;) {
+            read_line();
+            if (string_prefix_endp(_buf, "idle OK")) {
+                break;
+            }
+            if (string_prefix_endp(_buf, "idle NO")
+             || string_prefix_endp(_buf, "idle BAD")) {
+                die("Somehow IDLE failed '%s'", _buf);
+            }
+            if (is_idle_notification(_buf)) {
+                notified = 1;
+            }
+        }
+        if (notified) {
+            return;
+        }
+    }
+}
+
+static char *delta_tag_status(char *str)
+{
+    char *p = string_prefix_endp(str, "fetch ");
+    if (!p) {
+        p = string_prefix_endp(str, "changed ");
+    }
+    return p;
+}
+
+/* Fetches the uids above the highest local uid and the changes since
+   highestmodseq in one round trip, then the bodies of the new uids only,
+   as 'maxuid+1:*' always includes the highest uid on the server. Applies
+   them and returns the new highestmodseq. */
+static unsigned long sync_idle_deltas(unsigned long highestmodseq)
+{
+    unsigned long maxuid = _indexcount ? _index[_indexcount-1].uid : 0;
+    mark_index_dirty();
+    uid_set_clear(&_vanishedset);
+    uid_set_clear(&_fetchset);
+
+    int pending = 1;
+    write_string("fetch uid fetch %lu:* (UID MODSEQ)\r\n", maxuid+1);
+    if (maxuid) {
+        write_string("changed uid fetch 1:%lu (FLAGS) (CHANGEDSINCE %lu VANISHED)\r\n", maxuid, highestmodseq);
+        pending++;
+    }
+    unsigned long newmodseq = highestmodseq;
+    while (pending) {
+        read_line();
+        char *status = delta_tag_status(_buf);
+        if (status) {
+            if (!string_prefix_endp(status, "OK")) {
+                die("Unable to fetch changes '%s'", _buf);
+            }
+            pending--;
+            continue;
+        }
+        if (receive_vanished_response(&_vanishedset)) {
+            continue;
+        }
+        struct fetch_items items;
+        if (parse_fetch_response(&items)) {
+            if (items.modseq > newmodseq) {
+                newmodseq = items.modseq;
+            }
+            if (items.uid > maxuid) {
+                uid_set_add(&_fetchset, items.uid);
+                continue;
+            }
+            struct index_record *rec = index_find(items.uid);
+            if (rec && (items.flags >= 0)) {
+tracelog("uid %lu flags %d", items.uid, items.flags);
+                rec->flags = (rec->flags & ~MESSAGE_FLAGS) | items.flags;
+            }
+        }
+    }
+
+    if (_fetchset.count) {
+debuglog("fetching %lu new uids", uid_set_size(&_fetchset));
+        do_pipelined_fetch(&_fetchset, get_fetch_window());
+        uid_set_clear(&_fetchset);
+    }
+    index_remove_set(&_vanishedset);
+    update_message_symlinks();
+    save_index();
+
+    if (newmodseq != highestmodseq) {
+        char highestmodseqbuf[64];
+        snprintf(highestmodseqbuf, sizeof(highestmodseqbuf), "%lu", newmodseq);
+        unlink(".highestmodseq");
+        write_string_to_new_file(highestmodseqbuf, ".highestmodseq");
+    }
+    return newmodseq;
+}
+
+static void imap_mh_idle_sync()
+{
+    char usernamebuf[BUFSIZE];
+    char passwordbuf[BUFSIZE];
+    char mailboxbuf[BUFSIZE];
+    read_first_line_from_file(".username", usernamebuf);
+    read_first_line_from_file(".password", passwordbuf);
+    read_first_line_from_file(".mailbox", mailboxbuf);
+
+    open_connection();
+
+    wait_for_initial_ok();
+
+    do_login(usernamebuf, passwordbuf);
+
+    do_enable_qresync();
+
+    update_folder(mailboxbuf);
+
+    unsigned long highestmodseq = read_optional_number_from_file(".highestmodseq", 0);
+    for(;;) {
+        wait_for_idle_notification();
+        highestmodseq = sync_idle_deltas(highestmodseq);
+    }
+}
+
+static char *input_password(char *buf)
+{
+    struct termios oldterm;
+    struct termios newterm;
+
+    tcgetattr(0, &oldterm);
+    newterm = oldterm;
+    newterm.c_lflag &= ~(ECHO);
+    tcsetattr(0, TCSANOW, &newterm);
+
+    char *result = fgets(buf, BUFSIZE, stdin);
+
+    tcsetattr(0, TCSANOW, &oldterm);
+
+    return result;
+}
+
+static void imap_mh_init()
+{
+    if (!is_directory_empty(".")) {
+        die("Current directory is not empty");
+    }
+
+    char usernamebuf[BUFSIZE];
+    char passwordbuf[BUFSIZE];
+    char mailboxbuf[BUFSIZE];
+
+    printf("Enter IMAP username: ");
+    if (!fgets(usernamebuf, BUFSIZE, stdin)) {
+        die("Unable to read line");
+    }
+    chomp_string(usernamebuf);
+    printf("Enter IMAP password: ");
+    if (!input_password(passwordbuf)) {
+        die("Unable to read line");
+    }
+    chomp_string(passwordbuf);
+    printf("\n");
+    printf("Enter IMAP mailbox: ");
+    if (!fgets(mailboxbuf, BUFSIZE, stdin)) {
+        die("Unable to read line");
+    }
+    chomp_string(mailboxbuf);
+
+    write_string_to_new_file(usernamebuf, ".username");
+    write_string_to_new_file(passwordbuf, ".password");
+    write_string_to_new_file(mailboxbuf, ".mailbox");
+
+    exit(0);
+}
+
+/* Finds a message by message number, or by its file name .UID */
+static struct index_record *find_message(char *arg)
+{
+    if (arg[0] == '.') {
+        if (!is_filename_uid(arg)) {
+            return NULL;
+        }
+        return index_find(strtoul(arg+1, NULL, 10));
+    }
+    if (!str_validchars_endchar(arg, DIGITCHARS, 0)) {
+        return NULL;
+    }
+    unsigned long msgnum = strtoul(arg, NULL, 10);
+    for (int i=0; i<_indexcount; i++) {
+        if (_index[i].msgnum == msgnum) {
+            return &_index[i];
+        }
+    }
+    return NULL;
+}
+
+/* Replaces the header-only files of the uids in set with the full
+   messages. The mailbox is opened with EXAMINE so that \Seen is not set. */
+static void fetch_message_bodies(struct uid_set *set)
+{
+    char usernamebuf[BUFSIZE];
+    char passwordbuf[BUFSIZE];
+    char mailboxbuf[BUFSIZE];
+    read_first_line_from_file(".username", usernamebuf);
+    read_first_line_from_file(".password", passwordbuf);
+    read_first_line_from_file(".mailbox", mailboxbuf);
+    unsigned long uidvalidity = read_optional_number_from_file(".uidvalidity", 0);
+    if (!uidvalidity) {
+        die("Invalid .uidvalidity");
+    }
+
+    open_connection();
+
+    wait_for_initial_ok();
+
+    do_login(usernamebuf, passwordbuf);
+
+    unsigned long server_uidvalidity, highestmodseq, uidnext;
+    select_mailbox_status("examine", mailboxbuf, &server_uidvalidity, &highestmodseq, &uidnext);
+    if (server_uidvalidity != uidvalidity) {
+        die("UIDVALIDITY '%lu' does not match .uidvalidity '%lu', the mailbox may have changed, run 'imap-mh reconcile'", server_uidvalidity, uidvalidity);
+    }
+
+    mark_index_dirty();
+    _headersfirst = 0;
+    do_pipelined_fetch(set, get_fetch_window());
+    write_mh_sequences();
+    save_index();
+
+    do_logout();
+}
+
+static void imap_mh_get(char *arg)
+{
+    load_index();
+    struct index_record *rec = find_message(arg);
+    if (!rec) {
+        die("No message '%s'", arg);
+    }
+    if (!(rec->flags & MESSAGE_PARTIAL)) {
+debuglog("message '%s' is already complete", arg);
+        exit(0);
+    }
+    uid_set_clear(&_fetchset);
+    uid_set_add(&_fetchset, rec->uid);
+    fetch_message_bodies(&_fetchset);
+    exit(0);
+}
+
+static void imap_mh_backfill()
+{
+    load_index();
+    uid_set_clear(&_fetchset);
+    for (int i=0; i<_indexcount; i++) {
+        if (_index[i].flags & MESSAGE_PARTIAL) {
+            uid_set_add(&_fetchset, _index[i].uid);
+        }
+    }
+debuglog("backfilling %lu messages", uid_set_size(&_fetchset));
+    if (_fetchset.count) {
+        fetch_message_bodies(&_fetchset);
+    }
+    exit(0);
+}
+
+static struct pack_entry *_packnew;
+static int _packnewcapacity;
+
+static void format_pack_name(unsigned long generation, char *name)
+{
+    sprintf(name, ".pack.%lu", generation);
+}
+
+/* Deflates the file into the pack at the current offset of packfd,
+   returns the length of the record */
+static uint64_t append_pack_record(int packfd, int dirfd, struct index_record *rec, z_stream *zs)
+{
+    char filename[64];
+    snprintf(filename, sizeof(filename), ".%lu", (unsigned long)rec->uid);
+    int fd = openat(dirfd, filename, O_RDONLY);
+    if (fd < 0) {
+        die("Unable to open '%s'", filename);
+    }
+    off_t offset = lseek(packfd, 0, SEEK_CUR);
+    struct pack_record_header hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    write_all(packfd, (char *)&hdr, sizeof(hdr));
+    if (deflateReset(zs) != Z_OK) {
+        die("Unable to deflate '%s'", filename);
+    }
     for(;;) {
-        read_line();
-        if (string_prefix_endp(_buf, "qresync OK")) {
+        int n = read(fd, _litbuf, LITBUFSIZE);
+        if (n < 0) {
+            die("Unable to read '%s'", filename);
+        }
+        zs->next_in = (Bytef *)_litbuf;
+        zs->avail_in = n;
+        do {
+            zs->next_out = (Bytef *)_zoutbuf;
+            zs->avail_out = ZBUFSIZE;
+            if (deflate(zs, n ? Z_NO_FLUSH : Z_FINISH) == Z_STREAM_ERROR) {
+                die("Unable to deflate '%s'", filename);
+            }
+            write_all(packfd, _zoutbuf, ZBUFSIZE - zs->avail_out);
+        } while (!zs->avail_out);
+        if (!n) {
+            break;
+        }
+    }
+    close(fd);
+    hdr.uid = rec->uid;
+    hdr.clen = zs->total_out;
+    hdr.rlen = zs->total_in;
+    hdr.internaldate = rec->internaldate;
+    if (pwrite(packfd, &hdr, sizeof(hdr), offset) != sizeof(hdr)) {
+        die("Unable to write pack");
+    }
+    return sizeof(hdr) + hdr.clen;
+}
+
+/* Writes '.packidx.tmp' with the entries in the current .packidx merged
+   with the count new ones, a packed uid that is packed again leaves its
+   old record dead. Tombstoned entries are dropped, their bytes are
+   already counted. */
+static void write_pack_index(unsigned long generation, int count, uint64_t deadbytes)
+{
+    unlink(".packidx.tmp");
+    FILE *fp = open_file_for_writing(".packidx.tmp");
+    if (!fp) {
+        die("Unable to create .packidx.tmp");
+    }
+    struct pack_header hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    fwrite(&hdr, sizeof(hdr), 1, fp);
+    uint64_t oldcount = _packheader ? _packheader->count : 0;
+    uint64_t i = 0;
+    int j = 0;
+    while ((i < oldcount) || (j < count)) {
+        struct pack_entry *entry;
+        if ((j == count) || ((i < oldcount) && (_packentries[i].uid < _packnew[j].uid))) {
+            entry = &_packentries[i++];
+        } else {
+            if ((i < oldcount) && (_packentries[i].uid == _packnew[j].uid)) {
+                if (!_packentries[i].tombstone) {
+                    deadbytes += sizeof(struct pack_record_header) + _packentries[i].clen;
+                }
+                i++;
+            }
+            entry = &_packnew[j++];
+        }
+        if (entry->tombstone) {
+            continue;
+        }
+        fwrite(entry, sizeof(*entry), 1, fp);
+        hdr.count++;
+    }
+    memcpy(hdr.magic, PACK_MAGIC, 8);
+    hdr.generation = generation;
+    hdr.deadbytes = deadbytes;
+    if ((fseek(fp, 0, SEEK_SET) != 0)
+     || (fwrite(&hdr, sizeof(hdr), 1, fp) != 1)
+     || (fflush(fp) != 0)
+     || (fsync(fileno(fp)) != 0))
+    {
+        die("Unable to write .packidx.tmp");
+    }
+    fclose(fp);
+}
+
+static void commit_pack_index(int dirfd)
+{
+    unmap_pack_index();
+    if (rename(".packidx.tmp", ".packidx") != 0) {
+        die("Unable to rename .packidx.tmp");
+    }
+    if (fsync(dirfd) != 0) {
+        die("Unable to fsync directory");
+    }
+}
+
+/* Copies the live records into the next generation of the pack */
+static void compact_pack(int dirfd)
+{
+    unsigned long generation = _packheader->generation;
+    char oldname[64];
+    char newname[64];
+    format_pack_name(generation, oldname);
+    format_pack_name(generation+1, newname);
+debuglog("compacting '%s' with %lu dead bytes into '%s'", oldname, (unsigned long)_packheader->deadbytes, newname);
+    int oldfd = openat(dirfd, oldname, O_RDONLY);
+    if (oldfd < 0) {
+        die("Unable to open '%s'", oldname);
+    }
+    int newfd = openat(dirfd, newname, O_WRONLY|O_CREAT|O_TRUNC, 0600);
+    if (newfd < 0) {
+        die("Unable to create '%s'", newname);
+    }
+    int count = 0;
+    uint64_t offset = 0;
+    for (uint64_t i=0; i<_packheader->count; i++) {
+        struct pack_entry *entry = &_packentries[i];
+        if (entry->tombstone) {
+            continue;
+        }
+        uint64_t remaining = sizeof(struct pack_record_header) + entry->clen;
+        grow_array(&_packnew, &_packnewcapacity, count+1, sizeof(struct pack_entry));
+        _packnew[count] = *entry;
+        _packnew[count].offset = offset;
+        count++;
+        offset += remaining;
+        off_t pos = entry->offset;
+        while (remaining > 0) {
+            int n = (remaining > LITBUFSIZE) ? LITBUFSIZE : remaining;
+            if (pread(oldfd, _litbuf, n, pos) != n) {
+                die("Unable to read '%s'", oldname);
+            }
+            write_all(newfd, _litbuf, n);
+            pos += n;
+            remaining -= n;
+        }
+    }
+    close(oldfd);
+    if (fsync(newfd) != 0) {
+        die("Unable to fsync '%s'", newname);
+    }
+    close(newfd);
+    unmap_pack_index();
+    write_pack_index(generation+1, count, 0);
+    commit_pack_index(dirfd);
+}
+
+/* Removes the packs of other generations, left behind by compaction */
+static void remove_stale_packs(int dirfd, unsigned long generation)
+{
+    DIR *dir = fdopendir(dup(dirfd));
+    if (!dir) {
+        die("Unable to open current directory");
+    }
+    for(;;) {
+        struct dirent *ent = readdir(dir);
+        if (!ent) {
+            break;
+        }
+        char *p = string_prefix_endp(ent->d_name, ".pack.");
+        if (!p || !str_validchars_endchar(p, DIGITCHARS, 0)) {
+            continue;
+        }
+        if (strtoul(p, NULL, 10) == generation) {
+            continue;
+        }
+debuglog("removing stale pack '%s'", ent->d_name);
+        if (unlinkat(dirfd, ent->d_name, 0) != 0) {
+            die("Unable to unlink '%s'", ent->d_name);
+        }
+    }
+    closedir(dir);
+}
+
+/* Moves complete messages older than .packdays days into the pack,
+   compacting it when more than half of it is dead */
+static void imap_mh_pack()
+{
+    load_index();
+    mark_index_dirty();
+    int dirfd = open_current_directory();
+    int storedirfd = get_store_directory();
+    time_t cutoff = time(NULL) - (time_t)read_optional_number_from_file(".packdays", DEFAULT_PACK_DAYS)*24*60*60;
+
+    unsigned long generation = 1;
+    uint64_t deadbytes = 0;
+    if (map_pack_index()) {
+        generation = _packheader->generation;
+        deadbytes = _packheader->deadbytes;
+    }
+    char packname[64];
+    format_pack_name(generation, packname);
+    int packfd = openat(dirfd, packname, O_WRONLY|O_CREAT, 0600);
+    if (packfd < 0) {
+        die("Unable to open '%s'", packname);
+    }
+    /* anything after the last indexed record was left by a crash */
+    uint64_t offset = lseek(packfd, 0, SEEK_END);
+
+    z_stream zs;
+    memset(&zs, 0, sizeof(zs));
+    zs.zalloc = zarena_alloc;
+    zs.zfree = zarena_free;
+    _zarenaused = 0;
+    if (deflateInit2(&zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        die("Unable to initialize zlib");
+    }
+    int count = 0;
+    uint64_t rawbytes = 0;
+    for (int i=0; i<_indexcount; i++) {
+        struct index_record *rec = &_index[i];
+        if ((rec->flags & (MESSAGE_PARTIAL|MESSAGE_PACKED)) || (rec->internaldate >= cutoff)) {
+            continue;
+        }
+        grow_array(&_packnew, &_packnewcapacity, count+1, sizeof(struct pack_entry));
+        struct pack_entry *entry = &_packnew[count++];
+        memset(entry, 0, sizeof(*entry));
+        entry->uid = rec->uid;
+        entry->offset = offset;
+        entry->internaldate = rec->internaldate;
+        entry->flags = rec->flags & MESSAGE_FLAGS;
+        offset += append_pack_record(packfd, dirfd, rec, &zs);
+        entry->clen = zs.total_out;
+        entry->rlen = zs.total_in;
+        rawbytes += entry->rlen;
+    }
+    deflateEnd(&zs);
+    _zarenaused = 0;
+    if (fsync(packfd) != 0) {
+        die("Unable to fsync '%s'", packname);
+    }
+    close(packfd);
+    if (!offset) {
+        unlinkat(dirfd, packname, 0);
+    }
+debuglog("packed %d messages of %lu bytes", count, (unsigned long)rawbytes);
+
+    if (count) {
+        write_pack_index(generation, count, deadbytes);
+        commit_pack_index(dirfd);
+        for (int j=0; j<count; j++) {
+            struct index_record *rec = index_find(_packnew[j].uid);
+            char filename[64];
+            snprintf(filename, sizeof(filename), ".%lu", (unsigned long)rec->uid);
+            if (unlinkat(dirfd, filename, 0) != 0) {
+                die("Unable to unlink '%s'", filename);
+            }
+            if ((storedirfd >= 0) && !is_zero_hash(rec->hash)) {
+                release_store_object(rec->hash);
+            }
+            if (rec->msgnum) {
+                set_message_symlink(dirfd, rec->msgnum, 0);
+            }
+            rec->msgnum = 0;
+            rec->flags |= MESSAGE_PACKED;
+            memset(rec->hash, 0, 32);
+        }
+        if (fsync(dirfd) != 0) {
+            die("Unable to fsync directory");
+        }
+    }
+
+    if (map_pack_index()) {
+        if (_packheader->deadbytes*2 > offset) {
+            compact_pack(dirfd);
+            map_pack_index();
+        }
+        remove_stale_packs(dirfd, _packheader->generation);
+    }
+    close(dirfd);
+    update_message_symlinks();
+    save_index();
+    exit(0);
+}
+
+/* Inflates the packed message from the open pack into its .UID file,
+   the caller syncs the directory */
+static void unpack_message_file(int dirfd, int packfd, char *packname, struct pack_entry *entry)
+{
+    char filename[64];
+    char partname[64];
+    snprintf(filename, sizeof(filename), ".%lu", (unsigned long)entry->uid);
+    snprintf(partname, sizeof(partname), ".%lu.part", (unsigned long)entry->uid);
+    struct pack_record_header hdr;
+    if ((pread(packfd, &hdr, sizeof(hdr), entry->offset) != sizeof(hdr)) || (hdr.uid != entry->uid)) {
+        die("Invalid record for '%s' in '%s'", filename, packname);
+    }
+    int fd = openat(dirfd, partname, O_WRONLY|O_CREAT|O_TRUNC, 0600);
+    if (fd < 0) {
+        die("Unable to create file '%s'", partname);
+    }
+
+    z_stream zs;
+    memset(&zs, 0, sizeof(zs));
+    zs.zalloc = zarena_alloc;
+    zs.zfree = zarena_free;
+    _zarenaused = 0;
+    if (inflateInit2(&zs, -15) != Z_OK) {
+        die("Unable to initialize zlib");
+    }
+    off_t pos = entry->offset + sizeof(hdr);
+    uint64_t remaining = entry->clen;
+    int result = Z_OK;
+    while (remaining > 0) {
+        int n = (remaining > ZBUFSIZE) ? ZBUFSIZE : remaining;
+        if (pread(packfd, _zinbuf, n, pos) != n) {
+            die("Unable to read '%s'", packname);
+        }
+        pos += n;
+        remaining -= n;
+        zs.next_in = (Bytef *)_zinbuf;
+        zs.avail_in = n;
+        do {
+            zs.next_out = (Bytef *)_litbuf;
+            zs.avail_out = LITBUFSIZE;
+            result = inflate(&zs, Z_NO_FLUSH);
+            if ((result != Z_OK) && (result != Z_STREAM_END) && (result != Z_BUF_ERROR)) {
+                die("Unable to inflate '%s'", filename);
+            }
+            write_all(fd, _litbuf, LITBUFSIZE - zs.avail_out);
+        } while (!zs.avail_out);
+    }
+    if ((result != Z_STREAM_END) || (zs.total_out != entry->rlen)) {
+        die("Packed message '%s' is corrupt", filename);
+    }
+    inflateEnd(&zs);
+    _zarenaused = 0;
+
+    struct timespec times[2];
+    times[0].tv_sec = entry->internaldate;
+    times[0].tv_nsec = 0;
+    times[1] = times[0];
+    futimens(fd, times);
+    if (fsync(fd) != 0) {
+        die("Unable to fsync '%s'", partname);
+    }
+    close(fd);
+    if (renameat(dirfd, partname, dirfd, filename) != 0) {
+        die("Unable to rename '%s' to '%s'", partname, filename);
+    }
+tracelog("unpacked '%s'", filename);
+}
+
+/* Inflates the packed message into its .UID file and tombstones it */
+static void imap_mh_unpack(char *arg)
+{
+    load_index();
+    struct index_record *rec = find_message(arg);
+    if (!rec) {
+        die("No message '%s'", arg);
+    }
+    if (!(rec->flags & MESSAGE_PACKED)) {
+debuglog("message '%s' is not packed", arg);
+        exit(0);
+    }
+    struct pack_entry *entry = find_pack_entry(rec->uid);
+    if (!entry) {
+        die("Message '%s' is not in .packidx", arg);
+    }
+    mark_index_dirty();
+    int dirfd = open_current_directory();
+    char packname[64];
+    format_pack_name(_packheader->generation, packname);
+    int packfd = openat(dirfd, packname, O_RDONLY);
+    if (packfd < 0) {
+        die("Unable to open '%s'", packname);
+    }
+    unpack_message_file(dirfd, packfd, packname, entry);
+    close(packfd);
+    if (fsync(dirfd) != 0) {
+        die("Unable to fsync directory");
+    }
+    close(dirfd);
+debuglog("unpacked '%s'", arg);
+
+    tombstone_pack_entry(entry);
+    rec->flags &= ~MESSAGE_PACKED;
+    update_message_symlinks();
+    save_index();
+    exit(0);
+}
+
+/* After the UIDVALIDITY of a mailbox changes, for example when it was
+   moved to another server, reconcile gives the local messages their new
+   uids instead of downloading everything again. The Message-ID of every
+   local message is read once from its header, then the server is asked
+   for the Message-ID, INTERNALDATE, RFC822.SIZE and FLAGS of all of its
+   messages. A message with the same Message-ID and INTERNALDATE, and no
+   larger than RFC822.SIZE since the file has LF line endings, is renamed
+   to its new uid. Only the messages without a match are downloaded. */
+
+#define RECONCILE_MAGIC "IMAPMHR1"
+
+/* '.reconcile' lists the renames, so that they can be finished after a
+   crash. A file is first renamed to '.NEW.renamed' and only then to
+   '.NEW', because the new uid of one message may be the old uid of
+   another. phase is 1 until every file has its temporary name. */
+struct reconcile_header {
+    char magic[8];
+    uint64_t count;
+    uint64_t phase;
+};
+
+struct reconcile_rename {
+    uint64_t olduid;
+    uint64_t newuid;
+};
+
+/* A local message, the key is a hash of its Message-ID or 0 if it has
+   none, index is its position in _index */
+struct reconcile_entry {
+    uint64_t key;
+    int64_t internaldate;
+    uint64_t size;
+    uint64_t newuid; /* 0 until matched */
+    uint64_t newflags;
+    int index;
+};
+
+static struct reconcile_entry *_reconcile;
+static int _reconcilecount;
+static int _reconcilecapacity;
+
+/* Returns a hash of the Message-ID field in the header in buf, or 0 if
+   there is none. The value is taken between the angle brackets, so that
+   folding and comments do not matter. */
+static uint64_t message_id_key(char *buf, int len)
+{
+    char *p = buf;
+    char *endp = buf + len;
+    while (p < endp) {
+        char *eol = memchr(p, '\n', endp - p);
+        if (!eol) {
+            eol = endp;
+        }
+        if ((eol == p) || ((eol == p+1) && (*p == '\r'))) {
+            break;
+        }
+        if ((eol - p > 11) && !strncasecmp(p, "Message-ID:", 11)) {
+            char *value = p + 11;
+            while ((eol+1 < endp) && ((eol[1] == ' ') || (eol[1] == '\t'))) {
+                char *next = memchr(eol+1, '\n', endp - (eol+1));
+                eol = next ? next : endp;
+            }
+            char *first = memchr(value, '<', eol - value);
+            char *last = first ? memchr(first, '>', eol - first) : NULL;
+            if (!last) {
+                first = value;
+                last = eol - 1;
+                while ((first <= last) && strchr(" \t\r\n", *first)) {
+                    first++;
+                }
+                while ((last >= first) && strchr(" \t\r\n", *last)) {
+                    last--;
+                }
+                if (first > last) {
+                    return 0;
+                }
+            }
+            struct sha256 sha;
+            unsigned char digest[32];
+            sha256_init(&sha);
+            sha256_update(&sha, first, last + 1 - first);
+            sha256_final(&sha, digest);
+            uint64_t key = 0;
+            for (int i=0; i<8; i++) {
+                key = (key << 8) | digest[i];
+            }
+            return key ? key : 1;
+        }
+        p = eol + 1;
+    }
+    return 0;
+}
+
+/* Reads the header of a message file into _litbuf, returns its length */
+static int read_message_header(int dirfd, char *name)
+{
+    int fd = openat(dirfd, name, O_RDONLY);
+    if (fd < 0) {
+        die("Unable to open '%s'", name);
+    }
+    int len = 0;
+    while (len < LITBUFSIZE) {
+        int n = LITBUFSIZE - len;
+        if (n > 16384) {
+            n = 16384;
+        }
+        n = read(fd, _litbuf+len, n);
+        if (n < 0) {
+            die("Unable to read '%s'", name);
+        }
+        if (!n) {
+            break;
+        }
+        len += n;
+        if (memmem(_litbuf, len, "\n\n", 2)) {
+            break;
+        }
+    }
+    close(fd);
+    return len;
+}
+
+static int compare_reconcile_entries(const void *a, const void *b)
+{
+    const struct reconcile_entry *x = a;
+    const struct reconcile_entry *y = b;
+    if (x->key != y->key) {
+        return (x->key < y->key) ? -1 : 1;
+    }
+    if (x->internaldate != y->internaldate) {
+        return (x->internaldate < y->internaldate) ? -1 : 1;
+    }
+    return x->index - y->index;
+}
+
+static int compare_index_records(const void *a, const void *b)
+{
+    const struct index_record *x = a;
+    const struct index_record *y = b;
+    if (x->uid != y->uid) {
+        return (x->uid < y->uid) ? -1 : 1;
+    }
+    return 0;
+}
+
+/* Finds the first unmatched local message with the key and date that is
+   not larger than size */
+static struct reconcile_entry *find_reconcile_entry(uint64_t key, int64_t internaldate, uint64_t size)
+{
+    int lo = 0;
+    int hi = _reconcilecount;
+    while (lo < hi) {
+        int mid = lo + (hi - lo)/2;
+        struct reconcile_entry *entry = &_reconcile[mid];
+        if ((entry->key < key) || ((entry->key == key) && (entry->internaldate < internaldate))) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    for (int i=lo; i<_reconcilecount; i++) {
+        struct reconcile_entry *entry = &_reconcile[i];
+        if ((entry->key != key) || (entry->internaldate != internaldate)) {
+            break;
+        }
+        if (!entry->newuid && (entry->size <= size)) {
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+/* Matches a FETCH response to the local messages, the uids without a
+   match are added to _fetchset */
+static void receive_reconcile_response()
+{
+    char *p = string_prefix_endp(_buf, "* ");
+    if (!p || !(p = strstr(p, " FETCH "))) {
+debuglog("Error, ' FETCH ' not found");
+        return;
+    }
+    p += 7;
+    struct token tok;
+    if (next_token(&p, &tok) != TOKEN_OPEN) {
+debuglog("Error, '(' not found");
+        return;
+    }
+    unsigned long uid = 0;
+    time_t internaldate = 0;
+    uint64_t size = 0;
+    int flags = 0;
+    uint64_t key = 0;
+    for(;;) {
+        if (next_token(&p, &tok) == TOKEN_CLOSE) {
             break;
         }
-        if (string_prefix_endp(_buf, "qresync NO")
-         || string_prefix_endp(_buf, "qresync BAD"))
-        {
-            die("Unable to enable qresync '%s'", _buf);
+        if (tok.type != TOKEN_ATOM) {
+            die("Expecting FETCH item '%s'", tok.str);
+        }
+        struct token name = tok;
+        next_token(&p, &tok);
+        if (token_is(&name, "UID") && (tok.type == TOKEN_ATOM)) {
+            uid = strtoul(tok.str, NULL, 10);
+        } else if (token_is(&name, "INTERNALDATE") && (tok.type == TOKEN_QUOTED)) {
+            internaldate = parse_internaldate(tok.str);
+        } else if (token_is(&name, "RFC822.SIZE") && (tok.type == TOKEN_ATOM)) {
+            size = strtoull(tok.str, NULL, 10);
+        } else if (token_is(&name, "FLAGS") && (tok.type == TOKEN_OPEN)) {
+            while (next_token(&p, &tok) == TOKEN_ATOM) {
+                flags |= message_flag(tok.str, tok.len);
+            }
+            if (tok.type != TOKEN_CLOSE) {
+                die("Invalid FLAGS in response");
+            }
+        } else if (!strncasecmp(name.str, "BODY[HEADER.FIELDS", 18) && (tok.type == TOKEN_LITERAL)) {
+            char header[BUFSIZE];
+            receive_literal_string(tok.num, header, sizeof(header));
+            key = message_id_key(header, strlen(header));
+            read_line();
+            p = _buf;
+        } else if (!strncasecmp(name.str, "BODY[HEADER.FIELDS", 18) && (tok.type == TOKEN_QUOTED)) {
+            key = message_id_key(tok.str, tok.len);
+        } else {
+            skip_token_value(&p, &tok);
+        }
+    }
+    if (!uid) {
+debuglog("Error, 'UID' not found");
+        return;
+    }
+    struct reconcile_entry *entry = key ? find_reconcile_entry(key, internaldate, size) : NULL;
+    if (entry) {
+        entry->newuid = uid;
+        entry->newflags = flags;
+    } else {
+        uid_set_add(&_fetchset, uid);
+    }
+}
+
+/* A pack is keyed by the old uids, so every packed message is unpacked
+   and the pack removed. Run pack again afterwards. */
+static void unpack_all_messages(int dirfd)
+{
+    if (!map_pack_index()) {
+        return;
+    }
+    char packname[64];
+    format_pack_name(_packheader->generation, packname);
+    int packfd = openat(dirfd, packname, O_RDONLY);
+    int count = 0;
+    for (int i=0; i<_indexcount; i++) {
+        struct index_record *rec = &_index[i];
+        if (!(rec->flags & MESSAGE_PACKED)) {
+            continue;
+        }
+        struct pack_entry *entry = find_pack_entry(rec->uid);
+        if (!entry) {
+            die("Packed uid %lu is not in .packidx", (unsigned long)rec->uid);
+        }
+        if (packfd < 0) {
+            die("Unable to open '%s'", packname);
         }
+        unpack_message_file(dirfd, packfd, packname, entry);
+        rec->flags &= ~MESSAGE_PACKED;
+        count++;
     }
+    if (packfd >= 0) {
+        close(packfd);
+    }
+    if (fsync(dirfd) != 0) {
+        die("Unable to fsync directory");
+    }
+    unmap_pack_index();
+    if (unlink(".packidx") != 0) {
+        die("Unable to unlink .packidx");
+    }
+    remove_stale_packs(dirfd, 0);
+debuglog("unpacked %d messages", count);
 }
 
-static void do_fetch(char *range)
+/* Runs the renames in '.reconcile' and removes it. Each phase can be run
+   again after a crash, a rename whose source is gone was already done. */
+static void run_reconcile_renames(int dirfd)
 {
-    write_string("fetch uid fetch %s RFC822\r\n", range);
-    for(;;) {
-        read_line();
-        if (string_prefix_endp(_buf, "fetch OK")) {
-            break;
+    int fd = open(".reconcile", O_RDWR);
+    if (fd < 0) {
+        return;
+    }
+    struct reconcile_header hdr;
+    if ((pread(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr)) || memcmp(hdr.magic, RECONCILE_MAGIC, 8)) {
+        die("Invalid .reconcile");
+    }
+    FILE *fp = fdopen(fd, "r+");
+    if (!fp) {
+        die("Unable to open .reconcile");
+    }
+    for (int phase=hdr.phase; phase<=2; phase++) {
+        if (fseek(fp, sizeof(hdr), SEEK_SET) != 0) {
+            die("Unable to seek .reconcile");
         }
-        if (string_prefix_endp(_buf, "fetch NO")
-         || string_prefix_endp(_buf, "fetch BAD"))
-        {
-            die("Unable to uid fetch %s '%s'", range, _buf);
+        for (uint64_t i=0; i<hdr.count; i++) {
+            struct reconcile_rename rename;
+            if (fread(&rename, sizeof(rename), 1, fp) != 1) {
+                die("Unable to read .reconcile");
+            }
+            char oldname[64];
+            char tmpname[64];
+            char newname[64];
+            snprintf(oldname, sizeof(oldname), ".%lu", (unsigned long)rename.olduid);
+            snprintf(tmpname, sizeof(tmpname), ".%lu.renamed", (unsigned long)rename.newuid);
+            snprintf(newname, sizeof(newname), ".%lu", (unsigned long)rename.newuid);
+            char *from = (phase == 1) ? oldname : tmpname;
+            char *to = (phase == 1) ? tmpname : newname;
+            if ((renameat(dirfd, from, dirfd, to) != 0) && (errno != ENOENT)) {
+                die("Unable to rename '%s' to '%s'", from, to);
+            }
         }
-        char *p = string_prefix_endp(_buf, "* ");
-        if (!p) {
-debuglog("Error, '* ' not found");
-            continue;
+        if (fsync(dirfd) != 0) {
+            die("Unable to fsync directory");
         }
-        if (!strchr(DIGITCHARS, *p)) {
-debuglog("Error, digit not found");
-            continue;
+        if (phase == 1) {
+            hdr.phase = 2;
+            if ((pwrite(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr)) || (fsync(fd) != 0)) {
+                die("Unable to write .reconcile");
+            }
         }
-        p++;
+    }
+debuglog("renamed %lu messages", (unsigned long)hdr.count);
+    fclose(fp);
+    unlink(".reconcile");
+}
 
-        p = strstr(p, " FETCH ");
-        if (!p) {
-debuglog("Error, ' FETCH ' not found");
-            continue;
+static void write_reconcile_renames(int dirfd)
+{
+    unlink(".reconcile.tmp");
+    FILE *fp = open_file_for_writing(".reconcile.tmp");
+    if (!fp) {
+        die("Unable to create .reconcile.tmp");
+    }
+    struct reconcile_header hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, RECONCILE_MAGIC, 8);
+    hdr.phase = 1;
+    for (int i=0; i<_reconcilecount; i++) {
+        struct reconcile_entry *entry = &_reconcile[i];
+        if (entry->newuid && (entry->newuid != _index[entry->index].uid)) {
+            hdr.count++;
+        }
+    }
+    fwrite(&hdr, sizeof(hdr), 1, fp);
+    for (int i=0; i<_reconcilecount; i++) {
+        struct reconcile_entry *entry = &_reconcile[i];
+        if (entry->newuid && (entry->newuid != _index[entry->index].uid)) {
+            struct reconcile_rename rename;
+            rename.olduid = _index[entry->index].uid;
+            rename.newuid = entry->newuid;
+            fwrite(&rename, sizeof(rename), 1, fp);
         }
-        p += 7;
+    }
+    if ((fflush(fp) != 0) || (fsync(fileno(fp)) != 0)) {
+        die("Unable to write .reconcile.tmp");
+    }
+    fclose(fp);
+    if (rename(".reconcile.tmp", ".reconcile") != 0) {
+        die("Unable to rename .reconcile.tmp");
+    }
+    if (fsync(dirfd) != 0) {
+        die("Unable to fsync directory");
+    }
+}
 
-        char *uid_p = strstr(p, "UID ");
-        if (!uid_p) {
-debuglog("Error, 'UID ' not found");
-            continue;
+static void reconcile_folder(char *mailbox)
+{
+    read_headersfirst();
+    int dirfd = open_current_directory();
+    /* renames left by an interrupted reconcile are finished first, the
+       index is dirty then and is rebuilt from the directory */
+    run_reconcile_renames(dirfd);
+    unlink(".journal");
+    load_index();
+    mark_index_dirty();
+    unpack_all_messages(dirfd);
+
+    long startus = monotonic_microseconds();
+    _reconcilecount = 0;
+    grow_array(&_reconcile, &_reconcilecapacity, _indexcount, sizeof(struct reconcile_entry));
+    for (int i=0; i<_indexcount; i++) {
+        struct index_record *rec = &_index[i];
+        char filename[64];
+        snprintf(filename, sizeof(filename), ".%lu", (unsigned long)rec->uid);
+        struct reconcile_entry *entry = &_reconcile[_reconcilecount++];
+        entry->key = message_id_key(_litbuf, read_message_header(dirfd, filename));
+        entry->internaldate = rec->internaldate;
+        entry->size = rec->size;
+        entry->newuid = 0;
+        entry->newflags = 0;
+        entry->index = i;
+    }
+    qsort(_reconcile, _reconcilecount, sizeof(struct reconcile_entry), compare_reconcile_entries);
+debuglog("read the Message-ID of %d local messages in %ld ms", _reconcilecount, (monotonic_microseconds() - startus)/1000);
+
+    unsigned long uidvalidity, highestmodseq, uidnext;
+    select_mailbox_status("select", mailbox, &uidvalidity, &highestmodseq, &uidnext);
+debuglog("uidvalidity %lu highestmodseq %lu uidnext %lu", uidvalidity, highestmodseq, uidnext);
+
+    startus = monotonic_microseconds();
+    uid_set_clear(&_fetchset);
+    write_string("reconcile uid fetch 1:* (FLAGS INTERNALDATE RFC822.SIZE BODY.PEEK[HEADER.FIELDS (MESSAGE-ID)])\r\n");
+    for(;;) {
+        read_line();
+        if (string_prefix_endp(_buf, "reconcile OK")) {
+            break;
         }
-        uid_p += 4;
-        char *uid_endp = NULL;
-        strtoul(uid_p, &uid_endp, 10);
-        if (uid_p == uid_endp) {
-debuglog("Error, uid_endp not found");
-            continue;
+        if (string_prefix_endp(_buf, "reconcile NO")
+         || string_prefix_endp(_buf, "reconcile BAD"))
+        {
+            die("Unable to fetch Message-IDs '%s'", _buf);
         }
-        *uid_endp = 0;
-debuglog("uid '%s'", uid_p);
-        p = uid_endp+1;
+        receive_reconcile_response();
+    }
+    add_phase_time(PHASE_FETCH, startus);
 
-        p = strstr(p, "RFC822 {");
-        if (!p) {
-debuglog("No 'RFC822 {'");
+    /* local messages without a match are removed like vanished ones,
+       before any file takes a new uid that may be theirs */
+    int storedirfd = get_store_directory();
+    int matched = 0;
+    int removed = 0;
+    for (int i=0; i<_reconcilecount; i++) {
+        struct reconcile_entry *entry = &_reconcile[i];
+        struct index_record *rec = &_index[entry->index];
+        if (entry->newuid) {
+            matched++;
             continue;
         }
-        p += 8;
+        char filename[64];
+        snprintf(filename, sizeof(filename), ".%lu", (unsigned long)rec->uid);
+        if ((unlinkat(dirfd, filename, 0) != 0) && (errno != ENOENT)) {
+            die("Unable to unlink '%s'", filename);
+        }
+        if ((storedirfd >= 0) && !is_zero_hash(rec->hash)) {
+            release_store_object(rec->hash);
+        }
+        if (rec->msgnum) {
+            set_message_symlink(dirfd, rec->msgnum, 0);
+        }
+        removed++;
+    }
+debuglog("matched %d local messages, removed %d, %lu to download", matched, removed, uid_set_size(&_fetchset));
+
+    write_reconcile_renames(dirfd);
+    run_reconcile_renames(dirfd);
 
-        char *fetch_size_endp = NULL;
-        int fetch_size = strtoul(p, &fetch_size_endp, 10);
-        if (p == fetch_size_endp) {
-debuglog("Error, fetch_size_endp not found");
+    for (int i=0; i<_reconcilecount; i++) {
+        struct reconcile_entry *entry = &_reconcile[i];
+        struct index_record *rec = &_index[entry->index];
+        rec->uid = entry->newuid;
+        if (!rec->uid) {
             continue;
         }
-        p = fetch_size_endp;
-        if (strcmp(p, "}\r\n") != 0) {
-debuglog("Error, '}\\r\\n' not found");
-            continue;
+        rec->flags = (rec->flags & ~MESSAGE_FLAGS) | entry->newflags;
+        if (rec->msgnum) {
+            set_message_symlink(dirfd, rec->msgnum, rec->uid);
+        }
+    }
+    int n = 0;
+    for (int i=0; i<_indexcount; i++) {
+        if (_index[i].uid) {
+            _index[n++] = _index[i];
         }
+    }
+    _indexcount = n;
+    qsort(_index, _indexcount, sizeof(struct index_record), compare_index_records);
+    close(dirfd);
 
-debuglog("uid '%s' fetch_size %d", uid_p, fetch_size);
-        {
-            char *q = uid_p-1;
-            *q = '.';
+    if (_fetchset.count) {
+        do_pipelined_fetch(&_fetchset, get_fetch_window());
+    }
+    update_message_symlinks();
+    save_index();
 
-            if (file_exists(q)) {
-                die("File '%s' already exists", q);
-            }
+    /* .uidvalidity is written last, until then reconcile can be run again */
+    char numbuf[64];
+    snprintf(numbuf, sizeof(numbuf), "%lu", highestmodseq);
+    unlink(".highestmodseq");
+    write_string_to_new_file(numbuf, ".highestmodseq");
+    unlink(".download");
+    snprintf(numbuf, sizeof(numbuf), "%lu", uidvalidity);
+    unlink(".uidvalidity");
+    write_string_to_new_file(numbuf, ".uidvalidity");
+}
 
-            int emailfd = open(q, O_WRONLY|O_CREAT|O_TRUNC, 0600);
-            FILE *emailfp = fdopen(emailfd, "w");
-            if (!emailfp) {
-                die("Unable to create file '%s'", q);
-            }
+static void imap_mh_reconcile()
+{
+    char usernamebuf[BUFSIZE];
+    char passwordbuf[BUFSIZE];
+    char mailboxbuf[BUFSIZE];
+    read_first_line_from_file(".username", usernamebuf);
+    read_first_line_from_file(".password", passwordbuf);
+    read_first_line_from_file(".mailbox", mailboxbuf);
 
-            int fetch_bytes_read = 0;
-            for(;;) {
-                if (fetch_bytes_read == fetch_size) {
-debuglog("success");
-                    break;
-                }
-                if (fetch_bytes_read >= fetch_size) {
-                    die("Read too many bytes");
-                }
+    open_connection();
 
-                if (!fgets(_buf, BUFSIZE, _infp)) {
-                    die("fgets failed");
-                }
+    wait_for_initial_ok();
 
-                int len = strlen(_buf);
+    do_login(usernamebuf, passwordbuf);
 
-                fetch_bytes_read += len;
+    do_enable_qresync();
 
-                if (len >= 2) {
-                    if (_buf[len-1] == '\n') {
-                        if (_buf[len-2] == '\r') {
-                            _buf[len-2] = '\n';
-                            _buf[len-1] = 0;
-                            len--;
-                        }
-                    }
-                }
-                int n = fwrite(_buf, 1, len, emailfp);
-                if (n != len) {
-                    die("fwrite error n %d len %d", n, len);
-                }
+    reconcile_folder(mailboxbuf);
 
-            }
+    do_logout();
 
-            fclose(emailfp);
-        }
+    exit(0);
+}
 
-        read_line();
-        if (!string_suffix(_buf, ")\r\n")) {
-            die("Expecting line ending with ')'");
-        }
+#define PUSH_BATCH_MESSAGES 64
+#define MAX_NONSYNC_LITERAL 4096 /* LITERAL- */
+
+/* A message file that was added to the folder with MH tools, such as inc
+   or refile, and has not been uploaded yet. It is a plain file with a
+   message number for a name instead of a symlink to '.UID'. */
+struct push_entry {
+    unsigned long msgnum;
+    uint64_t localsize;
+    uint64_t size; /* with CRLF line endings */
+    int64_t internaldate;
+    uint64_t flags;
+    int tagnum;
+};
+
+static struct push_entry *_push;
+static int _pushcount;
+static int _pushcapacity;
+static struct uid_set _deleteset;
+
+static int compare_push_entries(const void *a, const void *b)
+{
+    const struct push_entry *x = a;
+    const struct push_entry *y = b;
+    if (x->msgnum != y->msgnum) {
+        return (x->msgnum < y->msgnum) ? -1 : 1;
     }
+    return 0;
 }
 
-static void process_qresync_fetch()
+static int is_symlink_to(int dirfd, char *name, char *target)
 {
-    FILE *fp = fopen(".qresync", "r");
-    if (!fp) {
-debuglog("unable to open .qresync");
-        return;
-    }
-    for(;;) {
-        if (!fgets(_buf, BUFSIZE, fp)) {
-            break;
-        }
-        char *p = string_prefix_endp(_buf, "fetch ");
-        if (!p) {
-            continue;
-        }
-        char *q = str_validchars_endchar(p, DIGITCHARS, '\n');
-        if (!q) {
-debuglog("invalid fetch line '%s'", _buf);
-            continue;
-        }
-        *q = 0;
-debuglog("fetch '%s'", p);
-        char *filename = p-1;
-        *filename = '.';
-debuglog("Checking file '%s'", filename);
-        if (file_exists(filename)) {
-debuglog("File '%s' exists, skipping fetch", filename);
-        } else {
-debuglog("Performing fetch '%s'", p);
-            do_fetch(p);
-        }
+    char buf[64];
+    int len = readlinkat(dirfd, name, buf, sizeof(buf)-1);
+    if (len < 0) {
+        return 0;
     }
+    buf[len] = 0;
+    return !strcmp(buf, target);
 }
 
-static void process_qresync_vanished()
+static uint64_t *_linkedmsgnum;
+static int _linkedmsgnumcapacity;
+
+/* A message was removed locally, for example by rmm, if no number links
+   to its '.UID' file any more, or the file is gone. The numbers are read
+   in one pass, so a message that sortm or folder -pack gave another
+   number is not taken for removed, and the index gets its new number. */
+static void find_local_deletions(int dirfd)
 {
-    FILE *fp = fopen(".qresync", "r");
-    if (!fp) {
-debuglog("unable to open .qresync");
-        return;
+    grow_array(&_linkedmsgnum, &_linkedmsgnumcapacity, _indexcount, sizeof(uint64_t));
+    memset(_linkedmsgnum, 0, _indexcount*sizeof(uint64_t));
+    DIR *dir = fdopendir(dup(dirfd));
+    if (!dir) {
+        die("Unable to open current directory");
     }
     for(;;) {
-        if (!fgets(_buf, BUFSIZE, fp)) {
+        struct dirent *ent = readdir(dir);
+        if (!ent) {
             break;
         }
-        char *p = string_prefix_endp(_buf, "vanished ");
-        if (!p) {
+        if (!str_validchars_endchar(ent->d_name, DIGITCHARS, 0) || (ent->d_type == DT_REG)) {
             continue;
         }
-        char *q = str_validchars_endchar(p, DIGITCHARS ":,", '\n');
-        if (!q) {
-debuglog("invalid vanished line '%s'", _buf);
+        char target[64];
+        int len = readlinkat(dirfd, ent->d_name, target, sizeof(target)-1);
+        if (len < 0) {
             continue;
         }
-        *q = 0;
-debuglog("vanished '%s'", p);
-        unlink_files_in_range(p);
+        target[len] = 0;
+        if (!is_filename_uid(target)) {
+            continue;
+        }
+        unsigned long uid = strtoul(target+1, NULL, 10);
+        int i = index_search(uid);
+        if ((i == _indexcount) || (_index[i].uid != uid)) {
+            continue;
+        }
+        unsigned long msgnum = strtoul(ent->d_name, NULL, 10);
+        if (!_linkedmsgnum[i] || (msgnum < _linkedmsgnum[i])) {
+            _linkedmsgnum[i] = msgnum;
+        }
     }
-}
+    /* the duplicate shares its position with dirfd */
+    rewinddir(dir);
+    closedir(dir);
 
-static void process_qresync_highestmodseq()
-{
-    FILE *fp = fopen(".qresync", "r");
-    if (!fp) {
-debuglog("unable to open .qresync");
-        return;
-    }
-    for(;;) {
-        if (!fgets(_buf, BUFSIZE, fp)) {
-            break;
+    uid_set_clear(&_deleteset);
+    int renumbered = 0;
+    for (int i=0; i<_indexcount; i++) {
+        struct index_record *rec = &_index[i];
+        if (rec->flags & MESSAGE_PACKED) {
+            continue;
         }
-        char *p = string_prefix_endp(_buf, "highestmodseq ");
-        if (!p) {
+        if (!_linkedmsgnum[i]) {
+            if (rec->msgnum) {
+                uid_set_add(&_deleteset, rec->uid);
+            }
             continue;
         }
-        char *q = str_validchars_endchar(p, DIGITCHARS, '\n');
-        if (!q) {
-debuglog("invalid highestmodseq line '%s'", _buf);
-            break;
+        char filename[64];
+        snprintf(filename, sizeof(filename), ".%lu", (unsigned long)rec->uid);
+        struct stat statbuf;
+        if (fstatat(dirfd, filename, &statbuf, AT_SYMLINK_NOFOLLOW) != 0) {
+            uid_set_add(&_deleteset, rec->uid);
+            continue;
+        }
+        if (rec->msgnum != _linkedmsgnum[i]) {
+            rec->msgnum = _linkedmsgnum[i];
+            if (rec->msgnum > _indexmaxmsgnum) {
+                _indexmaxmsgnum = rec->msgnum;
+            }
+            renumbered++;
         }
-        *q = 0;
-debuglog("highestmodseq '%s'", p);
-        unlink(".highestmodseq");
-        write_string_to_new_file(p, ".highestmodseq");
-        return;
+    }
+    if (renumbered) {
+debuglog("%d messages have new numbers", renumbered);
     }
 }
 
-static int is_directory_empty(char *path)
+/* Returns the size of the message with bare LF line endings turned
+   into CRLF */
+static uint64_t crlf_message_size(char *data, uint64_t len)
 {
-    DIR *dir = opendir(path);
-    if (!dir) {
-debuglog("Error, unable to open directory '%s'", path);
-        return 0;
-    }
+    uint64_t size = len;
+    char *p = data;
+    char *endp = data + len;
     for(;;) {
-        struct dirent *ent = readdir(dir);
-        if (!ent) {
+        char *q = memchr(p, '\n', endp - p);
+        if (!q) {
             break;
         }
-        if (!strcmp(ent->d_name, ".")) {
-            continue;
-        }
-        if (!strcmp(ent->d_name, "..")) {
-            continue;
+        if ((q == data) || (q[-1] != '\r')) {
+            size++;
         }
-        return 0;
+        p = q+1;
     }
-    closedir(dir);
-    return 1;
+    return size;
 }
 
-static int is_directory_empty_except_for_init(char *path)
+static void find_local_additions(int dirfd)
 {
-    DIR *dir = opendir(path);
+    _pushcount = 0;
+    DIR *dir = fdopendir(dup(dirfd));
     if (!dir) {
-debuglog("Error, unable to open directory '%s'", path);
-        return 0;
+        die("Unable to open current directory");
     }
     for(;;) {
         struct dirent *ent = readdir(dir);
         if (!ent) {
             break;
         }
-        if (!strcmp(ent->d_name, ".")) {
+        char *p = ent->d_name;
+        if (!str_validchars_endchar(p, DIGITCHARS, 0) || (ent->d_type == DT_LNK)) {
             continue;
         }
-        if (!strcmp(ent->d_name, "..")) {
-            continue;
+        struct stat statbuf;
+        if (fstatat(dirfd, p, &statbuf, AT_SYMLINK_NOFOLLOW) != 0) {
+            die("Unable to stat '%s'", p);
         }
-        if (!strcmp(ent->d_name, ".username")) {
+        if (!S_ISREG(statbuf.st_mode)) {
             continue;
         }
-        if (!strcmp(ent->d_name, ".password")) {
-            continue;
+        unsigned long msgnum = strtoul(p, NULL, 10);
+        if ((msgnum < 1) || (msgnum > MAX_MESSAGES)) {
+            die("Message number '%s' out of range", p);
         }
-        if (!strcmp(ent->d_name, ".mailbox")) {
+        if (!statbuf.st_size) {
+debuglog("not uploading empty message '%s'", p);
             continue;
         }
-        return 0;
+        if (_pushcount >= MAX_MESSAGES) {
+            die("Too many messages");
+        }
+        grow_array(&_push, &_pushcapacity, _pushcount+1, sizeof(struct push_entry));
+        struct push_entry *entry = &_push[_pushcount++];
+        memset(entry, 0, sizeof(*entry));
+        entry->msgnum = msgnum;
+        entry->localsize = statbuf.st_size;
+        entry->internaldate = statbuf.st_mtime;
+        entry->flags = MESSAGE_SEEN;
     }
     closedir(dir);
-    return 1;
+    qsort(_push, _pushcount, sizeof(struct push_entry), compare_push_entries);
+
+    /* new messages are usually in the unseen sequence of inc */
+    unsigned long maxmsgnum = 0;
+    if (_pushcount) {
+        grow_array(&_msgnumflags, &_msgnumflagscapacity, _push[_pushcount-1].msgnum+1, sizeof(uint64_t *));
+    }
+    for (int i=0; i<_pushcount; i++) {
+        _msgnumflags[_push[i].msgnum] = &_push[i].flags;
+        maxmsgnum = _push[i].msgnum;
+    }
+    apply_mh_sequences(maxmsgnum);
+    for (int i=0; i<_pushcount; i++) {
+        _msgnumflags[_push[i].msgnum] = NULL;
+    }
 }
 
-static void imap_mh_download()
+static char *store_tag_status(char *str)
 {
-    if (!is_directory_empty_except_for_init(".")) {
-        die("Current directory is not empty (excluding .username .password .mailbox)");
+    char *p = string_prefix_endp(str, "store");
+    if (!p) {
+        p = string_prefix_endp(str, "expunge");
     }
+    if (!p) {
+        return NULL;
+    }
+    char *q = str_validchars_endchar(p, DIGITCHARS, ' ');
+    if (!q) {
+        return NULL;
+    }
+    return q+1;
+}
 
-    char usernamebuf[BUFSIZE];
-    char passwordbuf[BUFSIZE];
-    char mailboxbuf[BUFSIZE];
-    read_first_line_from_file(".username", usernamebuf);
-    read_first_line_from_file(".password", passwordbuf);
-    read_first_line_from_file(".mailbox", mailboxbuf);
-
-    _infp = stdin;
-    _outfp = stdout;
-
-    wait_for_initial_ok();
-
-    do_login(usernamebuf, passwordbuf);
-
-    do_enable_qresync();
-
-    write_string("select select %s\r\n", mailboxbuf);
-    for(;;) {
-        read_line();
-        if (string_prefix_endp(_buf, "select OK")) {
-            break;
-        }
-        if (string_prefix_endp(_buf, "select NO")
-         || string_prefix_endp(_buf, "select BAD"))
-        {
-            die("Unable to select mailbox %s '%s'", mailboxbuf, _buf);
-        }
-
-        char *p = string_prefix_endp(_buf, "* ");
-        if (p) {
-            char *q = str_validchars_endchar(p, DIGITCHARS, ' ');
-            if (q) {
-                if (!strcmp(q+1, "EXISTS\r\n")) {
-                    int num_exists = strtoul(p, NULL, 10);
-debuglog("num_exists %d", num_exists);
-                    continue;
-                }
-            }
-        }
-
-        p = string_prefix_endp(_buf, "* OK [UIDVALIDITY ");
-        if (p) {
-            char *q = strchr(p, ']');
-            if (q) {
-                *q = 0;
-debuglog("uidvalidity '%s'", p);
-                write_string_to_new_file(p, ".uidvalidity");
-                continue;
-            }
-        }
-        p = string_prefix_endp(_buf, "* OK [HIGHESTMODSEQ ");
-        if (p) {
-            char *q = strchr(p, ']');
-            if (q) {
-                *q = 0;
-debuglog("highestmodseq '%s'", p);
-                write_string_to_new_file(p, ".highestmodseq");
+/* Sends 'uid command set items' for the uids in set, a few commands in
+   flight at once, and waits for all of them */
+static void send_pipelined_uid_command(char *command, struct uid_set *set, char *items, int window)
+{
+    char rangebuf[SENDBUFSIZE/2];
+    unsigned long next = set->count ? set->ranges[0].first : 0;
+    int tagnum = 0;
+    int inflight = 0;
+    for(;;) {
+        while ((inflight < window) && next) {
+            next = uid_set_format(set, next, MAX_UID, rangebuf, sizeof(rangebuf));
+            tagnum++;
+            write_string("%s%d uid %s %s%s\r\n", command, tagnum, command, rangebuf, items);
+            inflight++;
+        }
+        if (!inflight) {
+            break;
+        }
+        read_line();
+        char *status = store_tag_status(_buf);
+        if (status) {
+            if (string_prefix_endp(status, "OK")) {
+                inflight--;
                 continue;
             }
+            die("Unable to uid %s '%s'", command, _buf);
         }
     }
-
-    do_fetch("1:*");
-
-    do_logout();
-
-    exit(0);
 }
 
-static void imap_mh_update()
+/* Marks the messages removed locally \Deleted and expunges only those
+   with UID EXPUNGE, which is sent once every store has completed */
+static void push_deletions(int dirfd)
 {
-    if (file_exists(".qresync")) {
-        die(".qresync already exists");
+    if (!_deleteset.count) {
+        return;
     }
-
-    int same_highestmodseq = 0;
-
-    char usernamebuf[BUFSIZE];
-    char passwordbuf[BUFSIZE];
-    char mailboxbuf[BUFSIZE];
-    char uidvaliditybuf[BUFSIZE];
-    char highestmodseqbuf[BUFSIZE];
-    read_first_line_from_file(".username", usernamebuf);
-    read_first_line_from_file(".password", passwordbuf);
-    read_first_line_from_file(".mailbox", mailboxbuf);
-    {
-        read_first_line_from_file(".uidvalidity", uidvaliditybuf);
-        char *q = str_validchars_endchar(uidvaliditybuf, DIGITCHARS, 0);
-        if (!q) {
-            die("Invalid .uidvalidity '%s'", uidvaliditybuf);
+    long startus = monotonic_microseconds();
+    int window = get_fetch_window();
+    send_pipelined_uid_command("store", &_deleteset, " +FLAGS.SILENT (\\Deleted)", window);
+    send_pipelined_uid_command("expunge", &_deleteset, "", window);
+debuglog("expunged %lu messages in %ld ms", uid_set_size(&_deleteset), (monotonic_microseconds() - startus)/1000);
+    /* the number may already belong to a new message, and the ',N' backup
+       that rmm leaves would only be a dangling symlink now */
+    for (int i=0; i<_indexcount; i++) {
+        struct index_record *rec = &_index[i];
+        if (!rec->msgnum || !uid_set_contains(&_deleteset, rec->uid)) {
+            continue;
         }
-        *q = 0;
-    }
-    {
-        read_first_line_from_file(".highestmodseq", highestmodseqbuf);
-        char *q = str_validchars_endchar(highestmodseqbuf, DIGITCHARS, 0);
-        if (!q) {
-            die("Invalid .highestmodseq '%s'", highestmodseqbuf);
+        char name[64];
+        char filename[64];
+        snprintf(filename, sizeof(filename), ".%lu", (unsigned long)rec->uid);
+        snprintf(name, sizeof(name), ",%lu", (unsigned long)rec->msgnum);
+        if (is_symlink_to(dirfd, name, filename)) {
+            unlinkat(dirfd, name, 0);
+        }
+        if (!is_symlink_to(dirfd, name+1, filename)) {
+            rec->msgnum = 0;
         }
-        *q = 0;
     }
+    index_remove_set(&_deleteset);
+}
 
-    _infp = stdin;
-    _outfp = stdout;
+/* Formats an INTERNALDATE such as '17-Jul-1996 09:44:25 +0000' */
+static void format_internaldate(int64_t internaldate, char *buf, int bufsize)
+{
+    static char *months[] = { "Jan", "Feb", "Mar", "Apr", "May", "Jun", "Jul", "Aug", "Sep", "Oct", "Nov", "Dec" };
+    time_t t = internaldate;
+    struct tm tm;
+    gmtime_r(&t, &tm);
+    snprintf(buf, bufsize, "%02d-%s-%04d %02d:%02d:%02d +0000",
+        tm.tm_mday, months[tm.tm_mon], tm.tm_year+1900, tm.tm_hour, tm.tm_min, tm.tm_sec);
+}
 
-    wait_for_initial_ok();
+static void format_message_flags(uint64_t flags, char *buf, int bufsize)
+{
+    snprintf(buf, bufsize, "%s%s%s",
+        (flags & MESSAGE_SEEN) ? "\\Seen " : "",
+        (flags & MESSAGE_FLAGGED) ? "\\Flagged " : "",
+        (flags & MESSAGE_ANSWERED) ? "\\Answered " : "");
+    int len = strlen(buf);
+    if (len) {
+        buf[len-1] = 0;
+    }
+}
 
-    do_login(usernamebuf, passwordbuf);
+static char *map_message_file(int dirfd, struct push_entry *entry)
+{
+    char name[64];
+    snprintf(name, sizeof(name), "%lu", entry->msgnum);
+    int fd = openat(dirfd, name, O_RDONLY);
+    if (fd < 0) {
+        die("Unable to open '%s'", name);
+    }
+    char *data = mmap(NULL, entry->localsize, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        die("Unable to map '%s'", name);
+    }
+    return data;
+}
 
-    do_enable_qresync();
+/* Sends the message data with LF turned into CRLF */
+static void send_message_data(char *data, uint64_t len)
+{
+    char *p = data;
+    char *endp = data + len;
+    int prevcr = 0;
+    while (p < endp) {
+        int n = 0;
+        while ((p < endp) && (n < SENDBUFSIZE-1)) {
+            if ((*p == '\n') && !prevcr) {
+                _sendbuf[n++] = '\r';
+            }
+            prevcr = (*p == '\r');
+            _sendbuf[n++] = *p++;
+        }
+        write_output(_sendbuf, n);
+    }
+}
 
-    FILE *qresyncfp = open_file_for_writing(".qresync");
-    if (!qresyncfp) {
-        die("Unable to open .qresync");
+static char *append_tag_status(char *str, int *tagnum)
+{
+    char *p = string_prefix_endp(str, "append");
+    if (!p) {
+        return NULL;
     }
+    char *q = str_validchars_endchar(p, DIGITCHARS, ' ');
+    if (!q) {
+        return NULL;
+    }
+    *tagnum = strtoul(p, NULL, 10);
+    return q+1;
+}
 
-    write_string("select select %s (qresync (%s %s))\r\n", mailboxbuf, uidvaliditybuf, highestmodseqbuf);
-    for(;;) {
-        read_line();
-        if (string_prefix_endp(_buf, "select OK")) {
-            break;
-        }
-        if (string_prefix_endp(_buf, "select NO")
-         || string_prefix_endp(_buf, "select BAD"))
-        {
-            die("Unable to select mailbox %s uidvalidity %s highestmodseq %s '%s'", mailboxbuf, uidvaliditybuf, highestmodseqbuf, _buf);
+static int _pushsent;
+static int _pushuploaded;
+static int _pushwithoutuid;
+
+/* The uploaded files take their uid from APPENDUID and become '.UID'
+   with a symlink from their number, like downloaded messages. Without
+   UIDPLUS the file is kept as ',N' and the next update downloads it. */
+static void finish_append(int dirfd, int tagnum, char *status, unsigned long uidvalidity)
+{
+    int lo = 0;
+    int hi = _pushsent;
+    while (lo < hi) {
+        int mid = lo + (hi-lo)/2;
+        if (_push[mid].tagnum < tagnum) {
+            lo = mid+1;
+        } else {
+            hi = mid;
         }
-        char *p = string_prefix_endp(_buf, "* ");
-        if (p) {
-            char *q = str_validchars_endchar(p, DIGITCHARS, ' ');
-            if (q) {
-                if (!strcmp(q+1, "EXISTS\r\n")) {
-                    int num_exists = strtoul(p, NULL, 10);
-debuglog("num_exists %d", num_exists);
-                    continue;
-                }
+    }
+    uid_set_clear(&_batchset);
+    unsigned long uid = 0;
+    char *p = strstr(status, "[APPENDUID ");
+    if (p && (strtoul(p+11, &p, 10) == uidvalidity) && (*p == ' ') && uid_set_parse(&_batchset, p+1, 0)) {
+        uid = _batchset.ranges[0].first;
+    }
+    for (int i=lo; (i<_pushsent) && (_push[i].tagnum == tagnum); i++) {
+        struct push_entry *entry = &_push[i];
+        char name[64];
+        char filename[64];
+        snprintf(name, sizeof(name), "%lu", entry->msgnum);
+        if (!uid) {
+            snprintf(filename, sizeof(filename), ",%lu", entry->msgnum);
+            if (renameat(dirfd, name, dirfd, filename) != 0) {
+                die("Unable to rename '%s' to '%s'", name, filename);
             }
+            _pushwithoutuid++;
+            continue;
         }
-        p = string_prefix_endp(_buf, "* OK [UIDVALIDITY ");
-        if (p) {
-            char *q = strchr(p, ']');
-            if (q) {
-                *q = 0;
-                if (strcmp(p, uidvaliditybuf) != 0) {
-                    die("UIDVALIDITY '%s' does not match .uidvalidity '%s', the mailbox may have changed", p, uidvaliditybuf);
-                }
-                fprintf(qresyncfp, "uidvalidity %s\n", p);
-                continue;
-            }
+        snprintf(filename, sizeof(filename), ".%lu", uid);
+        if (renameat(dirfd, name, dirfd, filename) != 0) {
+            die("Unable to rename '%s' to '%s'", name, filename);
         }
-        p = string_prefix_endp(_buf, "* OK [HIGHESTMODSEQ ");
-        if (p) {
-            char *q = strchr(p, ']');
-            if (q) {
-                *q = 0;
-                if (!strcmp(p, highestmodseqbuf)) {
-debuglog("HIGHESTMODSEQ '%s' is the same as before", p);
-                    same_highestmodseq = 1;
-                } else {
-                    fprintf(qresyncfp, "highestmodseq %s\n", p);
-                }
-                continue;
-            }
+        set_message_symlink(dirfd, entry->msgnum, uid);
+        struct index_record *rec = index_add(uid);
+        rec->size = entry->localsize;
+        rec->internaldate = entry->internaldate;
+        rec->msgnum = entry->msgnum;
+        rec->flags = entry->flags;
+        if (entry->msgnum > _indexmaxmsgnum) {
+            _indexmaxmsgnum = entry->msgnum;
         }
+        _pushuploaded++;
+        uid = uid_set_next(&_batchset, uid);
+    }
+}
 
-        p = strstr(_buf, " FETCH ");
-        if (p) {
-            p += 7;
+/* Uploads the new messages with several APPEND commands in flight. With
+   MULTIAPPEND a command carries up to PUSH_BATCH_MESSAGES messages, and
+   with LITERAL+ nothing waits for a continuation, so 1000 messages take
+   a few round trips instead of 1000. */
+static void push_additions(int dirfd, char *mailbox, unsigned long uidvalidity)
+{
+    if (!_pushcount) {
+        return;
+    }
+    long startus = monotonic_microseconds();
+    int literalplus = has_capability("LITERAL+");
+    int literalminus = has_capability("LITERAL-");
+    int batchmessages = has_capability("MULTIAPPEND") ? PUSH_BATCH_MESSAGES : 1;
+    int window = get_fetch_window();
+    _pushsent = 0;
+    _pushuploaded = 0;
+    _pushwithoutuid = 0;
+    uint64_t bytes = 0;
+    int pos = 0;
+    int tagnum = 0;
+    int inflight = 0;
+    for(;;) {
+        while ((inflight < window) && (pos < _pushcount)) {
+            tagnum++;
+            int count = 0;
+            unsigned long batchbytes = 0;
+            while ((pos < _pushcount) && (count < batchmessages)) {
+                struct push_entry *entry = &_push[pos];
+                if (count && (batchbytes + entry->localsize > FETCH_BATCH_BYTES)) {
+                    break;
+                }
+                char *data = map_message_file(dirfd, entry);
+                entry->size = crlf_message_size(data, entry->localsize);
+                entry->tagnum = tagnum;
 
-            char *uid_p = strstr(p, "UID ");
-            if (!uid_p) {
-debuglog("Error, 'UID ' not found");
-                continue;
-            }
-            uid_p += 4;
-            char *uid_endp = NULL;
-            strtoul(uid_p, &uid_endp, 10);
-            if (uid_p == uid_endp) {
-debuglog("Error, uid_endp not found");
-                continue;
+                char flagsbuf[64];
+                char datebuf[64];
+                format_message_flags(entry->flags, flagsbuf, sizeof(flagsbuf));
+                format_internaldate(entry->internaldate, datebuf, sizeof(datebuf));
+                int nonsync = literalplus || (literalminus && (entry->size <= MAX_NONSYNC_LITERAL));
+                if (!count) {
+                    write_string("append%d append %s (%s) \"%s\" {%lu%s}\r\n", tagnum, mailbox, flagsbuf, datebuf, (unsigned long)entry->size, nonsync ? "+" : "");
+                } else {
+                    /* not write_string(), the line has no tag of its own */
+                    int len = snprintf(_sendbuf, sizeof(_sendbuf), " (%s) \"%s\" {%lu%s}\r\n", flagsbuf, datebuf, (unsigned long)entry->size, nonsync ? "+" : "");
+                    write_output(_sendbuf, len);
+                }
+                if (!nonsync) {
+                    /* earlier commands may complete while waiting */
+                    for(;;) {
+                        read_line();
+                        if (string_prefix_endp(_buf, "+")) {
+                            break;
+                        }
+                        int donetagnum;
+                        char *status = append_tag_status(_buf, &donetagnum);
+                        if (status) {
+                            if (!string_prefix_endp(status, "OK")) {
+                                die("Unable to append '%s'", _buf);
+                            }
+                            finish_append(dirfd, donetagnum, status, uidvalidity);
+                            inflight--;
+                        }
+                    }
+                }
+                send_message_data(data, entry->localsize);
+                munmap(data, entry->localsize);
+                batchbytes += entry->localsize;
+                bytes += entry->size;
+                count++;
+                pos++;
+                _pushsent = pos;
             }
-            *uid_endp = 0;
-            fprintf(qresyncfp, "fetch %s\n", uid_p);
+            write_output("\r\n", 2);
+            inflight++;
         }
-
-        p = string_prefix_endp(_buf, "* VANISHED (EARLIER) ");
-        if (p) {
-            char *q = strchr(p, '\r');
-            if (q) {
-                *q = 0;
-                fprintf(qresyncfp, "vanished %s\n", p);
-                continue;
+        if (!inflight) {
+            break;
+        }
+        read_line();
+        int donetagnum;
+        char *status = append_tag_status(_buf, &donetagnum);
+        if (status) {
+            if (!string_prefix_endp(status, "OK")) {
+                die("Unable to append '%s'", _buf);
             }
+            finish_append(dirfd, donetagnum, status, uidvalidity);
+            inflight--;
         }
     }
-
-    fclose(qresyncfp);
-
-    if (!same_highestmodseq) {
-        process_qresync_fetch();
+    if (fsync(dirfd) != 0) {
+        die("Unable to fsync current directory");
     }
+debuglog("uploaded %d messages, %lu bytes in %d commands in %ld ms", _pushcount, (unsigned long)bytes, tagnum, (monotonic_microseconds() - startus)/1000);
+    if (_pushwithoutuid) {
+debuglog("server did not return APPENDUID, kept %d messages as ',N' until the next update", _pushwithoutuid);
+    }
+}
 
-    do_logout();
-
-    if (!same_highestmodseq) {
-        process_qresync_vanished();
-        process_qresync_highestmodseq();
-        unlink_message_symlinks();
+/* Sends the messages removed and added locally since the last update to
+   mailbox, on a connection that is logged in */
+static void push_folder(char *mailbox)
+{
+    char uidvaliditybuf[BUFSIZE];
+    read_first_line_from_file(".uidvalidity", uidvaliditybuf);
+    if (!str_validchars_endchar(uidvaliditybuf, DIGITCHARS, 0)) {
+        die("Invalid .uidvalidity '%s'", uidvaliditybuf);
+    }
+    unsigned long uidvalidity = strtoul(uidvaliditybuf, NULL, 10);
+    if (file_exists(".journal")) {
+        die("An update was interrupted, run 'imap-mh update' first");
     }
 
-    unlink(".qresync");
+    load_index();
+    int dirfd = open_current_directory();
+    find_local_deletions(dirfd);
+    find_local_additions(dirfd);
+debuglog("%lu messages removed and %d added locally", uid_set_size(&_deleteset), _pushcount);
+    if (!_deleteset.count && !_pushcount) {
+        close(dirfd);
+        return;
+    }
+    /* a plain EXPUNGE would also remove what other clients marked \Deleted */
+    if (_deleteset.count && !has_capability("UIDPLUS")) {
+        die("The server does not support UIDPLUS, unable to expunge only the %lu messages removed locally", uid_set_size(&_deleteset));
+    }
 
-    exit(0);
+    select_mailbox_with_uidvalidity(mailbox, uidvalidity);
+    mark_index_dirty();
+    push_deletions(dirfd);
+    push_additions(dirfd, mailbox, uidvalidity);
+    close(dirfd);
+    update_message_symlinks();
+    save_index();
 }
 
-static void imap_mh_idle()
+static void imap_mh_push()
 {
     char usernamebuf[BUFSIZE];
     char passwordbuf[BUFSIZE];
@@ -878,118 +6897,66 @@ static void imap_mh_idle()
     read_first_line_from_file(".username", usernamebuf);
     read_first_line_from_file(".password", passwordbuf);
     read_first_line_from_file(".mailbox", mailboxbuf);
-    _infp = stdin;
-    _outfp = stdout;
+
+    open_connection();
 
     wait_for_initial_ok();
 
     do_login(usernamebuf, passwordbuf);
 
-    write_string("select select %s\r\n", mailboxbuf);
-    for(;;) {
-        read_line();
-        if (string_prefix_endp(_buf, "select OK")) {
-            break;
-        }
-        if (string_prefix_endp(_buf, "select NO")
-         || string_prefix_endp(_buf, "select BAD"))
-        {
-            die("Unable to select mailbox %s '%s'", mailboxbuf, _buf);
-        }
-    }
-
-    write_string("idle idle\r\n");
-    for(;;) {
-        read_line();
-        if (string_prefix_endp(_buf, "+ ")) {
-            break;
-        }
-    }
-    for(;;) {
-        read_line();
-        char *p = string_prefix_endp(_buf, "* ");
-        if (p) {
-            char *q = str_validchars_endchar(p, DIGITCHARS, ' ');
-            if (q) {
-                if (!strcmp(q+1, "EXISTS\r\n")) {
-                    int num_exists = strtoul(p, NULL, 10);
-debuglog("num_exists %d", num_exists);
-                    break;
-                }
-            }
-        }
-    }
-
-    write_string("DONE\r\n");
-    for(;;) {
-        read_line();
-        if (string_prefix_endp(_buf, "idle OK")) {
-            break;
-        }
-        if (string_prefix_endp(_buf, "idle NO")
-         || string_prefix_endp(_buf, "idle BAD")) {
-            die("Somehow IDLE failed '%s'", _buf);
-        }
-    }
+    push_folder(mailboxbuf);
 
     do_logout();
 
     exit(0);
 }
 
-static char *input_password(char *buf)
-{
-    struct termios oldterm;
-    struct termios newterm;
-
-    tcgetattr(0, &oldterm);
-    newterm = oldterm;
-    newterm.c_lflag &= ~(ECHO);
-    tcsetattr(0, TCSANOW, &newterm);
-
-    char *result = fgets(buf, BUFSIZE, stdin);
-
-    tcsetattr(0, TCSANOW, &oldterm);
-
-    return result;
-}
-
-static void imap_mh_init()
+/* Reads '.loglevel' and '.metrics' in the directory imap-mh is run in */
+static void setup_logging()
 {
-    if (!is_directory_empty(".")) {
-        die("Current directory is not empty");
+    _metricsstartus = monotonic_microseconds();
+    if (file_exists(".loglevel")) {
+        char buf[BUFSIZE];
+        read_first_line_from_file(".loglevel", buf);
+        if (!strcmp(buf, "quiet")) {
+            _loglevel = LOG_QUIET;
+        } else if (!strcmp(buf, "info")) {
+            _loglevel = LOG_INFO;
+        } else if (!strcmp(buf, "trace")) {
+            _loglevel = LOG_TRACE;
+        } else {
+            die("Invalid .loglevel '%s', expecting 'quiet', 'info' or 'trace'", buf);
+        }
     }
-
-    char usernamebuf[BUFSIZE];
-    char passwordbuf[BUFSIZE];
-    char mailboxbuf[BUFSIZE];
-
-    printf("Enter IMAP username: ");
-    if (!fgets(usernamebuf, BUFSIZE, stdin)) {
-        die("Unable to read line");
+    if (!file_exists(".metrics")) {
+        return;
     }
-    chomp_string(usernamebuf);
-    printf("Enter IMAP password: ");
-    if (!input_password(passwordbuf)) {
-        die("Unable to read line");
+    char path[BUFSIZE];
+    read_first_line_from_file(".metrics", path);
+    if (path[0] == '/') {
+        strcpy(_metricspath, path);
+    } else {
+        char cwd[BUFSIZE];
+        if (!getcwd(cwd, sizeof(cwd))) {
+            die("Unable to get current directory");
+        }
+        snprintf(_metricspath, sizeof(_metricspath), "%s/%s", cwd, path);
     }
-    chomp_string(passwordbuf);
-    printf("\n");
-    printf("Enter IMAP mailbox: ");
-    if (!fgets(mailboxbuf, BUFSIZE, stdin)) {
-        die("Unable to read line");
+    _metrics = mmap(NULL, sizeof(struct metrics), PROT_READ|PROT_WRITE, MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+    if (_metrics == MAP_FAILED) {
+        die("Unable to map metrics");
     }
-    chomp_string(mailboxbuf);
-
-    write_string_to_new_file(usernamebuf, ".username");
-    write_string_to_new_file(passwordbuf, ".password");
-    write_string_to_new_file(mailboxbuf, ".mailbox");
-
-    exit(0);
+    _metricspid = getpid();
+    atexit(write_metrics);
 }
 
 int main(int argc, char **argv)
 {
+    setup_logging();
+    if ((argc >= 3) && string_prefix_endp(argv[argc-1], "tls:")) {
+        _tlsaddress = argv[argc-1];
+        argc--;
+    }
     if (argc == 2) {
         if (!strcmp(argv[1], "init")) {
             imap_mh_init();
@@ -997,23 +6964,80 @@ int main(int argc, char **argv)
         if (!strcmp(argv[1], "download")) {
             imap_mh_download();
         }
+        if (!strcmp(argv[1], "parallel-download")) {
+            imap_mh_parallel_download();
+        }
         if (!strcmp(argv[1], "update")) {
             imap_mh_update();
         }
+        if (!strcmp(argv[1], "sync")) {
+            imap_mh_sync();
+        }
         if (!strcmp(argv[1], "idle")) {
             imap_mh_idle();
         }
+        if (!strcmp(argv[1], "idle-sync")) {
+            imap_mh_idle_sync();
+        }
+        if (!strcmp(argv[1], "symlinks")) {
+            load_index();
+            update_message_symlinks();
+            save_index();
+            exit(0);
+        }
+        if (!strcmp(argv[1], "fsck")) {
+            rebuild_index();
+            save_index();
+            exit(0);
+        }
+        if (!strcmp(argv[1], "backfill")) {
+            imap_mh_backfill();
+        }
+        if (!strcmp(argv[1], "pack")) {
+            imap_mh_pack();
+        }
+        if (!strcmp(argv[1], "reconcile")) {
+            imap_mh_reconcile();
+        }
+        if (!strcmp(argv[1], "push")) {
+            imap_mh_push();
+        }
+    }
+    if (argc == 3) {
+        if (!strcmp(argv[1], "get")) {
+            imap_mh_get(argv[2]);
+        }
+        if (!strcmp(argv[1], "unpack")) {
+            imap_mh_unpack(argv[2]);
+        }
     }
     fprintf(stderr, "Usage:\n");
     fprintf(stderr, "imap-mh init\n");
     fprintf(stderr, "socat openssl:example.com:993 system:'imap-mh download'\n");
     fprintf(stderr, "socat openssl:example.com:993 system:'imap-mh update'\n");
     fprintf(stderr, "socat openssl:example.com:993 system:'imap-mh idle'\n");
+    fprintf(stderr, "socat openssl:example.com:993 system:'imap-mh idle-sync'\n");
+    fprintf(stderr, "socat openssl:example.com:993 system:'imap-mh get <msgnum|.uid>'\n");
+    fprintf(stderr, "socat openssl:example.com:993 system:'imap-mh backfill'\n");
+    fprintf(stderr, "socat openssl:example.com:993 system:'imap-mh reconcile'\n");
+    fprintf(stderr, "socat openssl:example.com:993 system:'imap-mh push'\n");
+    fprintf(stderr, "imap-mh parallel-download\n");
+    fprintf(stderr, "imap-mh sync\n");
+    fprintf(stderr, "imap-mh symlinks\n");
+    fprintf(stderr, "imap-mh fsck\n");
+    fprintf(stderr, "imap-mh pack\n");
+    fprintf(stderr, "imap-mh unpack <.uid>\n");
+    fprintf(stderr, "\n");
+    fprintf(stderr, "To connect without socat, add a tls: address to any of the socat commands:\n");
+    fprintf(stderr, "imap-mh download tls:example.com:993\n");
+    fprintf(stderr, "imap-mh get <msgnum|.uid> tls:example.com:993\n");
     fprintf(stderr, "\n");
     fprintf(stderr, "To disable certificate verification:\n");
     fprintf(stderr, "socat openssl:example.com:993,verify=0 system:'imap-mh download'\n");
     fprintf(stderr, "socat openssl:example.com:993,verify=0 system:'imap-mh update'\n");
     fprintf(stderr, "socat openssl:example.com:993,verify=0 system:'imap-mh idle'\n");
+    fprintf(stderr, "socat openssl:example.com:993,verify=0 system:'imap-mh idle-sync'\n");
+    fprintf(stderr, "imap-mh download tls:example.com:993,verify=0\n");
     return 0;
 }
 